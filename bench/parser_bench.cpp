@@ -0,0 +1,137 @@
+// Microbenchmark of DNS message parsing: in place DnsParser against the former per-byte parser
+// Build with -DDNS_SERVER_BUILD_BENCHMARKS=ON, run: parser_bench [iterations]
+
+#include "dnsmessage.hpp"
+#include "dnsparser.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+std::vector<char> makeQuery(const std::string& name, uint16_t id)
+{
+    std::vector<char> packet{static_cast<char>(id >> 8), static_cast<char>(id & 0xFF), 0x01, 0x00, 0x00, 0x01, 0, 0, 0, 0, 0, 0};
+    size_t start = 0;
+    while (start <= name.size())
+    {
+        size_t end = name.find('.', start);
+        if (end == std::string::npos)
+            end = name.size();
+        packet.push_back(static_cast<char>(end - start));
+        packet.insert(packet.end(), name.begin() + start, name.begin() + end);
+        start = end + 1;
+    }
+    packet.push_back(0);
+    packet.insert(packet.end(), {0x00, 0x01, 0x00, 0x01});
+    return packet;
+}
+
+std::vector<char> makeResponse(const std::string& name, uint16_t id)
+{
+    std::vector<char> packet = makeQuery(name, id);
+    packet[2] = static_cast<char>(0x81);
+    packet[3] = static_cast<char>(0x80);
+    packet[7] = 2;  // ANCOUNT
+    for (uint8_t last : {4, 5})
+        packet.insert(packet.end(), {static_cast<char>(0xC0), 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2C, 0x00, 0x04,
+                                     1, 2, 3, static_cast<char>(last)});
+    return packet;
+}
+
+// question parsing as it was done before DnsParser: name appended to std::string byte by byte, no bounds checks
+struct LegacyQuestion
+{
+    uint16_t id;
+    std::string qName;
+    uint16_t qType;
+    uint16_t qClass;
+};
+
+uint16_t legacyRead16(const char*& buffer)
+{
+    uint16_t result = static_cast<unsigned char>(buffer[0]);
+    result <<= 8;
+    result += static_cast<unsigned char>(buffer[1]);
+    buffer += 2;
+    return result;
+}
+
+LegacyQuestion legacyParse(const char* packet)
+{
+    LegacyQuestion question;
+    question.id = legacyRead16(packet);
+    packet += DNSHeader::headerOffset - 2;
+    int labelLength = *packet++;
+    while (labelLength != 0)
+    {
+        for (int i = 0; i < labelLength; i++)
+        {
+            char c = *packet++;
+            question.qName.append(1, c);
+        }
+        labelLength = *packet++;
+        if (labelLength != 0)
+            question.qName.append(1, '.');
+    }
+    question.qType = legacyRead16(packet);
+    question.qClass = legacyRead16(packet);
+    return question;
+}
+
+template<typename F>
+void run(const char* title, const std::vector<std::vector<char>>& packets, size_t iterations, F&& parse)
+{
+    uint64_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        const std::vector<char>& packet = packets[i % packets.size()];
+        checksum += parse(packet.data(), static_cast<int>(packet.size()));
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    std::printf("%-32s %8.1f ns/op  (checksum %llu)\n", title, static_cast<double>(elapsed.count()) / iterations,
+                static_cast<unsigned long long>(checksum));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    const size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 5000000;
+    const std::vector<std::string> names{
+        "a.io", "example.com", "www.example.com", "mail.google.com",
+        "cdn-123.edge.static.some-long-provider-name.net", "a.b.c.d.e.f.g.h.i.j.k.example.org"};
+    std::vector<std::vector<char>> queries, responses;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        queries.push_back(makeQuery(names[i], static_cast<uint16_t>(i + 1)));
+        responses.push_back(makeResponse(names[i], static_cast<uint16_t>(i + 1)));
+    }
+
+    run("legacy query parse", queries, iterations, [](const char* packet, int) {
+        const LegacyQuestion question = legacyParse(packet);
+        return question.qName.size() + question.qType;
+    });
+    run("DnsParser question", queries, iterations, [](const char* packet, int size) {
+        DnsParser parser(packet, size);
+        DnsName name;
+        uint16_t type = 0, qClass = 0;
+        char text[MAX_NAME_TEXT_LENGTH];
+        return parser.readQuestion(name, type, qClass) ? parser.nameText(name, text) + type : 0;
+    });
+    run("DNSQuery", queries, iterations, [](const char* packet, int size) {
+        const DNSQuery query(packet, size);
+        return query.getData().qName.size() + query.getData().qType;
+    });
+    run("DNSResponse", responses, iterations / 4, [](const char* packet, int size) {
+        const DNSResponse response(DNSHeader::NoError, packet, size);
+        return response.getData().rData.size();
+    });
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Microbenchmark of ThreadPool schedulers: global queue against per-worker work stealing, 1 to 64 threads
+// Build with -DDNS_SERVER_BUILD_BENCHMARKS=ON, run: pool_bench [tasks]
+
+#include "threadpool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+
+namespace
+{
+
+inline constexpr unsigned TASK_WORK = 200;  // iterations of dummy work per task, about a cache hit of a request
+inline constexpr unsigned SPAWN_FANOUT = 4;
+
+std::atomic<uint64_t> checksum{0};
+
+void work(uint64_t seed)
+{
+    uint64_t value = seed;
+    for (unsigned i = 0; i < TASK_WORK; ++i)
+        value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+    checksum.fetch_add(value & 0xFF, std::memory_order_relaxed);
+}
+
+void waitFor(const std::atomic<uint64_t>& done, uint64_t count)
+{
+    while (done.load(std::memory_order_acquire) < count)
+        std::this_thread::yield();
+}
+
+// requests submitted from a single receive thread, as the server does
+double external(ThreadPool& pool, uint64_t tasks)
+{
+    std::atomic<uint64_t> done{0};
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < tasks; ++i)
+    {
+        while (!pool.submit([i, &done]() {
+            work(i);
+            done.fetch_add(1, std::memory_order_release);
+        }))
+            std::this_thread::yield();  // queue is full, wait for workers
+    }
+    waitFor(done, tasks);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// tasks that submit more tasks from the workers, every one spawns SPAWN_FANOUT children up to the depth
+void spawn(ThreadPool& pool, std::atomic<uint64_t>& done, unsigned depth, uint64_t seed)
+{
+    work(seed);
+    for (unsigned i = 0; depth > 0 && i < SPAWN_FANOUT; ++i)
+    {
+        const uint64_t childSeed = seed * SPAWN_FANOUT + i;
+        // queue is full: child runs here, workers waiting for free space would never take anything from it
+        if (!pool.submit([&pool, &done, depth, childSeed]() { spawn(pool, done, depth - 1, childSeed); }))
+            spawn(pool, done, depth - 1, childSeed);
+    }
+    done.fetch_add(1, std::memory_order_release);
+}
+
+double nested(ThreadPool& pool, uint64_t tasks, uint64_t& count)
+{
+    // full tree with about the requested number of tasks
+    unsigned depth = 0;
+    count = 1;
+    for (uint64_t level = SPAWN_FANOUT; count + level <= tasks; level *= SPAWN_FANOUT)
+    {
+        count += level;
+        ++depth;
+    }
+    std::atomic<uint64_t> done{0};
+    const auto start = std::chrono::steady_clock::now();
+    while (!pool.submit([&pool, &done, depth]() { spawn(pool, done, depth, 1); }))
+        std::this_thread::yield();
+    waitFor(done, count);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    const uint64_t tasks = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::printf("%-8s %-10s %16s %16s\n", "threads", "scheduler", "external Mtask/s", "nested Mtask/s");
+    for (unsigned threads = 1; threads <= 64; threads *= 2)
+    {
+        for (SchedulerType scheduler : {SchedulerType::GlobalQueue, SchedulerType::WorkStealing})
+        {
+            ThreadPool pool(threads, std::chrono::microseconds(50), THREAD_POOL_QUEUE_CAPACITY, scheduler);
+            uint64_t nestedCount = 0;
+            const double externalTime = external(pool, tasks);
+            const double nestedTime = nested(pool, tasks, nestedCount);
+            std::printf("%-8u %-10s %16.2f %16.2f\n", threads, scheduler == SchedulerType::GlobalQueue ? "global" : "stealing",
+                        tasks / externalTime / 1e6, nestedCount / nestedTime / 1e6);
+        }
+    }
+    std::printf("(checksum %llu)\n", static_cast<unsigned long long>(checksum.load()));
+    return 0;
+}
@@ -1,11 +1,72 @@
 #include "dnscache.hpp"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include "dnsmessage.hpp"
 #include "logger.hpp"
 
 
-DnsCache::DnsCache(const std::string& cacheFileName)
+namespace
 {
+
+std::atomic<uint64_t> nextCacheId{1};
+
+/// lookups of the calling thread, not recorded to the sketches yet
+struct AccessBuffer
+{
+    uint64_t cacheId = 0;
+    uint64_t started = 0;  // in sec of DnsCache::getCurrentTimestamp
+    size_t count = 0;
+    std::array<uint64_t, ACCESS_BUFFER_SIZE> hashes;
+};
+
+thread_local AccessBuffer accessBuffer;
+
+}  // namespace
+
+DnsEntry DnsEntry::fromString(const std::string& address, uint64_t lastUpdated, bool preloaded) noexcept
+{
+    DnsEntry entry;
+    entry.lastUpdated = lastUpdated;
+    entry.preloaded = preloaded;
+    if (inet_pton(AF_INET, address.c_str(), entry.address.data()) == 1)
+        entry.addressLength = 4;
+    else if (inet_pton(AF_INET6, address.c_str(), entry.address.data()) == 1)
+        entry.addressLength = 16;
+    return entry;
+}
+
+std::string DnsEntry::addressToString() const
+{
+    char addressStr[INET6_ADDRSTRLEN];
+    if (addressLength == 0 || !inet_ntop(addressLength == 4 ? AF_INET : AF_INET6, address.data(), addressStr, sizeof (addressStr)))
+        return std::string();
+    return addressStr;
+}
+
+
+DnsCache::DnsCache(const std::string& cacheFileName, const CacheConfig& config) :
+    shardMask(config.shards - 1), cacheId(nextCacheId.fetch_add(1, std::memory_order_relaxed)), minTtl(config.minTtl), maxTtl(config.maxTtl),
+    maxNegativeTtl(config.maxNegativeTtl), servfailTtl(config.servfailTtl),
+    prefetchPercent(config.prefetchPercent), staleTime(config.staleTime)
+{
+    if (config.shards < 1 || config.shards > MAX_CACHE_SHARDS || (config.shards & shardMask) != 0)
+        throw std::runtime_error("Invalid cache shards number, should be power of 2 in range [1, " + std::to_string(MAX_CACHE_SHARDS) + "]");
+    if (config.minTtl > config.maxTtl)
+        throw std::runtime_error("Invalid cache TTL bounds, min TTL is greater than max TTL");
+    if (config.prefetchPercent >= 100)
+        throw std::runtime_error("Invalid cache prefetch percent, should be less than 100");
+    // don't let budget round down to 0, that means no limit
+    const size_t shardBytes = config.maxBytes ? std::max<size_t>(config.maxBytes / config.shards, 1) : 0;
+    const size_t shardEntries = config.maxEntries ? std::max<size_t>(config.maxEntries / config.shards, 1) : 0;
+    for (unsigned i = 0; i < config.shards; ++i)
+        shards.push_back(std::make_unique<Shard>(epochs, shardBytes, shardEntries));
+
     this->cacheFileName = cacheFileName;
     cacheFile.open(this->cacheFileName, std::ios::in);
     if (!cacheFile.is_open())
@@ -38,38 +99,318 @@ DnsCache::DnsCache(const std::string& cacheFileName)
             }
             std::string addrStr = line.substr(0, addrPos);
             std::string domainStr = line.substr(domainPos, line.size());
-            cache.emplace(domainStr, DnsEntry{addrStr, timestamp, true});
+            DnsEntry entry = DnsEntry::fromString(addrStr, timestamp, true);
+            entry.ttl = TIMEOUT_TIME;
+            if (entry.addressLength == 0 || domainStr.size() > MAX_CACHED_NAME_LENGTH)
+            {
+                cacheFile.close();
+                throw std::runtime_error("failed to read dns cache file entry: " + line);
+            }
+            // precompile the answer, so hosts entries are served as forwarded ones
+            const QueryData question{domainStr, static_cast<uint16_t>(entry.addressLength == 4 ? 0x01 : 0x1C), 0x01};
+            char responseBuffer[MAX_CACHE_KEY_LENGTH + 64];
+            const int size = DNSResponse(DNSHeader::RCode::NoError, question, 0, entry).write(responseBuffer, sizeof (responseBuffer), &entry.ttlOffsets);
+            entry.response.assign(responseBuffer, responseBuffer + size);
+            updateOrInsertEntry(question.qName, question.qType, question.qClass, entry);
         }
     }
     cacheFile.close();
-    Logger::logToStdout("DnsCache created");
+    const auto [entries, bytes] = getUsage();
+    Logger::logToStdout("DnsCache created, entries: " + std::to_string(entries) + ", memory: " + std::to_string(bytes) + " bytes");
+    expiryThread = std::thread(&DnsCache::expireEntries, this);
 }
 
 DnsCache::~DnsCache()
 {
+    {
+        std::lock_guard<std::mutex> lk(expiryMutex);
+        stopExpiry = true;
+    }
+    expiryCondition.notify_one();
+    if (expiryThread.joinable())
+        expiryThread.join();
+
     // save cache to hosts file
     if (saveOnExit)
         saveCacheToFile();
     Logger::logToStdout("DnsCache destroyed");
 }
 
-DnsEntry DnsCache::lookupEntry(const std::string &name) const noexcept
+std::string_view DnsCache::makeKey(std::string_view name, uint16_t type, uint16_t qClass, char* keyBuffer) noexcept
+{
+    std::transform(name.begin(), name.end(), keyBuffer, [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    char* typeClass = keyBuffer + name.size();
+    typeClass[0] = static_cast<char>(type >> 8);
+    typeClass[1] = static_cast<char>(type & 0xFF);
+    typeClass[2] = static_cast<char>(qClass >> 8);
+    typeClass[3] = static_cast<char>(qClass & 0xFF);
+    return std::string_view(keyBuffer, name.size() + 4);
+}
+
+template<typename F>
+int DnsCache::readEntry(std::string_view name, uint16_t type, uint16_t qClass, F&& reader) const noexcept
+{
+    if (name.size() > MAX_CACHED_NAME_LENGTH)
+        return 0;
+    char keyBuffer[MAX_CACHE_KEY_LENGTH];
+    const std::string_view key = makeKey(name, type, qClass, keyBuffer);
+    const uint64_t hash = hashKey(key);
+    const Shard& shard = shardFor(hash);
+    const uint64_t currentTime = getCurrentTimestamp();
+    recordAccess(hash, currentTime);
+
+    EpochManager::Guard guard(epochs);
+    std::shared_lock lk(shard.sharedMutex, std::defer_lock);
+    if (!guard.active())
+        lk.lock();  // too many threads to track, fall back to locking
+    const DnsEntry* entry = shard.entries.find(key, hash);
+    return entry ? reader(*entry, currentTime, hash, shard) : 0;
+}
+
+void DnsCache::recordAccess(uint64_t hash, uint64_t currentTime) const noexcept
+{
+    AccessBuffer& buffer = accessBuffer;
+    if (buffer.cacheId != cacheId || buffer.count == 0)
+    {
+        buffer.cacheId = cacheId;
+        buffer.started = currentTime;
+        buffer.count = 0;
+    }
+    buffer.hashes[buffer.count++] = hash;
+    if (buffer.count < ACCESS_BUFFER_SIZE && buffer.started == currentTime)
+        return;
+
+    // lookups of the same shard are recorded under one lock
+    const auto shardIndex = [this](uint64_t h) { return (h >> 54) & shardMask; };
+    const auto end = buffer.hashes.begin() + buffer.count;
+    std::sort(buffer.hashes.begin(), end, [&shardIndex](uint64_t lhs, uint64_t rhs) { return shardIndex(lhs) < shardIndex(rhs); });
+    for (auto first = buffer.hashes.begin(); first != end;)
+    {
+        const auto last = std::find_if(first, end, [&](uint64_t h) { return shardIndex(h) != shardIndex(*first); });
+        const Shard& shard = shardFor(*first);
+        std::unique_lock<std::shared_mutex> lk(shard.sharedMutex, std::try_to_lock);
+        for (auto it = first; lk.owns_lock() && it != last; ++it)
+            shard.policy.recordAccess(*it);
+        first = last;
+    }
+    buffer.count = 0;
+}
+
+int DnsCache::writeResponse(const DnsEntry& entry, std::string_view name, uint16_t id, bool recursionDesired, uint32_t ttl,
+                            char* buffer, int bufferSize) noexcept
+{
+    // answer larger than the client can receive is cut to the question with TC set, so client retries over TCP
+    const int questionEnd = DNSHeader::headerOffset + static_cast<int>(name.size()) + (name.empty() ? 1 : 2) + 4;
+    const int responseSize = static_cast<int>(entry.response.size());
+    const bool truncated = responseSize > bufferSize;
+    const int size = truncated ? questionEnd : responseSize;
+    if (size > bufferSize || responseSize < questionEnd)
+        return 0;
+
+    std::memcpy(buffer, entry.response.data(), size);
+    buffer[0] = static_cast<char>(id >> 8);
+    buffer[1] = static_cast<char>(id & 0xFF);
+    buffer[2] = static_cast<char>((buffer[2] & ~(DNSHeader::mask_rd >> 8)) | (recursionDesired ? DNSHeader::mask_rd >> 8 : 0));
+    if (truncated)
+        DNSResponse::truncate(buffer, size);
+    else
+    {
+        for (uint16_t offset : entry.ttlOffsets)
+        {
+            buffer[offset] = static_cast<char>(ttl >> 24);
+            buffer[offset + 1] = static_cast<char>(ttl >> 16);
+            buffer[offset + 2] = static_cast<char>(ttl >> 8);
+            buffer[offset + 3] = static_cast<char>(ttl);
+        }
+    }
+    // echo question name as client sent it, label lengths are at the dots positions
+    for (size_t i = 0; i < name.size(); ++i)
+        if (name[i] != '.')
+            buffer[DNSHeader::headerOffset + 1 + i] = name[i];
+    return size;
+}
+
+int DnsCache::readResponse(std::string_view name, uint16_t type, uint16_t qClass, uint16_t id, bool recursionDesired,
+                           char* buffer, int bufferSize, bool* prefetch) const noexcept
+{
+    return readEntry(name, type, qClass, [&](const DnsEntry& entry, uint64_t currentTime, uint64_t hash, const Shard& shard) {
+        if (entry.preloaded)
+            return writeResponse(entry, name, id, recursionDesired, entry.ttl, buffer, bufferSize);
+        // cache entry time-outed, it's kept only to be served stale
+        if (currentTime >= entry.lastUpdated + entry.ttl)
+            return 0;
+
+        const uint32_t ttl = static_cast<uint32_t>(entry.lastUpdated + entry.ttl - currentTime);
+        // refresh popular entry before it expires, only the first lookup that claims it starts the refresh
+        if (prefetch && uint64_t(ttl) * 100 <= uint64_t(entry.ttl) * prefetchPercent
+            && shard.policy.frequency(hash) >= PREFETCH_MIN_FREQUENCY)
+        {
+            std::atomic_ref<uint64_t> claim(entry.prefetchDeadline);
+            uint64_t deadline = claim.load(std::memory_order_relaxed);
+            if (currentTime >= deadline && claim.compare_exchange_strong(deadline, currentTime + PREFETCH_RETRY_TIME, std::memory_order_relaxed))
+                *prefetch = true;
+        }
+        return writeResponse(entry, name, id, recursionDesired, ttl, buffer, bufferSize);
+    });
+}
+
+int DnsCache::readStaleResponse(std::string_view name, uint16_t type, uint16_t qClass, uint16_t id, bool recursionDesired,
+                                char* buffer, int bufferSize) const noexcept
+{
+    return readEntry(name, type, qClass, [&](const DnsEntry& entry, uint64_t currentTime, uint64_t, const Shard&) {
+        const uint64_t expiresAt = entry.lastUpdated + entry.ttl;
+        if (entry.preloaded || currentTime < expiresAt)
+            return writeResponse(entry, name, id, recursionDesired, entry.preloaded ? entry.ttl : static_cast<uint32_t>(expiresAt - currentTime),
+                                 buffer, bufferSize);
+        if (currentTime >= expiresAt + staleTime)
+            return 0;
+        return writeResponse(entry, name, id, recursionDesired, STALE_ANSWER_TTL, buffer, bufferSize);
+    });
+}
+
+void DnsCache::updateOrInsertEntry(std::string_view name, uint16_t type, uint16_t qClass, const DnsEntry& entry) noexcept
 {
-    std::shared_lock lk(sharedMutex);
-    auto entryIt = cache.find(name);
-    return entryIt == cache.end() ? DnsEntry() : entryIt->second;
+    if (name.size() > MAX_CACHED_NAME_LENGTH || entry.isEmpty())
+        return;
+    char keyBuffer[MAX_CACHE_KEY_LENGTH];
+    if (entry.preloaded)
+        return insertEntry(makeKey(name, type, qClass, keyBuffer), entry);
+
+    DnsEntry clampedEntry = entry;
+    if (entry.rcode == DNSHeader::ServerFail)
+        clampedEntry.ttl = servfailTtl;
+    else if (entry.negative)  // negative answer without SOA has TTL 0 and is not cached
+        clampedEntry.ttl = entry.ttl == 0 ? 0 : std::clamp(entry.ttl, minTtl, std::max(minTtl, std::min(maxTtl, maxNegativeTtl)));
+    else
+        clampedEntry.ttl = std::clamp(entry.ttl, minTtl, maxTtl);
+    if (clampedEntry.ttl == 0)
+        return;
+    insertEntry(makeKey(name, type, qClass, keyBuffer), clampedEntry);
+}
+
+size_t DnsCache::entryCost(std::string_view key, const DnsEntry& entry) noexcept
+{
+    return sizeof (DnsEntry) + entry.response.capacity() + entry.ttlOffsets.capacity() * sizeof (uint16_t) + key.size()
+        + FlatTable<DnsEntry>::slotBytes() + TimerWheel<uint64_t>::timerBytes();
+}
+
+void DnsCache::insertEntry(std::string_view key, const DnsEntry& entry) noexcept
+{
+    const uint64_t hash = hashKey(key);
+    Shard& shard = shardFor(hash);
+    std::lock_guard<std::shared_mutex> lk(shard.sharedMutex);
+    try
+    {
+        // timer of the replaced version is taken over, so every entry has at most one
+        const DnsEntry* previous = shard.entries.find(key, hash);
+        uint32_t timer = previous ? previous->expiryTimer : NO_TIMER;
+        const DnsEntry& stored = shard.entries.insertOrAssign(key, hash, entry);
+        const size_t cost = entryCost(key, stored);
+        if (entry.preloaded)
+        {
+            if (timer != NO_TIMER)
+                shard.expirations.cancel(timer);
+            stored.expiryTimer = NO_TIMER;
+            shard.preloadedBytes += cost;
+            return;
+        }
+        // expired entry is kept for stale time
+        const uint64_t expiresAt = entry.lastUpdated + entry.ttl + staleTime;
+        if (timer == NO_TIMER)
+            timer = shard.expirations.schedule(expiresAt, hash);
+        else
+            shard.expirations.reschedule(timer, expiresAt);
+        stored.expiryTimer = timer;
+        shard.policy.insert(hash, cost);
+        shard.policy.evict([&shard](uint64_t victim) {
+            shard.entries.eraseIf(victim, [&shard](const DnsEntry& entry) {
+                if (entry.preloaded)
+                    return false;
+                shard.expirations.cancel(entry.expiryTimer);
+                return true;
+            });
+        });
+    } catch (std::bad_alloc& e) {
+        Logger::logToStdout("DnsCache failed to allocate memory for entry: " + std::string(key.substr(0, key.size() - 4)));
+    }
 }
 
-void DnsCache::updateOrInsertEntry(const std::string &name,
-                                   const DnsEntry &entry) noexcept
+void DnsCache::expireEntries() noexcept
 {
-    std::lock_guard<std::shared_mutex> lk(sharedMutex);
-    cache[name] = entry;
+    std::unique_lock<std::mutex> lk(expiryMutex);
+    uint64_t lastStatsLogTime = getCurrentTimestamp();
+    uint64_t lastLoggedEvictions = 0;
+    while (!expiryCondition.wait_for(lk, std::chrono::seconds(CACHE_EXPIRY_INTERVAL), [this] { return stopExpiry; }))
+    {
+        const uint64_t currentTime = getCurrentTimestamp();
+        for (auto& shard : shards)
+        {
+            std::lock_guard<std::shared_mutex> shardLk(shard->sharedMutex);
+            // updates move the timer with the entry, so the entry of the fired one has expired,
+            // unless it shares the hash with another entry, that gets own timer then
+            shard->expirations.advance(currentTime, [this, &shard, currentTime](uint64_t hash) {
+                const size_t erased = shard->entries.eraseIf(hash, [this, &shard, currentTime, hash](const DnsEntry& entry) {
+                    if (entry.preloaded)
+                        return false;
+                    const uint64_t expiresAt = entry.lastUpdated + entry.ttl + staleTime;
+                    if (currentTime >= expiresAt)
+                        return true;
+                    entry.expiryTimer = shard->expirations.schedule(expiresAt, hash);
+                    return false;
+                });
+                if (erased != 0)
+                    shard->policy.erase(hash);
+            });
+        }
+
+        if (currentTime < lastStatsLogTime + CACHE_STATS_LOG_INTERVAL)
+            continue;
+        lastStatsLogTime = currentTime;
+        const uint64_t evictions = getEvictions();
+        if (evictions == lastLoggedEvictions)
+            continue;  // nothing new to report
+        lastLoggedEvictions = evictions;
+        try
+        {
+            const auto [entries, bytes] = getUsage();
+            const std::string logMsg("DnsCache stats: entries: " + std::to_string(entries) + ", memory: " + std::to_string(bytes)
+                                     + " bytes, evicted entries: " + std::to_string(evictions));
+            Logger::logInfo(logMsg);
+            Logger::logToStdout(logMsg);
+        } catch (std::exception& e) {
+            Logger::logToStdout(std::string("DnsCache Error logging stats: ") + e.what());
+        }
+    }
 }
 
 uint64_t DnsCache::getCurrentTimestamp() noexcept
 {
-    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+    return time.tv_sec;
+}
+
+std::pair<size_t, size_t> DnsCache::getUsage() const noexcept
+{
+    size_t entries = 0, bytes = 0;
+    for (const auto& shard : shards)
+    {
+        std::shared_lock lk(shard->sharedMutex);
+        entries += shard->entries.size();
+        bytes += shard->policy.chargedBytes() + shard->preloadedBytes;
+    }
+    return {entries, bytes};
+}
+
+uint64_t DnsCache::getEvictions() const noexcept
+{
+    uint64_t evictions = 0;
+    for (const auto& shard : shards)
+    {
+        std::shared_lock lk(shard->sharedMutex);
+        evictions += shard->policy.evicted();
+    }
+    return evictions;
 }
 
 void DnsCache::saveCacheToFile()
@@ -82,10 +423,14 @@ void DnsCache::saveCacheToFile()
         Logger::logToStdout(logMsg);
         return;
     }
-    std::shared_lock lk(sharedMutex);
-    for (const auto& entry : cache)
-        cacheFile << entry.second.address << ' ' << entry.first << std::endl;
-    lk.unlock();
+    for (const auto& shard : shards)
+    {
+        std::shared_lock lk(shard->sharedMutex);
+        shard->entries.forEach([this](std::string_view key, const DnsEntry& entry) {
+            if (entry.addressLength != 0)
+                cacheFile << entry.addressToString() << ' ' << key.substr(0, key.size() - 4) << std::endl;
+        });
+    }
     cacheFile.close();
 
     const std::string logMsg("DNS cache written to file: " + cacheFileName);
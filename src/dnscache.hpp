@@ -1,47 +1,178 @@
 #pragma once
 
-#include <map>
+#include "evictionpolicy.hpp"
+#include "flattable.hpp"
+#include "timerwheel.hpp"
+#include <array>
+#include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <shared_mutex>
 #include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
 
- // in sec
+ // in sec, TTL of answers from hosts file
 inline constexpr int TIMEOUT_TIME = 60;
+inline constexpr int CACHE_EXPIRY_INTERVAL = 1;  // in sec, tick of expiry timer wheels
+inline constexpr int CACHE_STATS_LOG_INTERVAL = 10;  // in sec
+inline constexpr unsigned MAX_CACHE_SHARDS = 1024;
+inline constexpr size_t MAX_CACHED_NAME_LENGTH = 255;
+inline constexpr size_t MAX_CACHE_KEY_LENGTH = MAX_CACHED_NAME_LENGTH + 4;  // name, type and class
+inline constexpr uint32_t STALE_ANSWER_TTL = 30;  // in sec, TTL of expired answers served on upstream failure, RFC 8767
+inline constexpr uint8_t PREFETCH_MIN_FREQUENCY = 3;  // recent lookups of an entry, that make it worth refreshing
+inline constexpr uint32_t PREFETCH_RETRY_TIME = 10;  // in sec, refresh that didn't replace the entry by then is claimed again
+inline constexpr size_t ACCESS_BUFFER_SIZE = 64;  // lookups a thread collects before recording them in shard sketches
 
+/// runtime options of the cache, set from command line
+struct CacheConfig
+{
+    // number of independent parts of the cache, each with its own lock and table, power of 2
+    unsigned shards = 16;
+    // bounds for TTL of cached answers, in sec. Answers with TTL 0 are not cached
+    uint32_t minTtl = 0;
+    uint32_t maxTtl = 86400;
+    // budget of cached answers, split evenly between shards, 0 means no limit. Hosts file entries are not counted
+    size_t maxBytes = 64 * 1024 * 1024;
+    size_t maxEntries = 0;
+    // popular entries are refreshed in background, when this percent of their TTL remains. 0 disables prefetch
+    unsigned prefetchPercent = 10;
+    // bound for TTL of cached NXDOMAIN and NODATA answers, in sec
+    uint32_t maxNegativeTtl = 3600;
+    // how long SERVFAIL from Forward Server is replayed, in sec. 0 disables caching of failures
+    uint32_t servfailTtl = 5;
+    // how long expired entries are kept to answer when Forward Server fails, in sec. 0 disables serve-stale
+    uint32_t staleTime = 86400;
+};
+
+/// cached answer to one question, kept as encoded response, that is sent after patching few fields
 struct DnsEntry
 {
     bool isEmpty() const noexcept
     {
-        return address.empty();
+        return response.empty();
     }
 
-    std::string address;
-    uint64_t lastUpdated;
+    // entry with IPv4 or IPv6 address in text form and no response, address is empty if it is invalid
+    static DnsEntry fromString(const std::string& address, uint64_t lastUpdated, bool preloaded) noexcept;
+    std::string addressToString() const;
+
+    std::array<uint8_t, 16> address{};  // first answer address in network byte order, saved to hosts file
+    uint8_t addressLength = 0;  // 4 for IPv4, 16 for IPv6
     bool preloaded = false;
+    uint64_t lastUpdated = 0;  // by DnsCache::getCurrentTimestamp
+    uint32_t ttl = 0;  // in sec, preloaded entries don't expire
+    // NXDOMAIN, NODATA or SERVFAIL answer
+    bool negative = false;
+    uint8_t rcode = 0;
+    // claimed by the lookup that starts background refresh of this version until the time,
+    // so it's refreshed once, and a failed or lost refresh is retried by a later lookup
+    mutable uint64_t prefetchDeadline = 0;
+    // expiration timer in the shard wheel, moved to every new version and cancelled on eviction. Writers only
+    mutable uint32_t expiryTimer = NO_TIMER;
+    std::vector<char> response;  // wire format with zero id
+    std::vector<uint16_t> ttlOffsets;  // positions of record TTLs in the response
 };
 
 
+/*
+    Domain name cache, split into shards by name hash
+    Every shard has its own lock and table, so writers block only readers of the same shard,
+    and shards don't share cache lines. Shard table is open-addressing flat table with names interned in the shard arena.
+    Lookups take no lock: readers enter an epoch, writers publish new entry versions with atomic pointer swaps
+    and old versions are reclaimed after all readers have left the epoch.
+    Entries live for TTL of the answer, popular ones are refreshed before they expire.
+    Expired entries are kept for stale time to answer when Forward Server fails,
+    then expiry thread erases them by hierarchical timer wheel of every shard.
+    Size of every entry is charged to the shard budget, when it's exceeded the eviction policy chooses entries to drop,
+    lookups feed its frequency sketch, so names seen once can't push out the popular ones.
+    Lookups are buffered per thread and recorded in batches under the shard lock, so hits don't write shared memory
+*/
 class DnsCache
 {
-    std::map<std::string, DnsEntry> cache;
-    mutable std::shared_mutex sharedMutex;
+    struct alignas(64) Shard
+    {
+        Shard(EpochManager& epochs, size_t maxBytes, size_t maxEntries) :
+            entries(epochs), policy(maxBytes, maxEntries) {}
+
+        FlatTable<DnsEntry> entries;
+        // decides which dynamic entries are evicted when the shard is over budget
+        EvictionPolicy policy;
+        size_t preloadedBytes = 0;
+        // key hashes of dynamic entries by expiration time, one timer per entry, expired entries are erased from the table
+        TimerWheel<uint64_t> expirations{getCurrentTimestamp()};
+        // serializes writers, readers lock it only if they can't enter the epoch
+        mutable std::shared_mutex sharedMutex;
+    };
+
+    static uint64_t hashKey(std::string_view key) noexcept { return std::hash<std::string_view>()(key); }
+    // bytes of the stored entry, its interned name, table slot and expiration timer. Allocator headers and empty slots are not counted
+    static size_t entryCost(std::string_view key, const DnsEntry& entry) noexcept;
+    // normalized question: lowercased name followed by type and class, written to the buffer of MAX_CACHE_KEY_LENGTH
+    static std::string_view makeKey(std::string_view name, uint16_t type, uint16_t qClass, char* keyBuffer) noexcept;
+    void insertEntry(std::string_view key, const DnsEntry& entry) noexcept;
+    // buffer the lookup in the calling thread, full or a second old buffer is recorded to the sketches of its shards.
+    // Shard busy with a writer is skipped, popularity is approximate anyway
+    void recordAccess(uint64_t hash, uint64_t currentTime) const noexcept;
+    // find entry of the question in epoch and pass it to the reader with current time and key hash,
+    // returns reader result or 0 if entry is missing
+    template<typename F>
+    int readEntry(std::string_view name, uint16_t type, uint16_t qClass, F&& reader) const noexcept;
+    // copy response into the buffer and patch it for the query, returns response size or 0 if it doesn't fit
+    static int writeResponse(const DnsEntry& entry, std::string_view name, uint16_t id, bool recursionDesired, uint32_t ttl,
+                             char* buffer, int bufferSize) noexcept;
+    // expiry thread, advances timer wheels and reclaims expired entries
+    void expireEntries() noexcept;
+    // top bits select the shard, low bits are used by the shard table
+    Shard& shardFor(uint64_t hash) noexcept { return *shards[(hash >> 54) & shardMask]; }
+    const Shard& shardFor(uint64_t hash) const noexcept { return *shards[(hash >> 54) & shardMask]; }
+
+    // declared before shards, so retired entries are freed after the tables
+    mutable EpochManager epochs;
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t shardMask;
+    uint64_t cacheId;  // thread buffers of lookups belong to one cache
+    uint32_t minTtl;
+    uint32_t maxTtl;
+    uint32_t maxNegativeTtl;
+    uint32_t servfailTtl;
+    unsigned prefetchPercent;
+    uint32_t staleTime;
     std::fstream cacheFile;
     std::string cacheFileName;
     bool saveOnExit = false;
+    std::mutex expiryMutex;
+    std::condition_variable expiryCondition;
+    bool stopExpiry = false;
+    std::thread expiryThread;
 
 public:
-    DnsCache(const std::string &cacheFileName);
+    DnsCache(const std::string &cacheFileName, const CacheConfig& config = CacheConfig());
     DnsCache(const DnsCache&) = delete;
     ~DnsCache();
 
-    // thread-safe non-blocking read access to cache
-    DnsEntry lookupEntry(const std::string& name) const noexcept;
-    // thread-safe write access
-    void updateOrInsertEntry(const std::string& name, const DnsEntry& entry) noexcept;
-    // in milliseconds
+    // thread-safe lock-free read access to cache. Copies fresh response to the question into the buffer
+    // and patches it with query id, RD flag, remaining TTL and query name case.
+    // Returns response size, or 0 if entry is missing or expired.
+    // Sets prefetch, if popular entry is close to expiration and the caller should refresh it
+    int readResponse(std::string_view name, uint16_t type, uint16_t qClass, uint16_t id, bool recursionDesired,
+                     char* buffer, int bufferSize, bool* prefetch = nullptr) const noexcept;
+    // same as readResponse, but expired entries within stale time are answered with short TTL,
+    // used when Forward Server fails
+    int readStaleResponse(std::string_view name, uint16_t type, uint16_t qClass, uint16_t id, bool recursionDesired,
+                          char* buffer, int bufferSize) const noexcept;
+    // thread-safe write access, entry TTL is clamped to configured bounds, SERVFAIL entries get configured TTL
+    void updateOrInsertEntry(std::string_view name, uint16_t type, uint16_t qClass, const DnsEntry& entry) noexcept;
+    // in sec, from coarse monotonic clock, that is cheap enough to call per request
     static uint64_t getCurrentTimestamp() noexcept;
     void saveCacheToFile();
+    // number of entries and bytes charged for them
+    std::pair<size_t, size_t> getUsage() const noexcept;
+    // number of entries evicted to fit the budget
+    uint64_t getEvictions() const noexcept;
     bool shouldSaveNewCacheFile() const noexcept { return saveOnExit; }
 
     const char entrySeparator= ' ';
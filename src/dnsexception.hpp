@@ -27,6 +27,9 @@ public:
         case DNSHeader::ServerFail:
             result = "Server Internal Error. ";
             break;
+        case DNSHeader::BadVersion:
+            result = "EDNS version is not supported. ";
+            break;
         default:
             return "Unknown Exception.";
         }
@@ -3,7 +3,9 @@
 #include <arpa/inet.h>
 #include <iostream>
 #include <algorithm>
+#include <cctype>
 #include "dnsexception.hpp"
+#include "dnswriter.hpp"
 
 std::string DNSMessage::toString() const noexcept
 {
@@ -37,7 +39,7 @@ void DNSMessage::readHeader(const char *buffer)
     header.arcount = read16Bits(buffer);
 }
 
-void DNSMessage::writeHeader(char* buffer) const
+void DNSMessage::writeHeader(char* buffer, const DNSHeader& header) const
 {
     write16Bits(buffer, header.id);
 
@@ -73,116 +75,76 @@ void DNSMessage::write16Bits(char*& buffer, uint16_t value) const
     buffer += 2;
 }
 
-uint32_t DNSMessage::read32Bits(const char *&buffer, bool reverse) const
+QuestionKey QuestionKey::fromQuery(const QueryData& data)
 {
-    const std::array<unsigned char, 4> bytes{
-        static_cast<unsigned char>(buffer[reverse ? 3 : 0]),
-        static_cast<unsigned char>(buffer[reverse ? 2 : 1]),
-        static_cast<unsigned char>(buffer[reverse ? 1 : 2]),
-        static_cast<unsigned char>(buffer[reverse ? 0 : 3])
-    };
-    uint32_t result;
-    std::memcpy(&result, bytes.data(), bytes.size());
-    buffer += 4;
-    return result;
-}
-
-void DNSMessage::write32Bits(char *&buffer, uint32_t value, bool reverse) const
-{
-    buffer[reverse ? 3 : 0] = (value & 0xFF000000) >> 24;
-    buffer[reverse ? 2 : 1] = (value & 0xFF0000) >> 16;
-    buffer[reverse ? 1 : 2] = (value & 0xFF00) >> 8;
-    buffer[reverse ? 0 : 3] = (value & 0xFF) >> 0;
-    buffer += 4;
-}
-
-void DNSMessage::writeLabel(char *&buffer, const std::string &name) const
-{
-    int start(0), end; // positions
-
-    while ((end = name.find('.', start)) != std::string::npos) 
-    {
-        *buffer++ = end - start; // label length octet
-        for (int i = start; i < end; i++) 
-            *buffer++ = name[i]; // label octets
-        start = end + 1; // Skip '.'
-    }
-
-    *buffer++ = name.size() - start; // last label length octet
-    for (int i = start; i < name.size(); i++)
-        *buffer++ = name[i]; // last label octets
-
-    *buffer++ = 0;
-}
-
-void DNSMessage::writeIPString(char *&buffer, const std::string &address) const
-{
-    in_addr addr;
-    inet_aton(address.c_str(), &addr);
-    write32Bits(buffer, addr.s_addr, true);
-}
-
-int DNSMessage::readLabel(const char*& buffer, std::string &name) const
-{
-    int labelLength = *buffer++;
-    int totalSize = labelLength + 1;
-    while (labelLength != 0)  // scan domain until null terminated label
-    {
-        for (int i = 0; i < labelLength; i++)
-        {
-            char c = *buffer++;
-            name.append(1, c);
-        }
-        labelLength = *buffer++;
-        totalSize += labelLength + 1;
-        if (labelLength != 0)
-            name.append(1, '.');
-    }
-
-    return totalSize;
-}
-
-uint16_t DNSMessage::createNameOffset(uint8_t offset) noexcept
-{
-    uint16_t result = 0xc000;
-    result += offset & 0xFF;
-    return result;
+    QuestionKey key{std::string(data.qName), data.qType, data.qClass};
+    std::transform(key.name.begin(), key.name.end(), key.name.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return key;
 }
 
 DNSQuery::DNSQuery(const char* packet, int size)
 {
+    if (size < DNSHeader::headerOffset)
+        throw DNSException(DNSHeader::Format, 0);
     readHeader(packet);
     if (header.id == 0 || header.qr != DNSHeader::Query)
         throw DNSException(DNSHeader::Format, header.id);
 
-    packet += DNSHeader::headerOffset;
-    readLabel(packet, data.qName);
-    data.qType = read16Bits(packet);
-    data.qClass = read16Bits(packet);
+    DnsParser parser(packet, size);
+    DnsName name;
+    if (header.qdcount == 0 || !parser.readQuestion(name, qType, qClass))
+        throw DNSException(DNSHeader::Format, header.id);
+    qNameLength = static_cast<uint8_t>(parser.nameText(name, qName.data()));
+    if (header.qdcount == 1)
+        readEdns(parser);
     if (!isQueryCompatible())
         throw DNSException(DNSHeader::NotImpl, header.id);
 }
 
-int DNSQuery::write(char *buffer)
+void DNSQuery::readEdns(DnsParser& parser)
+{
+    // RFC 6891: single OPT record with root name in additional section
+    DnsRecord record;
+    for (int i = 0; i < header.ancount + header.nscount + header.arcount; ++i)
+    {
+        if (!parser.readRecord(record))
+            throw DNSException(DNSHeader::Format, header.id);
+        if (record.type != 0x29)
+            continue;
+        if (i < header.ancount + header.nscount || hasEdns() || record.name.length != 1)
+            throw DNSException(DNSHeader::Format, header.id);
+        udpPayload = std::max(record.rClass, MIN_UDP_PAYLOAD);
+        // version is the second octet of TTL field, only version 0 is supported
+        if ((record.ttl >> 16 & 0xFF) != 0)
+            throw DNSException(DNSHeader::BadVersion, header.id);
+    }
+}
+
+int DNSQuery::write(char *buffer, uint16_t udpPayload)
 {
-    char* begin = buffer;
+    // parsed name always fits, root name included
+    DnsWriter writer(buffer, MIN_UDP_PAYLOAD - OPT_RECORD_SIZE);
+    if (!writer.writeQuestion(getData().qName, qType, qClass))
+        throw DNSException(DNSHeader::Format, header.id);
+    header.qdcount = 1;
+    header.ancount = 0;
+    header.nscount = 0;
     header.arcount = 0;
     writeHeader(buffer);
-    buffer += DNSHeader::headerOffset;
 
-    writeLabel(buffer, data.qName);
-    write16Bits(buffer, data.qType);
-    write16Bits(buffer, data.qClass);
-
-    return buffer - begin;
+    const int size = static_cast<int>(writer.size());
+    if (udpPayload == 0)
+        return size;
+    return DNSResponse::appendOpt(buffer, size, udpPayload);
 }
 
 bool DNSQuery::isQueryCompatible() const
 {
-    bool checkType = std::any_of(compatibleTypes.begin(), compatibleTypes.end(), 
-    [this](uint16_t type){ return type == data.qType; });
+    bool checkType = std::none_of(unsupportedTypes.begin(), unsupportedTypes.end(),
+    [this](uint16_t type){ return type == qType; });
     bool checkClass = std::any_of(compatibleClasses.begin(), compatibleClasses.end(), 
-    [this](uint16_t qClass){ return qClass == data.qClass; });
+    [this](uint16_t compatibleClass){ return compatibleClass == qClass; });
     return header.qdcount == 1 && header.opcode == DNSHeader::Standard && checkType && checkClass;
 }
 
@@ -194,10 +156,14 @@ DNSResponse::DNSResponse(DNSHeader::RCode rCode, uint16_t id)
     header.qr = DNSHeader::QR::Response;
 }
 
-DNSResponse::DNSResponse(DNSHeader::RCode rCode, const DNSQuery& query, const DnsEntry& entry)
+DNSResponse::DNSResponse(DNSHeader::RCode rCode, const DNSQuery& query, const DnsEntry& entry) :
+    DNSResponse(rCode, query.getData(), query.getId(), entry)
+{
+}
+
+DNSResponse::DNSResponse(DNSHeader::RCode rCode, const QueryData& queryData, uint16_t id, const DnsEntry& entry)
 {
-    const auto queryData = query.getData();
-    header.id = query.getId();
+    header.id = id;
     header.rcode = rCode;
     header.qr = DNSHeader::QR::Response;
     header.qdcount = 1;
@@ -206,58 +172,188 @@ DNSResponse::DNSResponse(DNSHeader::RCode rCode, const DNSQuery& query, const Dn
     data.type = queryData.qType;
     data.dataClass = queryData.qClass;
     data.ttl = TIMEOUT_TIME;
-    data.rLength = 4;
-    data.rData.emplace_back(entry.address);
+    data.rData.emplace_back(entry.addressToString());
+    data.answers.push_back({data.name, data.type, data.dataClass, data.ttl,
+                            std::string(reinterpret_cast<const char*>(entry.address.data()), entry.addressLength)});
 }
 
 DNSResponse::DNSResponse(DNSHeader::RCode rCode, const char *packet, int size)
 {
+    if (size < DNSHeader::headerOffset)
+        throw std::runtime_error("Failed to parse answer from Forward Server");
     readHeader(packet);
-    if (header.id == 0 || header.qr != DNSHeader::Response || header.rcode != DNSHeader::NoError || header.ancount == 0)
+    if (header.id == 0 || header.qr != DNSHeader::Response)
+        throw DNSException(static_cast<DNSHeader::RCode>(header.rcode), header.id, "Invalid Response from Forward Server.");
+    // NXDOMAIN, NODATA and SERVFAIL are cached, other errors are passed to the client
+    negative = header.rcode == DNSHeader::NameError || header.rcode == DNSHeader::ServerFail
+        || (header.rcode == DNSHeader::NoError && header.ancount == 0);
+    if (header.rcode != DNSHeader::NoError && !negative)
         throw DNSException(static_cast<DNSHeader::RCode>(header.rcode), header.id, "Invalid Response from Forward Server.");
 
     header.qr = DNSHeader::QR::Response;
-    packet += DNSHeader::headerOffset;
-    readLabel(packet, data.name);
-    data.type = read16Bits(packet);
-    data.dataClass = read16Bits(packet);
+    if (header.qdcount == 0)
+    {
+        if (negative)
+            return;  // can't be matched to the query and cached
+        throw std::runtime_error("Failed to parse answer from Forward Server");
+    }
+    DnsParser parser(packet, size);
+    DnsName name;
+    if (!parser.readQuestion(name, data.type, data.dataClass))
+        throw std::runtime_error("Failed to parse answer from Forward Server");
+    char nameBuffer[MAX_NAME_TEXT_LENGTH];
+    data.name.assign(nameBuffer, parser.nameText(name, nameBuffer));
+    for (int i = 1; i < header.qdcount; ++i)
+    {
+        uint16_t type, qClass;
+        if (!parser.readQuestion(name, type, qClass))
+            throw std::runtime_error("Failed to parse answer from Forward Server");
+    }
+    if (negative)
+    {
+        readNegativeAnswer(parser);
+        return;
+    }
 
+    data.ttl = UINT32_MAX;
+    DnsRecord record;
     for (int i = 0; i < header.ancount; ++i)
     {
-        packet += 2; // skip NAME offset
-        packet += 10; // skip TYPE, CLASS, TTL, RDLENGTH bit fields
-        data.ttl = 60;
-        data.rLength = 4;
-        in_addr addrN;
-        addrN.s_addr = read32Bits(packet, false);
-        char clientAddrStr[INET_ADDRSTRLEN];
-        data.rData.emplace_back(inet_ntop(AF_INET, &addrN.s_addr, clientAddrStr, INET_ADDRSTRLEN));
+        readRecord(parser, record, data.answers);
+        // addresses of the question type are kept for hosts file, records of other types are passed as they are
+        if (record.type != data.type || record.rClass != data.dataClass)
+            continue;
+        const int family = record.type == 0x01 && record.rdLength == 4 ? AF_INET
+            : record.type == 0x1C && record.rdLength == 16 ? AF_INET6 : AF_UNSPEC;
+        if (family == AF_UNSPEC)
+            continue;
+        char addressStr[INET6_ADDRSTRLEN];
+        data.rData.emplace_back(inet_ntop(family, packet + record.rdataOffset, addressStr, sizeof (addressStr)));
     }
-    if (data.name.empty() || data.rData.size() != header.ancount)
+    for (int i = 0; i < header.nscount; ++i)
+        readRecord(parser, record, data.authority);
+    for (int i = 0; i < header.arcount; ++i)
+        readRecord(parser, record, data.additional);
+    // answers are cached for the smallest TTL of the records
+    for (const auto* section : {&data.answers, &data.authority, &data.additional})
+        for (const auto& resourceRecord : *section)
+            data.ttl = std::min(data.ttl, resourceRecord.ttl);
+    // response is encoded again with all sections compressed
+    header.ancount = static_cast<uint16_t>(data.answers.size());
+    header.nscount = static_cast<uint16_t>(data.authority.size());
+    header.arcount = static_cast<uint16_t>(data.additional.size());
+}
+
+void DNSResponse::readRecord(DnsParser& parser, DnsRecord& record, std::vector<ResourceRecord>& section)
+{
+    if (!parser.readRecord(record))
         throw std::runtime_error("Failed to parse answer from Forward Server");
+    // OPT and TSIG describe the message of Forward Server, not the answer
+    if (record.type == 0x29 || record.type == 0xFA)
+        return;
+    ResourceRecord& resourceRecord = section.emplace_back();
+    char nameBuffer[MAX_NAME_TEXT_LENGTH];
+    resourceRecord.name.assign(nameBuffer, parser.nameText(record.name, nameBuffer));
+    resourceRecord.type = record.type;
+    resourceRecord.rClass = record.rClass;
+    resourceRecord.ttl = record.ttl;
+    resourceRecord.rdata.resize(record.rdLength + 2 * MAX_NAME_WIRE_LENGTH);
+    size_t rdLength = 0;
+    if (!parser.expandRdata(record, resourceRecord.rdata.data(), rdLength))
+        throw std::runtime_error("Failed to parse answer from Forward Server");
+    resourceRecord.rdata.resize(rdLength);
 }
 
-int DNSResponse::write(char* buffer) const
+void DNSResponse::readNegativeAnswer(DnsParser& parser)
 {
-    char* begin = buffer;
-    writeHeader(buffer);
-    buffer += DNSHeader::headerOffset;
-    if (!data.name.empty())
+    // RFC 2308: negative answer is cached for the smaller of SOA TTL and SOA MINIMUM from authority section,
+    // without SOA it's not cached. SERVFAIL TTL is chosen by the cache
+    data.ttl = 0;
+    if (header.rcode == DNSHeader::ServerFail)
+        return;
+    // CNAME chain of NXDOMAIN in answer section is sent with the rest of response
+    DnsRecord record;
+    for (int i = 0; i < header.ancount; ++i)
+        readRecord(parser, record, data.answers);
+    for (int i = 0; i < header.nscount; ++i)
+        readRecord(parser, record, data.authority);
+    for (const auto& soa : data.authority)
     {
-        writeLabel(buffer, data.name);
-        write16Bits(buffer, data.type);
-        write16Bits(buffer, data.dataClass);
+        if (soa.type != 0x06 || soa.rdata.size() < 20)
+            continue;
+        const char* minimum = soa.rdata.data() + soa.rdata.size() - 4;
+        const uint32_t minimumTtl = static_cast<uint32_t>(static_cast<uint8_t>(minimum[0]) << 24 | static_cast<uint8_t>(minimum[1]) << 16
+                                                           | static_cast<uint8_t>(minimum[2]) << 8 | static_cast<uint8_t>(minimum[3]));
+        data.ttl = std::max(data.ttl, std::min(soa.ttl, minimumTtl));
+    }
+}
 
-        for (const auto& ans : data.rData)
-        {
-            write16Bits(buffer, createNameOffset(DNSHeader::headerOffset)); // offset to qName
-            write16Bits(buffer, data.type);
-            write16Bits(buffer, data.dataClass);
-            write32Bits(buffer, data.ttl, false);
-            write16Bits(buffer, data.rLength);
-            writeIPString(buffer, ans);
-        }
+int DNSResponse::write(char* buffer, size_t capacity, std::vector<uint16_t>* ttlOffsets, bool* truncated) const
+{
+    if (capacity < DNSHeader::headerOffset)
+        throw std::runtime_error("Response buffer is too small");
+    DNSHeader written = header;
+    DnsWriter writer(buffer, capacity);
+    // response without question is a negative answer, that can't be matched to the query, or an error.
+    // Root name of the question is empty
+    if (header.qdcount != 0)
+    {
+        written.qdcount = writer.writeQuestion(data.name, data.type, data.dataClass) ? 1 : 0;
+        // RFC 2181 9: TC is set when the answer is incomplete, dropped additional records don't need it
+        bool complete = written.qdcount != 0;
+        const auto writeSection = [&](const std::vector<ResourceRecord>& section, uint16_t& count, bool required) {
+            count = 0;
+            for (const auto& record : section)
+            {
+                uint16_t ttlOffset;
+                if (!complete || !writer.writeRecord(record.name, record.type, record.rClass, data.ttl, record.rdata, ttlOffset))
+                {
+                    complete = complete && !required;
+                    return;
+                }
+                if (ttlOffsets)
+                    ttlOffsets->push_back(ttlOffset);
+                ++count;
+            }
+        };
+        writeSection(data.answers, written.ancount, true);
+        writeSection(data.authority, written.nscount, true);
+        writeSection(data.additional, written.arcount, false);
+        // answer truncated by Forward Server stays truncated
+        written.tc = header.tc || !complete;
+    }
+    else
+    {
+        written.qdcount = written.ancount = written.nscount = written.arcount = 0;
     }
+    writeHeader(buffer, written);
+    if (truncated)
+        *truncated = written.tc;
+    return static_cast<int>(writer.size());
+}
 
-    return buffer - begin;
+int DNSResponse::appendOpt(char* buffer, int size, uint16_t udpPayload, uint8_t extendedRCode) noexcept
+{
+    // root name, type, class is the payload size, TTL holds extended RCODE, version 0 and flags, no options
+    const uint8_t opt[OPT_RECORD_SIZE]{0, 0x00, 0x29, static_cast<uint8_t>(udpPayload >> 8), static_cast<uint8_t>(udpPayload & 0xFF),
+                                      extendedRCode, 0, 0, 0, 0, 0};
+    std::memcpy(buffer + size, opt, sizeof (opt));
+    const uint16_t arcount = static_cast<uint16_t>((static_cast<uint8_t>(buffer[10]) << 8 | static_cast<uint8_t>(buffer[11])) + 1);
+    buffer[10] = static_cast<char>(arcount >> 8);
+    buffer[11] = static_cast<char>(arcount & 0xFF);
+    return size + static_cast<int>(sizeof (opt));
+}
+
+int DNSResponse::truncate(char* buffer, int size) noexcept
+{
+    DnsParser parser(buffer, size);
+    DnsName name;
+    uint16_t type, qClass;
+    const bool question = buffer[4] != 0 || buffer[5] != 0;
+    const int end = question && parser.readQuestion(name, type, qClass) ? static_cast<int>(parser.position()) : DNSHeader::headerOffset;
+    buffer[2] = static_cast<char>(buffer[2] | DNSHeader::mask_tc >> 8);
+    buffer[4] = 0;
+    buffer[5] = end > DNSHeader::headerOffset ? 1 : 0;
+    std::memset(buffer + 6, 0, 6);
+    return end;
 }
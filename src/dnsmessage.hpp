@@ -5,9 +5,18 @@
 #include <sstream>
 #include <array>
 #include <vector>
+#include <functional>
+#include <string_view>
 #include "dnscache.hpp"
+#include "dnsparser.hpp"
 
 
+inline constexpr uint16_t MIN_UDP_PAYLOAD = 512;  // RFC 1035 limit of UDP messages without EDNS
+inline constexpr uint16_t MAX_UDP_PAYLOAD = 4096;  // size of response and Forward Server buffers
+inline constexpr uint16_t MAX_TCP_MESSAGE = 65535;  // bound by the 2-byte length prefix (RFC 7766), size of TCP response buffers
+inline constexpr uint16_t DEFAULT_EDNS_PAYLOAD = 1232;  // fits IPv6 minimum MTU, so answers are not fragmented
+inline constexpr size_t OPT_RECORD_SIZE = 11;  // OPT without options
+
 struct DNSHeader
 {
     enum QR
@@ -30,7 +39,8 @@ struct DNSHeader
         ServerFail,
         NameError,
         NotImpl,
-        Refused
+        Refused,
+        BadVersion = 16  // extended, upper bits are sent in OPT record
     };
 
     uint16_t id = 0;
@@ -72,19 +82,51 @@ struct DNSHeader
 
 struct QueryData
 {
-    std::string qName;
+    std::string_view qName;  // refers to the name in the query
     uint16_t qType;
     uint16_t qClass;
 };
 
+/// normalized question: lowercased name, type and class, identifies answers of equal queries
+struct QuestionKey
+{
+    std::string name;
+    uint16_t type = 0;
+    uint16_t qClass = 0;
+
+    static QuestionKey fromQuery(const QueryData& data);
+    bool operator==(const QuestionKey& other) const noexcept = default;
+};
+
+template<>
+struct std::hash<QuestionKey>
+{
+    size_t operator()(const QuestionKey& key) const noexcept
+    {
+        return std::hash<std::string>()(key.name) ^ ((static_cast<size_t>(key.type) << 16 | key.qClass) * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+/// resource record of the response, names in RDATA are uncompressed
+struct ResourceRecord
+{
+    std::string name;
+    uint16_t type = 0;
+    uint16_t rClass = 0;
+    uint32_t ttl = 0;
+    std::string rdata;
+};
+
 struct ResponseData
 {
     std::string name;
     uint16_t type;
     uint16_t dataClass;
     uint32_t ttl;
-    uint16_t rLength;
-    std::vector<std::string> rData;
+    std::vector<std::string> rData;  // answer addresses of the question type
+    std::vector<ResourceRecord> answers;
+    std::vector<ResourceRecord> authority;
+    std::vector<ResourceRecord> additional;
 };
 
 
@@ -95,24 +137,19 @@ public:
 
     std::string toString() const noexcept;
     uint16_t getId() const noexcept { return header.id; }
+    bool recursionDesired() const noexcept { return header.rd; }
     DNSHeader::QR getQr() const noexcept { return static_cast<DNSHeader::QR>(header.qr); }
+    DNSHeader::RCode getRCode() const noexcept { return static_cast<DNSHeader::RCode>(header.rcode); }
 
 protected:
     DNSMessage(){}
 
     void readHeader(const char* buffer);
-    void writeHeader(char* buffer) const;
+    void writeHeader(char* buffer) const { writeHeader(buffer, header); }
+    void writeHeader(char* buffer, const DNSHeader& header) const;
 
     uint16_t read16Bits(const char*& buffer) const;
     void write16Bits(char*& buffer, uint16_t value) const;
-    uint32_t read32Bits(const char*& buffer, bool reverse) const;
-    void write32Bits(char*& buffer, uint32_t value, bool reverse) const;   
-    void writeLabel(char*& buffer, const std::string& name) const;
-    void writeIPString(char*& buffer, const std::string& address) const;
-    // returns qName byte size
-    int readLabel(const char*& buffer, std::string &name) const;
-    // from the start of the msg
-    static uint16_t createNameOffset(uint8_t offset) noexcept;
 
     DNSHeader header;
 };
@@ -120,10 +157,20 @@ protected:
 class DNSQuery : public DNSMessage
 {
 public:
+    // parse query in place, throws DNSException if it is malformed or not supported
     DNSQuery(const char* packet, int size);
 
-    QueryData getData() const noexcept { return data; }
-    int write(char* buffer);
+    // question with name referring to this query
+    QueryData getData() const noexcept { return {std::string_view(qName.data(), qNameLength), qType, qClass}; }
+    // client sent OPT record, its response should have one too
+    bool hasEdns() const noexcept { return udpPayload != 0; }
+    // UDP payload size the client can receive, at least 512
+    uint16_t getUdpPayload() const noexcept { return hasEdns() ? udpPayload : MIN_UDP_PAYLOAD; }
+    // query came over TCP, its response is limited by the 2-byte length prefix and not by the UDP payload (RFC 7766)
+    void setStreamTransport() noexcept { stream = true; }
+    bool overStream() const noexcept { return stream; }
+    // encode question for Forward Server into buffer of MIN_UDP_PAYLOAD, with OPT record advertising udpPayload if it isn't 0
+    int write(char* buffer, uint16_t udpPayload = 0);
 
     friend std::ostringstream& operator<<(std::ostringstream& os, const DNSQuery& query)
     {
@@ -139,13 +186,21 @@ public:
 
 private:
     bool isQueryCompatible() const;
-    // A type or any
-    std::array<uint16_t, 2> compatibleTypes{0x01, 0xFF};
-    // IN class or any
-    std::array<uint16_t, 2> compatibleClasses{0x01, 0xFF};
-
-
-    QueryData data;
+    // find OPT record in the sections after the question, throws DNSException if it's malformed or of unknown version
+    void readEdns(DnsParser& parser);
+    // every type is forwarded and cached but OPT pseudo type, zone transfers and obsolete mailbox queries
+    std::array<uint16_t, 5> unsupportedTypes{0x29, 0xFB, 0xFC, 0xFD, 0xFE};
+    // IN, CH, HS class or any
+    std::array<uint16_t, 4> compatibleClasses{0x01, 0x03, 0x04, 0xFF};
+
+
+    // question name is kept in place, so parsing query allocates nothing
+    std::array<char, MAX_NAME_TEXT_LENGTH> qName;
+    uint8_t qNameLength = 0;
+    uint16_t qType = 0;
+    uint16_t qClass = 0;
+    uint16_t udpPayload = 0;  // from OPT record, 0 without EDNS
+    bool stream = false;
 };
 
 class DNSResponse : public DNSMessage
@@ -155,22 +210,31 @@ public:
     DNSResponse(DNSHeader::RCode rCode, uint16_t id);
     // create response from query with answer entry
     DNSResponse(DNSHeader::RCode rCode, const DNSQuery& query, const DnsEntry& entry);
-    // read response msg from forward server
+    // create response to the question with answer entry address
+    DNSResponse(DNSHeader::RCode rCode, const QueryData& question, uint16_t id, const DnsEntry& entry);
+    // read response msg from forward server, negative answers are accepted for caching
     DNSResponse(DNSHeader::RCode rCode, const char* packet, int size);
-    // encode response msg to buffer
-    int write(char* buffer) const;
-    ResponseData getData() const noexcept { return data; }
+    // encode response msg with compressed names to buffer of given capacity, optionally collect offsets of TTLs for patching.
+    // Records that don't fit are dropped, TC is set if answer or authority section is incomplete
+    int write(char* buffer, size_t capacity, std::vector<uint16_t>* ttlOffsets = nullptr, bool* truncated = nullptr) const;
+    const ResponseData& getData() const noexcept { return data; }
+    // append OPT record to encoded response, buffer should have OPT_RECORD_SIZE bytes after it. Returns new size
+    static int appendOpt(char* buffer, int size, uint16_t udpPayload, uint8_t extendedRCode = 0) noexcept;
+    // cut encoded response to the question and set TC, for clients that can't receive it whole. Returns new size
+    static int truncate(char* buffer, int size) noexcept;
+    // NXDOMAIN, NODATA or SERVFAIL answer from forward server, its TTL is the negative caching TTL
+    bool isNegative() const noexcept { return negative; }
 
     friend std::ostringstream& operator<<(std::ostringstream& os, const DNSResponse& resp)
     {
-        const ResponseData data = resp.getData();
+        const ResponseData& data = resp.getData();
         os << "\nDNS Message\n{\n ";
         os << resp.toString();
         os << "\n\tResponse\n\tNAME: " << data.name << std::endl;
         os << "\tTYPE: " << data.type << std::endl;
         os << "\tCLASS: " << data.dataClass << std::endl;
         os << "\tTTL: " << data.ttl << std::endl;
-        os << "\tRDLENGTH: " << data.rLength << std::endl;
+        os << "\tRECORDS: " << data.answers.size() << '/' << data.authority.size() << '/' << data.additional.size() << std::endl;
         for (const auto& ans : data.rData)
             os << "\tRDATA: " << ans << std::endl;
         os << "}";
@@ -178,5 +242,11 @@ public:
     }
 
 private:
+    // parse answer and authority sections of negative answer after the question
+    void readNegativeAnswer(DnsParser& parser);
+    // parse record and keep it in the section with expanded RDATA, OPT and TSIG are skipped
+    void readRecord(DnsParser& parser, DnsRecord& record, std::vector<ResourceRecord>& section);
+
     ResponseData data;
+    bool negative = false;
 };
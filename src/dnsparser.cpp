@@ -0,0 +1,144 @@
+#include "dnsparser.hpp"
+#include <cctype>
+#include <cstring>
+
+
+bool DnsParser::readName(size_t& position, DnsName& name) const noexcept
+{
+    name.offset = static_cast<uint16_t>(position);
+    size_t at = position;
+    size_t wireLength = 0;
+    unsigned pointers = 0;
+    for (;;)
+    {
+        if (at >= size)
+            return false;
+        const uint8_t labelLength = packet[at];
+        if ((labelLength & 0xC0) == 0xC0)
+        {
+            if (at + 1 >= size)
+                return false;
+            const size_t target = (labelLength & 0x3F) << 8 | packet[at + 1];
+            if (pointers == 0)
+                position = at + 2;  // name in place ends with the first pointer
+            // pointers may only point back and their number is limited, so names can't loop
+            if (target >= at || ++pointers > MAX_NAME_POINTERS)
+                return false;
+            at = target;
+            continue;
+        }
+        if (labelLength > MAX_LABEL_LENGTH)
+            return false;  // extended label types are not supported
+        wireLength += labelLength + 1;
+        if (wireLength > MAX_NAME_WIRE_LENGTH || at + labelLength + 1 > size)
+            return false;
+        at += labelLength + 1;
+        if (labelLength == 0)
+            break;
+    }
+    if (pointers == 0)
+        position = at;
+    name.length = static_cast<uint16_t>(position - name.offset);
+    return true;
+}
+
+bool DnsParser::readQuestion(DnsName& name, uint16_t& type, uint16_t& qClass) noexcept
+{
+    if (!readName(name) || offset + 4 > size)
+        return false;
+    type = read16(offset);
+    qClass = read16(offset + 2);
+    offset += 4;
+    return true;
+}
+
+bool DnsParser::readRecord(DnsRecord& record) noexcept
+{
+    if (!readName(record.name) || offset + 10 > size)
+        return false;
+    record.type = read16(offset);
+    record.rClass = read16(offset + 2);
+    record.ttlOffset = static_cast<uint16_t>(offset + 4);
+    record.ttl = read32(offset + 4);
+    record.rdLength = read16(offset + 8);
+    record.rdataOffset = static_cast<uint16_t>(offset + 10);
+    if (record.rdataOffset + record.rdLength > size)
+        return false;
+    offset = record.rdataOffset + record.rdLength;
+    return true;
+}
+
+template<typename F>
+void DnsParser::forEachLabel(const DnsName& name, F&& visitor) const noexcept
+{
+    size_t at = name.offset;
+    while (packet[at] != 0)
+    {
+        if ((packet[at] & 0xC0) == 0xC0)
+        {
+            at = (packet[at] & 0x3F) << 8 | packet[at + 1];
+            continue;
+        }
+        visitor(reinterpret_cast<const char*>(packet + at + 1), packet[at]);
+        at += packet[at] + 1;
+    }
+}
+
+size_t DnsParser::nameText(const DnsName& name, char* buffer) const noexcept
+{
+    size_t length = 0;
+    forEachLabel(name, [buffer, &length](const char* label, size_t labelLength) {
+        if (length != 0)
+            buffer[length++] = '.';
+        for (size_t i = 0; i < labelLength; ++i)
+            buffer[length++] = label[i];
+    });
+    return length;
+}
+
+bool DnsParser::nameEquals(const DnsName& name, std::string_view text) const noexcept
+{
+    size_t position = 0;
+    bool equal = true;
+    forEachLabel(name, [&](const char* label, size_t labelLength) {
+        if (position != 0)
+            equal = equal && position < text.size() && text[position++] == '.';
+        equal = equal && position + labelLength <= text.size();
+        for (size_t i = 0; equal && i < labelLength; ++i, ++position)
+            equal = std::tolower(static_cast<unsigned char>(label[i])) == std::tolower(static_cast<unsigned char>(text[position]));
+    });
+    return equal && position == text.size();
+}
+
+size_t DnsParser::nameWire(const DnsName& name, char* buffer) const noexcept
+{
+    size_t length = 0;
+    forEachLabel(name, [buffer, &length](const char* label, size_t labelLength) {
+        buffer[length++] = static_cast<char>(labelLength);
+        std::memcpy(buffer + length, label, labelLength);
+        length += labelLength;
+    });
+    buffer[length++] = 0;
+    return length;
+}
+
+bool DnsParser::expandRdata(const DnsRecord& record, char* buffer, size_t& length) const noexcept
+{
+    const RdataNames layout = rdataNames(record.type);
+    const size_t end = record.rdataOffset + record.rdLength;
+    size_t at = record.rdataOffset + layout.prefix;
+    if (at > end)
+        return false;
+    std::memcpy(buffer, packet + record.rdataOffset, layout.prefix);
+    length = layout.prefix;
+    for (unsigned i = 0; i < layout.count; ++i)
+    {
+        DnsName name;
+        if (!readName(at, name) || at > end)
+            return false;
+        length += nameWire(name, buffer + length);
+    }
+    std::memcpy(buffer + length, packet + at, end - at);
+    length += end - at;
+    return true;
+}
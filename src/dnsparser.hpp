@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+
+inline constexpr size_t DNS_HEADER_SIZE = 12;
+inline constexpr size_t MAX_NAME_WIRE_LENGTH = 255;  // RFC 1035, with length octets and root label
+inline constexpr size_t MAX_NAME_TEXT_LENGTH = MAX_NAME_WIRE_LENGTH - 1;  // dotted form without the root
+inline constexpr size_t MAX_LABEL_LENGTH = 63;
+inline constexpr unsigned MAX_NAME_POINTERS = 64;
+
+/// encoded domain name in the packet
+struct DnsName
+{
+    uint16_t offset = 0;  // position of the first label
+    uint16_t length = 0;  // bytes taken at the position, labels up to the root label or the first pointer
+};
+
+/// resource record in the packet, RDATA is referenced by offset
+struct DnsRecord
+{
+    DnsName name;
+    uint16_t type = 0;
+    uint16_t rClass = 0;
+    uint32_t ttl = 0;
+    uint16_t ttlOffset = 0;
+    uint16_t rdataOffset = 0;
+    uint16_t rdLength = 0;
+};
+
+/// RDATA layout of the types whose names may be compressed (RFC 3597 section 4): fixed octets before the names and number of names
+struct RdataNames
+{
+    uint8_t prefix = 0;
+    uint8_t count = 0;
+};
+
+constexpr RdataNames rdataNames(uint16_t type) noexcept
+{
+    switch (type)
+    {
+    case 0x02:  // NS
+    case 0x05:  // CNAME
+    case 0x0C:  // PTR
+        return {0, 1};
+    case 0x06:  // SOA
+        return {0, 2};
+    case 0x0F:  // MX
+        return {2, 1};
+    default:
+        return {};
+    }
+}
+
+/// Bounds-checked reader of DNS message sections in place over the receive buffer
+/// Reader walks sections after the header, every length is validated against the packet size.
+/// Compression pointers may only point backwards and their number is limited, so names can't loop.
+/// Nothing is copied or allocated, read methods return false on malformed packet and the reader shouldn't be used after that.
+class DnsParser
+{
+public:
+    // packet should hold at least the header
+    DnsParser(const char* packet, size_t size) noexcept :
+        packet(reinterpret_cast<const uint8_t*>(packet)), size(size), offset(DNS_HEADER_SIZE) {}
+
+    bool readQuestion(DnsName& name, uint16_t& type, uint16_t& qClass) noexcept;
+    bool readRecord(DnsRecord& record) noexcept;
+
+    // write validated name in dotted form, buffer should have MAX_NAME_TEXT_LENGTH bytes. Returns text length
+    size_t nameText(const DnsName& name, char* buffer) const noexcept;
+    // case-insensitive comparison of validated name with dotted text
+    bool nameEquals(const DnsName& name, std::string_view text) const noexcept;
+    // copy RDATA with its compressed names expanded, so it can be written to another message.
+    // Buffer should have rdLength + 2 * MAX_NAME_WIRE_LENGTH bytes, returns false if names are malformed
+    bool expandRdata(const DnsRecord& record, char* buffer, size_t& length) const noexcept;
+
+    uint16_t read16(size_t at) const noexcept { return static_cast<uint16_t>(packet[at] << 8 | packet[at + 1]); }
+    uint32_t read32(size_t at) const noexcept { return static_cast<uint32_t>(read16(at)) << 16 | read16(at + 2); }
+    size_t position() const noexcept { return offset; }
+
+private:
+    // validate name at the current position with all its pointers and move past it
+    bool readName(DnsName& name) noexcept { return readName(offset, name); }
+    bool readName(size_t& at, DnsName& name) const noexcept;
+    // write validated name uncompressed, returns its wire length
+    size_t nameWire(const DnsName& name, char* buffer) const noexcept;
+    // call visitor with every label of validated name
+    template<typename F>
+    void forEachLabel(const DnsName& name, F&& visitor) const noexcept;
+
+    const uint8_t* packet;
+    size_t size;
+    size_t offset;
+};
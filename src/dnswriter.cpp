@@ -0,0 +1,201 @@
+#include "dnswriter.hpp"
+#include <cctype>
+#include <cstring>
+
+
+bool DnsWriter::textLabels(std::string_view name, Labels& labels, size_t& count) noexcept
+{
+    count = 0;
+    size_t wireLength = 1;
+    size_t start = 0;
+    while (start < name.size())
+    {
+        size_t end = name.find('.', start);
+        if (end == std::string_view::npos)
+            end = name.size();
+        const size_t length = end - start;
+        wireLength += length + 1;
+        if (length == 0 || length > MAX_LABEL_LENGTH || wireLength > MAX_NAME_WIRE_LENGTH || count == MAX_NAME_LABELS)
+            return false;
+        labels[count++] = {name.data() + start, static_cast<uint8_t>(length)};
+        start = end + 1;
+    }
+    return true;
+}
+
+bool DnsWriter::wireLabels(std::string_view data, Labels& labels, size_t& count, size_t& wireLength) noexcept
+{
+    count = 0;
+    wireLength = 0;
+    for (;;)
+    {
+        if (wireLength >= data.size())
+            return false;
+        const uint8_t length = static_cast<uint8_t>(data[wireLength]);
+        if (length > MAX_LABEL_LENGTH || wireLength + length + 1 > data.size() || wireLength + length + 1 > MAX_NAME_WIRE_LENGTH)
+            return false;
+        if (length == 0)
+            break;
+        if (count == MAX_NAME_LABELS)
+            return false;
+        labels[count++] = {data.data() + wireLength + 1, length};
+        wireLength += length + 1;
+    }
+    ++wireLength;
+    return true;
+}
+
+bool DnsWriter::suffixAt(const Labels& labels, size_t first, size_t count, size_t at) const noexcept
+{
+    // output holds only valid names with backward pointers
+    for (size_t i = first; i <= count; ++i)
+    {
+        while ((buffer[at] & 0xC0) == 0xC0)
+            at = (buffer[at] & 0x3F) << 8 | buffer[at + 1];
+        if (i == count)
+            return buffer[at] == 0;
+        if (buffer[at] != labels[i].length)
+            return false;
+        for (size_t j = 0; j < labels[i].length; ++j)
+        {
+            if (std::tolower(buffer[at + 1 + j]) != std::tolower(static_cast<unsigned char>(labels[i].data[j])))
+                return false;
+        }
+        at += labels[i].length + 1;
+    }
+    return false;
+}
+
+bool DnsWriter::writeLabels(const Labels& labels, size_t count) noexcept
+{
+    // longest known suffix is found first
+    size_t first = 0;
+    size_t target = 0;
+    for (; first < count; ++first)
+    {
+        size_t i = 0;
+        while (i < targetCount && !suffixAt(labels, first, count, targets[i]))
+            ++i;
+        if (i < targetCount)
+        {
+            target = targets[i];
+            break;
+        }
+    }
+
+    size_t length = first == count ? 1 : 2;
+    for (size_t i = 0; i < first; ++i)
+        length += labels[i].length + 1;
+    if (offset + length > capacity)
+        return false;
+    for (size_t i = 0; i < first; ++i)
+    {
+        if (targetCount < MAX_COMPRESSION_TARGETS && offset <= MAX_POINTER_OFFSET)
+            targets[targetCount++] = static_cast<uint16_t>(offset);
+        buffer[offset] = labels[i].length;
+        std::memcpy(buffer + offset + 1, labels[i].data, labels[i].length);
+        offset += labels[i].length + 1;
+    }
+    if (first == count)
+    {
+        buffer[offset++] = 0;
+        return true;
+    }
+    buffer[offset++] = static_cast<uint8_t>(0xC0 | target >> 8);
+    buffer[offset++] = static_cast<uint8_t>(target & 0xFF);
+    return true;
+}
+
+bool DnsWriter::writeName(std::string_view name) noexcept
+{
+    Labels labels;
+    size_t count;
+    return textLabels(name, labels, count) && writeLabels(labels, count);
+}
+
+bool DnsWriter::writeRdata(uint16_t type, std::string_view rdata) noexcept
+{
+    const RdataNames layout = rdataNames(type);
+    if (layout.count == 0 || rdata.size() < layout.prefix)
+        return writeBytes(rdata.data(), rdata.size());
+
+    const size_t start = offset;
+    const size_t targetMark = targetCount;
+    size_t position = layout.prefix;
+    bool written = writeBytes(rdata.data(), position);
+    for (unsigned i = 0; written && i < layout.count; ++i)
+    {
+        Labels labels;
+        size_t count, wireLength;
+        if (!wireLabels(rdata.substr(position), labels, count, wireLength))
+        {
+            // RDATA doesn't match its type, it's copied without compression
+            rollback(start, targetMark);
+            return writeBytes(rdata.data(), rdata.size());
+        }
+        written = writeLabels(labels, count);
+        position += wireLength;
+    }
+    return written && writeBytes(rdata.data() + position, rdata.size() - position);
+}
+
+bool DnsWriter::writeQuestion(std::string_view name, uint16_t type, uint16_t qClass) noexcept
+{
+    const size_t mark = offset;
+    const size_t targetMark = targetCount;
+    if (writeName(name) && write16(type) && write16(qClass))
+        return true;
+    rollback(mark, targetMark);
+    return false;
+}
+
+bool DnsWriter::writeRecord(std::string_view name, uint16_t type, uint16_t rClass, uint32_t ttl, std::string_view rdata,
+                            uint16_t& ttlOffset) noexcept
+{
+    const size_t mark = offset;
+    const size_t targetMark = targetCount;
+    if (writeName(name) && write16(type) && write16(rClass))
+    {
+        ttlOffset = static_cast<uint16_t>(offset);
+        const size_t lengthOffset = offset + 4;
+        if (write32(ttl) && write16(0) && writeRdata(type, rdata))
+        {
+            const size_t rdLength = offset - lengthOffset - 2;
+            if (rdLength <= UINT16_MAX)
+            {
+                buffer[lengthOffset] = static_cast<uint8_t>(rdLength >> 8);
+                buffer[lengthOffset + 1] = static_cast<uint8_t>(rdLength & 0xFF);
+                return true;
+            }
+        }
+    }
+    rollback(mark, targetMark);
+    return false;
+}
+
+bool DnsWriter::writeBytes(const void* data, size_t length) noexcept
+{
+    if (offset + length > capacity)
+        return false;
+    if (length != 0)
+        std::memcpy(buffer + offset, data, length);
+    offset += length;
+    return true;
+}
+
+bool DnsWriter::write16(uint16_t value) noexcept
+{
+    const uint8_t bytes[2]{static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value & 0xFF)};
+    return writeBytes(bytes, sizeof (bytes));
+}
+
+bool DnsWriter::write32(uint32_t value) noexcept
+{
+    return write16(static_cast<uint16_t>(value >> 16)) && write16(static_cast<uint16_t>(value & 0xFFFF));
+}
+
+void DnsWriter::rollback(size_t mark, size_t targetMark) noexcept
+{
+    offset = mark;
+    targetCount = targetMark;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "dnsparser.hpp"
+
+
+inline constexpr size_t MAX_COMPRESSION_TARGETS = 64;
+inline constexpr size_t MAX_NAME_LABELS = 128;
+inline constexpr size_t MAX_POINTER_OFFSET = 0x3FFF;
+
+/// Encoder of DNS message sections into the caller buffer with name compression (RFC 1035 4.1.4)
+/// Offset of every name suffix written is kept in a fixed dictionary, later names ending with a known suffix
+/// are written as their other labels and a pointer to it. Suffixes are compared against the output itself, so nothing is allocated.
+/// Every write is checked against the capacity, write that doesn't fit returns false and leaves the buffer as it was,
+/// so caller decides which records are dropped and whether the message is truncated.
+class DnsWriter
+{
+public:
+    // header is written by the caller, capacity should be at least DNS_HEADER_SIZE
+    DnsWriter(char* buffer, size_t capacity) noexcept :
+        buffer(reinterpret_cast<uint8_t*>(buffer)), capacity(capacity), offset(DNS_HEADER_SIZE) {}
+
+    bool writeQuestion(std::string_view name, uint16_t type, uint16_t qClass) noexcept;
+    // RDATA is written as is, except names of RFC 1035 types which are compressed. Position of TTL is returned in ttlOffset
+    bool writeRecord(std::string_view name, uint16_t type, uint16_t rClass, uint32_t ttl, std::string_view rdata,
+                     uint16_t& ttlOffset) noexcept;
+
+    size_t size() const noexcept { return offset; }
+
+private:
+    struct Label
+    {
+        const char* data;
+        uint8_t length;
+    };
+    using Labels = std::array<Label, MAX_NAME_LABELS>;
+
+    // split dotted name into labels, returns false if it isn't a valid name
+    static bool textLabels(std::string_view name, Labels& labels, size_t& count) noexcept;
+    // labels of uncompressed name at the start of data, wireLength gets its size
+    static bool wireLabels(std::string_view data, Labels& labels, size_t& count, size_t& wireLength) noexcept;
+    // labels from first on are equal to the name written at the position
+    bool suffixAt(const Labels& labels, size_t first, size_t count, size_t at) const noexcept;
+    bool writeLabels(const Labels& labels, size_t count) noexcept;
+    bool writeName(std::string_view name) noexcept;
+    bool writeRdata(uint16_t type, std::string_view rdata) noexcept;
+    bool writeBytes(const void* data, size_t length) noexcept;
+    bool write16(uint16_t value) noexcept;
+    bool write32(uint32_t value) noexcept;
+    // drop everything written after the mark, with its dictionary entries
+    void rollback(size_t mark, size_t targetMark) noexcept;
+
+    uint8_t* buffer;
+    size_t capacity;
+    size_t offset;
+    std::array<uint16_t, MAX_COMPRESSION_TARGETS> targets;
+    size_t targetCount = 0;
+};
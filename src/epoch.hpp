@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+
+inline constexpr size_t MAX_EPOCH_THREADS = 1024;
+inline constexpr size_t EPOCH_RECLAIM_BATCH = 64;  // retired objects collected before trying to reclaim
+
+/// Epoch based memory reclamation for read-mostly structures
+/// Readers enter an epoch with Guard, that writes only to the reader's own cache line.
+/// Writers unlink objects and retire them, retired object is deleted after global epoch advanced twice,
+/// that is when every reader, that could see it, has left its critical section.
+/// Global epoch advances only when all active readers have observed the current one
+class EpochManager
+{
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<uint64_t> epoch{0};  // 0 while the thread is outside of critical section
+    };
+
+    struct Retired
+    {
+        uint64_t epoch;
+        void* object;
+        void (*deleter)(void*);
+    };
+
+    /// process-wide index of the thread, released on thread exit
+    class ThreadIndex
+    {
+        static inline std::array<std::atomic<bool>, MAX_EPOCH_THREADS> claimed{};
+        static inline std::atomic<size_t> highWater{0};
+
+    public:
+        size_t index = MAX_EPOCH_THREADS;
+
+        ThreadIndex() noexcept
+        {
+            for (size_t i = 0; i < MAX_EPOCH_THREADS; ++i)
+            {
+                if (!claimed[i].exchange(true, std::memory_order_acq_rel))
+                {
+                    index = i;
+                    size_t current = highWater.load(std::memory_order_relaxed);
+                    while (current < i + 1 && !highWater.compare_exchange_weak(current, i + 1, std::memory_order_acq_rel))
+                        ;
+                    break;
+                }
+            }
+        }
+        ~ThreadIndex()
+        {
+            if (index < MAX_EPOCH_THREADS)
+                claimed[index].store(false, std::memory_order_release);
+        }
+
+        static size_t count() noexcept { return highWater.load(std::memory_order_acquire); }
+    };
+
+    static size_t threadIndex() noexcept
+    {
+        thread_local ThreadIndex threadIndex;
+        return threadIndex.index;
+    }
+
+    // free objects, that no reader can see anymore. Called under retireMutex
+    void reclaim()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const uint64_t current = globalEpoch.load(std::memory_order_seq_cst);
+        bool canAdvance = true;
+        for (size_t i = 0, count = ThreadIndex::count(); i < count && canAdvance; ++i)
+        {
+            const uint64_t epoch = readers[i].epoch.load(std::memory_order_seq_cst);
+            canAdvance = epoch == 0 || epoch == current;
+        }
+        uint64_t expected = current;
+        if (canAdvance)
+            globalEpoch.compare_exchange_strong(expected, current + 1, std::memory_order_seq_cst);
+
+        const uint64_t safeEpoch = globalEpoch.load(std::memory_order_seq_cst);
+        size_t kept = 0;
+        for (size_t i = 0; i < retired.size(); ++i)
+        {
+            if (retired[i].epoch + 2 <= safeEpoch)
+                retired[i].deleter(retired[i].object);
+            else
+                retired[kept++] = retired[i];
+        }
+        retired.resize(kept);
+        retiredSinceReclaim = 0;
+    }
+
+    std::unique_ptr<ReaderSlot[]> readers;
+    std::atomic<uint64_t> globalEpoch{1};
+    std::mutex retireMutex;
+    std::vector<Retired> retired;
+    size_t retiredSinceReclaim = 0;
+
+public:
+    /// read-side critical section, objects loaded inside it are not deleted until it ends.
+    /// Not reentrant. If process has more than MAX_EPOCH_THREADS threads, guard of extra thread
+    /// is not active, caller should fall back to locking
+    class Guard
+    {
+        ReaderSlot* slot = nullptr;
+
+    public:
+        explicit Guard(EpochManager& manager) noexcept
+        {
+            const size_t index = threadIndex();
+            if (index >= MAX_EPOCH_THREADS)
+                return;
+            slot = &manager.readers[index];
+            // publish observed epoch, and recheck it, so writer either sees the reader or reader sees unlinked objects
+            uint64_t epoch = manager.globalEpoch.load(std::memory_order_seq_cst);
+            for (;;)
+            {
+                slot->epoch.store(epoch, std::memory_order_seq_cst);
+                const uint64_t current = manager.globalEpoch.load(std::memory_order_seq_cst);
+                if (current == epoch)
+                    break;
+                epoch = current;
+            }
+        }
+        ~Guard()
+        {
+            if (slot)
+                slot->epoch.store(0, std::memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        bool active() const noexcept { return slot != nullptr; }
+    };
+
+    EpochManager() :
+        readers(std::make_unique<ReaderSlot[]>(MAX_EPOCH_THREADS)) {}
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+    // no readers are expected at destruction
+    ~EpochManager()
+    {
+        for (const Retired& object : retired)
+            object.deleter(object.object);
+    }
+
+    /// delete the object, after readers, that could load it, leave their critical sections.
+    /// Object must be unlinked already
+    template<typename T>
+    void retire(T* object)
+    {
+        if (!object)
+            return;
+        std::lock_guard<std::mutex> lk(retireMutex);
+        retired.push_back({globalEpoch.load(std::memory_order_seq_cst), const_cast<std::remove_const_t<T>*>(object),
+                           [](void* ptr) { delete static_cast<T*>(ptr); }});
+        if (++retiredSinceReclaim >= EPOCH_RECLAIM_BATCH)
+            reclaim();
+    }
+
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lk(retireMutex);
+        return retired.size();
+    }
+};
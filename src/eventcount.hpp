@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+/// Event count for parking consumers of a non-blocking queue
+/// Consumer takes a key with prepareWait, checks the queue once more and then either cancels or waits with the key.
+/// Producer calls notify after publishing the item, it only touches the futex when someone is registered to wait,
+/// so submission stays a couple of atomic loads when consumers are busy. Key changes on every notify, so wake up
+/// between the check and the wait is never lost. Waiting uses std::atomic wait, that is a futex on Linux
+class EventCount
+{
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<uint32_t> waiters{0};
+
+public:
+    EventCount() = default;
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount&) = delete;
+
+    /// register as a waiter, queue should be checked again before wait
+    uint32_t prepareWait() noexcept
+    {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        return epoch.load(std::memory_order_seq_cst);
+    }
+
+    /// item was found after prepareWait
+    void cancelWait() noexcept
+    {
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /// block until notify after the key was taken, may return spuriously
+    void wait(uint32_t key) noexcept
+    {
+        epoch.wait(key, std::memory_order_seq_cst);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notifyOne() noexcept
+    {
+        // pairs with prepareWait: either the waiter sees the published item or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) == 0)
+            return;
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        epoch.notify_one();
+    }
+
+    void notifyAll() noexcept
+    {
+        epoch.fetch_add(1, std::memory_order_seq_cst);
+        epoch.notify_all();
+    }
+};
@@ -0,0 +1,210 @@
+#include "evictionpolicy.hpp"
+#include <algorithm>
+#include <bit>
+
+
+FrequencySketch::FrequencySketch(size_t expectedEntries) :
+    words(std::make_unique<std::atomic<uint64_t>[]>(std::bit_ceil(std::max(expectedEntries, SKETCH_MIN_WIDTH)))),
+    wordMask(std::bit_ceil(std::max(expectedEntries, SKETCH_MIN_WIDTH)) - 1),
+    sampleSize(static_cast<uint32_t>(std::min<size_t>((wordMask + 1) * 10, UINT32_MAX / 2)))
+{
+}
+
+uint64_t FrequencySketch::mix(uint64_t hash, unsigned row) noexcept
+{
+    uint64_t h = (hash + row * 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 31);
+}
+
+void FrequencySketch::record(uint64_t hash) noexcept
+{
+    bool added = false;
+    for (unsigned row = 0; row < 4; ++row)
+    {
+        const uint64_t h = mix(hash, row);
+        // every row owns 4 counters of a word
+        const unsigned shift = (row * 4 + (h >> 62)) * 4;
+        std::atomic<uint64_t>& word = words[h & wordMask];
+        const uint64_t value = word.load(std::memory_order_relaxed);
+        if (((value >> shift) & 0xF) < SKETCH_MAX_COUNT)
+        {
+            word.store(value + (uint64_t(1) << shift), std::memory_order_relaxed);
+            added = true;
+        }
+    }
+    if (added && ++additions == sampleSize)
+    {
+        halve();
+        additions -= sampleSize / 2;
+    }
+}
+
+uint8_t FrequencySketch::estimate(uint64_t hash) const noexcept
+{
+    uint8_t frequency = SKETCH_MAX_COUNT;
+    for (unsigned row = 0; row < 4; ++row)
+    {
+        const uint64_t h = mix(hash, row);
+        const unsigned shift = (row * 4 + (h >> 62)) * 4;
+        const uint8_t count = (words[h & wordMask].load(std::memory_order_relaxed) >> shift) & 0xF;
+        frequency = std::min(frequency, count);
+    }
+    return frequency;
+}
+
+void FrequencySketch::halve() noexcept
+{
+    for (size_t i = 0; i <= wordMask; ++i)
+        words[i].store((words[i].load(std::memory_order_relaxed) >> 1) & 0x7777777777777777ULL, std::memory_order_relaxed);
+}
+
+
+EvictionPolicy::EvictionPolicy(size_t maxBytes, size_t maxEntries) :
+    sketch(maxEntries ? maxEntries : maxBytes / EVICTION_BYTES_PER_ENTRY),
+    maxBytes(maxBytes), maxEntries(maxEntries)
+{
+}
+
+bool EvictionPolicy::overBudget() const noexcept
+{
+    return (maxBytes && bytes > maxBytes) || (maxEntries && residents.size() > maxEntries);
+}
+
+bool EvictionPolicy::smallQueueFull() const noexcept
+{
+    return (maxBytes && smallBytes * 100 > maxBytes * EVICTION_SMALL_QUEUE_PERCENT)
+        || (maxEntries && smallEntries * 100 > maxEntries * EVICTION_SMALL_QUEUE_PERCENT);
+}
+
+void EvictionPolicy::enqueue(uint64_t hash, Resident& resident, bool main)
+{
+    resident.sequence = nextSequence++;
+    resident.frequency = sketch.estimate(hash);
+    resident.main = main;
+    if (main)
+    {
+        mainQueue.emplace_back(hash, resident.sequence);
+        return;
+    }
+    smallQueue.emplace_back(hash, resident.sequence);
+    smallBytes += resident.cost;
+    ++smallEntries;
+}
+
+void EvictionPolicy::insert(uint64_t hash, size_t cost)
+{
+    cost += entryOverhead();
+    auto it = residents.find(hash);
+    if (it != residents.end())
+    {
+        // updated entry keeps its place in the queue
+        Resident& resident = it->second;
+        bytes = bytes - resident.cost + cost;
+        if (!resident.main)
+            smallBytes = smallBytes - resident.cost + cost;
+        resident.cost = cost;
+        return;
+    }
+    const bool main = ghosts.erase(hash) != 0;
+    Resident& resident = residents.emplace(hash, Resident{cost, 0, 0, false}).first->second;
+    bytes += cost;
+    enqueue(hash, resident, main);
+    compactQueues();
+}
+
+void EvictionPolicy::erase(uint64_t hash) noexcept
+{
+    auto it = residents.find(hash);
+    if (it == residents.end())
+        return;
+    if (!it->second.main)
+    {
+        smallBytes -= it->second.cost;
+        --smallEntries;
+    }
+    bytes -= it->second.cost;
+    residents.erase(it);
+}
+
+bool EvictionPolicy::front(std::deque<QueueRecord>& queue, bool main, uint64_t& hash)
+{
+    while (!queue.empty())
+    {
+        const auto [recordHash, sequence] = queue.front();
+        auto it = residents.find(recordHash);
+        if (it != residents.end() && it->second.sequence == sequence && it->second.main == main)
+        {
+            hash = recordHash;
+            return true;
+        }
+        queue.pop_front();  // erased or queued again later
+    }
+    return false;
+}
+
+void EvictionPolicy::remember(uint64_t hash)
+{
+    if (ghosts.insert(hash).second)
+        ghostQueue.push_back(hash);
+    // ghost queue remembers about as many keys as the cache holds
+    while (ghostQueue.size() > std::max(residents.size(), SKETCH_MIN_WIDTH))
+    {
+        ghosts.erase(ghostQueue.front());
+        ghostQueue.pop_front();
+    }
+}
+
+void EvictionPolicy::compactQueues()
+{
+    // records of erased entries are dropped from the queue heads lazily, expired ones may never reach the head
+    if (smallQueue.size() + mainQueue.size() <= residents.size() * 2 + SKETCH_MIN_WIDTH)
+        return;
+    auto isStale = [this](const QueueRecord& record) {
+        auto it = residents.find(record.first);
+        return it == residents.end() || it->second.sequence != record.second;
+    };
+    smallQueue.erase(std::remove_if(smallQueue.begin(), smallQueue.end(), isStale), smallQueue.end());
+    mainQueue.erase(std::remove_if(mainQueue.begin(), mainQueue.end(), isStale), mainQueue.end());
+}
+
+bool EvictionPolicy::selectVictim(uint64_t& victim)
+{
+    // every key of the main queue gets at most one more round per eviction
+    size_t secondChances = mainQueue.size();
+    for (;;)
+    {
+        uint64_t candidate, oldest;
+        const bool hasSmall = front(smallQueue, false, candidate);
+        const bool hasMain = front(mainQueue, true, oldest);
+        if (hasSmall && (smallQueueFull() || !hasMain))
+        {
+            smallQueue.pop_front();
+            Resident& resident = residents.at(candidate);
+            smallBytes -= resident.cost;
+            --smallEntries;
+            // admission: key is kept only if it's more popular than the one it would replace
+            if (sketch.estimate(candidate) > (hasMain ? sketch.estimate(oldest) : 1))
+            {
+                enqueue(candidate, resident, true);
+                continue;
+            }
+            resident.main = true;  // not in the small queue anymore
+            remember(candidate);
+            victim = candidate;
+            return true;
+        }
+        if (!hasMain)
+            return false;
+
+        mainQueue.pop_front();
+        Resident& resident = residents.at(oldest);
+        const uint8_t frequency = sketch.estimate(oldest);
+        if ((frequency > resident.frequency || frequency == SKETCH_MAX_COUNT) && secondChances-- > 0)
+        {
+            enqueue(oldest, resident, true);
+            continue;
+        }
+        victim = oldest;
+        return true;
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+
+inline constexpr uint8_t SKETCH_MAX_COUNT = 15;  // 4-bit counters
+inline constexpr size_t SKETCH_MIN_WIDTH = 64;
+inline constexpr size_t EVICTION_SMALL_QUEUE_PERCENT = 10;
+inline constexpr size_t EVICTION_BYTES_PER_ENTRY = 256;  // expected entry size, for sketch width of byte budget
+
+/// Count-min sketch of 4-bit counters, estimates how often a key was requested recently
+/// Every key has a counter in each of 4 rows, estimate is the minimum of them.
+/// When number of increments reaches 10 times the width, all counters are halved, so old popularity fades out.
+/// Records must be serialized by the caller, estimates are lock-free and may run concurrently with them
+class FrequencySketch
+{
+    std::unique_ptr<std::atomic<uint64_t>[]> words;  // 16 counters in each word
+    size_t wordMask;
+    uint32_t sampleSize;
+    uint32_t additions = 0;
+
+    static uint64_t mix(uint64_t hash, unsigned row) noexcept;
+    void halve() noexcept;
+
+public:
+    explicit FrequencySketch(size_t expectedEntries);
+
+    void record(uint64_t hash) noexcept;
+    uint8_t estimate(uint64_t hash) const noexcept;
+};
+
+
+/*
+    Scan resistant eviction policy of a cache shard, S3-FIFO with frequency based admission
+    New keys enter the small FIFO queue, that takes about 10% of the budget. When the small queue is full,
+    its oldest key is promoted to the main queue only if it's requested more often than the oldest key of the main queue,
+    otherwise it's evicted and remembered in the ghost queue. Keys seen in the ghost queue go straight to the main queue.
+    Main queue is FIFO, where keys requested since they were queued get another round.
+    So one-hit wonders leave through the small queue and don't push the hot working set out.
+    Policy tracks keys by table hash and charged bytes of every entry, its own bookkeeping is charged too.
+    Not thread-safe except frequency
+*/
+class EvictionPolicy
+{
+    struct Resident
+    {
+        size_t cost;
+        uint32_t sequence;  // matches the queue record, older records are stale
+        uint8_t frequency;  // sketch estimate when queued
+        bool main;
+    };
+
+    using QueueRecord = std::pair<uint64_t, uint32_t>;
+
+    bool overBudget() const noexcept;
+    bool smallQueueFull() const noexcept;
+    void enqueue(uint64_t hash, Resident& resident, bool main);
+    // pops stale records, returns false if queue is empty
+    bool front(std::deque<QueueRecord>& queue, bool main, uint64_t& hash);
+    void remember(uint64_t hash);
+    void compactQueues();
+    // returns key to evict or false if nothing can be evicted
+    bool selectVictim(uint64_t& victim);
+
+    mutable FrequencySketch sketch;
+    std::unordered_map<uint64_t, Resident> residents;
+    std::deque<QueueRecord> smallQueue;
+    std::deque<QueueRecord> mainQueue;
+    std::deque<uint64_t> ghostQueue;
+    std::unordered_set<uint64_t> ghosts;
+    size_t maxBytes;
+    size_t maxEntries;
+    size_t bytes = 0;
+    size_t smallBytes = 0;
+    size_t smallEntries = 0;
+    uint32_t nextSequence = 0;
+    uint64_t evictions = 0;
+
+public:
+    // 0 means no limit
+    EvictionPolicy(size_t maxBytes, size_t maxEntries);
+
+    // lookups are buffered by readers and recorded in batches by the shard writer
+    void recordAccess(uint64_t hash) const noexcept { sketch.record(hash); }
+    // how often the key was requested recently, lock-free
+    uint8_t frequency(uint64_t hash) const noexcept { return sketch.estimate(hash); }
+    // new or updated entry with charged size
+    void insert(uint64_t hash, size_t cost);
+    // bytes of residents node with its bucket and queue record, charged for every entry
+    static constexpr size_t entryOverhead() noexcept
+    {
+        return sizeof (std::pair<const uint64_t, Resident>) + 2 * sizeof (void*) + sizeof (QueueRecord);
+    }
+    // entry is erased from the table by the owner
+    void erase(uint64_t hash) noexcept;
+    // erase entries by the erase function until the shard fits the budget
+    template<typename F>
+    void evict(F&& eraseEntry)
+    {
+        uint64_t victim;
+        while (overBudget() && selectVictim(victim))
+        {
+            eraseEntry(victim);
+            erase(victim);
+            ++evictions;
+        }
+    }
+
+    size_t size() const noexcept { return residents.size(); }
+    size_t chargedBytes() const noexcept { return bytes; }
+    uint64_t evicted() const noexcept { return evictions; }
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "epoch.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+inline constexpr size_t FLAT_TABLE_GROUP_SIZE = 16;
+inline constexpr size_t NAME_ARENA_CHUNK_SIZE = 64 * 1024;
+
+/// Append-only storage for interned names
+/// Names are packed into large chunks, that never move, so pointers to names stay valid for the arena lifetime.
+/// Not thread-safe
+class NameArena
+{
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* current = nullptr;
+    size_t remaining = 0;
+    size_t allocated = 0;
+
+public:
+    const char* intern(std::string_view name)
+    {
+        if (name.size() > remaining)
+        {
+            const size_t chunkSize = std::max(NAME_ARENA_CHUNK_SIZE, name.size());
+            chunks.push_back(std::make_unique<char[]>(chunkSize));
+            allocated += chunkSize;
+            if (chunkSize > NAME_ARENA_CHUNK_SIZE)
+            {  // dedicated chunk for huge name, keep filling the current one
+                std::memcpy(chunks.back().get(), name.data(), name.size());
+                return chunks.back().get();
+            }
+            current = chunks.back().get();
+            remaining = chunkSize;
+        }
+        char* result = current;
+        std::memcpy(result, name.data(), name.size());
+        current += name.size();
+        remaining -= name.size();
+        return result;
+    }
+
+    size_t allocatedBytes() const noexcept { return allocated; }
+};
+
+/// Open-addressing hash table keyed by name, in the style of Swiss tables
+/// Slots are grouped by 16, every slot has a control byte with 7 bits of the name hash,
+/// so a probe compares the whole group with one SSE2 instruction and touches slots only on hash match.
+/// Slots keep full hash and pointer to the name interned in the table arena, caller provides the hash,
+/// so it can be shared with shard selection.
+/// Lookups take no lock and may run concurrently with one writer: slot is filled before its control byte
+/// is published, values are immutable and replaced by atomic pointer swap, table is replaced as a whole on rehash.
+/// Erased slots become tombstones until rehash, that also compacts names into a new arena.
+/// Replaced values, tables and arenas are reclaimed by EpochManager, readers must be inside its Guard.
+/// Writers must be serialized by the caller
+template<typename Value>
+class FlatTable
+{
+    static constexpr int8_t CTRL_EMPTY = -128;
+    static constexpr int8_t CTRL_DELETED = -2;
+    static constexpr size_t MIN_GROUPS = 1;
+
+    struct Slot
+    {
+        uint64_t hash = 0;
+        const char* name = nullptr;
+        uint16_t nameLength = 0;
+        std::atomic<const Value*> value{nullptr};
+    };
+
+    struct Table
+    {
+        explicit Table(size_t groupCount) :
+            groupMask(groupCount - 1),
+            ctrl(std::make_unique<int8_t[]>(groupCount * FLAT_TABLE_GROUP_SIZE)),
+            slots(std::make_unique<Slot[]>(groupCount * FLAT_TABLE_GROUP_SIZE))
+        {
+            std::memset(ctrl.get(), CTRL_EMPTY, groupCount * FLAT_TABLE_GROUP_SIZE);
+        }
+
+        size_t capacity() const noexcept { return (groupMask + 1) * FLAT_TABLE_GROUP_SIZE; }
+        size_t firstGroup(uint64_t hash) const noexcept { return (hash >> 7) & groupMask; }
+
+        const size_t groupMask;
+        std::unique_ptr<int8_t[]> ctrl;
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    // control bytes are read while writer may publish new ones, byte stores are single-copy atomic,
+    // and the fence orders following slot reads after the load
+    static uint32_t matchByte(const int8_t* group, int8_t byte) noexcept
+    {
+#ifdef __SSE2__
+        const __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < FLAT_TABLE_GROUP_SIZE; ++i)
+        {
+            const int8_t ctrl = std::atomic_ref<const int8_t>(group[i]).load(std::memory_order_acquire);
+            mask |= static_cast<uint32_t>(ctrl == byte) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static int8_t controlByte(uint64_t hash) noexcept { return static_cast<int8_t>(hash & 0x7F); }
+
+    // slot with the name or nullptr
+    static Slot* findSlot(const Table* table, std::string_view name, uint64_t hash) noexcept
+    {
+        if (!table)
+            return nullptr;
+        size_t group = table->firstGroup(hash);
+        for (size_t probe = 1;; ++probe)
+        {
+            const int8_t* ctrlGroup = table->ctrl.get() + group * FLAT_TABLE_GROUP_SIZE;
+            for (uint32_t match = matchByte(ctrlGroup, controlByte(hash)); match != 0; match &= match - 1)
+            {
+                Slot& slot = table->slots[group * FLAT_TABLE_GROUP_SIZE + __builtin_ctz(match)];
+                // value is cleared before slot becomes tombstone, reader may still see the old control byte
+                if (slot.hash == hash && std::string_view(slot.name, slot.nameLength) == name
+                    && slot.value.load(std::memory_order_acquire))
+                    return &slot;
+            }
+            if (matchByte(ctrlGroup, CTRL_EMPTY) != 0)
+                return nullptr;
+            group = (group + probe) & table->groupMask;  // triangular probing visits every group
+        }
+    }
+
+    // index of the first empty slot on the probe sequence, table must have one.
+    // Tombstones are not reused, reader may still compare the name of erased slot
+    static size_t findEmpty(const Table* table, uint64_t hash) noexcept
+    {
+        size_t group = table->firstGroup(hash);
+        for (size_t probe = 1;; ++probe)
+        {
+            const uint32_t match = matchByte(table->ctrl.get() + group * FLAT_TABLE_GROUP_SIZE, CTRL_EMPTY);
+            if (match != 0)
+                return group * FLAT_TABLE_GROUP_SIZE + __builtin_ctz(match);
+            group = (group + probe) & table->groupMask;
+        }
+    }
+
+    // fill the slot, then publish its control byte for readers
+    static void publishSlot(Table* table, size_t index, uint64_t hash, const char* name, uint16_t nameLength, const Value* value) noexcept
+    {
+        Slot& slot = table->slots[index];
+        slot.hash = hash;
+        slot.name = name;
+        slot.nameLength = nameLength;
+        slot.value.store(value, std::memory_order_relaxed);
+        std::atomic_ref<int8_t>(table->ctrl[index]).store(controlByte(hash), std::memory_order_release);
+    }
+
+    // build new table aside, so readers keep probing the old one until new is published.
+    // Tombstones are dropped and names of live slots are compacted into new arena
+    void rehash(size_t groupCount)
+    {
+        Table* oldTable = table.load(std::memory_order_relaxed);
+        auto newTable = std::make_unique<Table>(groupCount);
+        auto newArena = std::make_unique<NameArena>();
+        if (oldTable)
+        {
+            for (size_t i = 0; i < oldTable->capacity(); ++i)
+            {
+                if (oldTable->ctrl[i] < 0)
+                    continue;  // empty or deleted
+                const Slot& slot = oldTable->slots[i];
+                const char* name = newArena->intern(std::string_view(slot.name, slot.nameLength));
+                publishSlot(newTable.get(), findEmpty(newTable.get(), slot.hash), slot.hash, name, slot.nameLength,
+                            slot.value.load(std::memory_order_relaxed));
+            }
+        }
+        table.store(newTable.release(), std::memory_order_release);
+        deleted = 0;
+        // values moved to the new table, names are still read from the old arena through the old table
+        epochs.retire(oldTable);
+        epochs.retire(arena.release());
+        arena = std::move(newArena);
+    }
+
+    std::atomic<Table*> table{nullptr};
+    std::unique_ptr<NameArena> arena = std::make_unique<NameArena>();
+    size_t count = 0;
+    size_t deleted = 0;
+    EpochManager& epochs;
+
+public:
+    explicit FlatTable(EpochManager& epochs) :
+        epochs(epochs) {}
+    FlatTable(const FlatTable&) = delete;
+    FlatTable& operator=(const FlatTable&) = delete;
+    ~FlatTable()
+    {
+        Table* current = table.load(std::memory_order_relaxed);
+        if (!current)
+            return;
+        for (size_t i = 0; i < current->capacity(); ++i)
+            delete current->slots[i].value.load(std::memory_order_relaxed);
+        delete current;
+    }
+
+    /// lock-free lookup, returned value stays valid until the reader leaves epoch Guard
+    const Value* find(std::string_view name, uint64_t hash) const noexcept
+    {
+        const Slot* slot = findSlot(table.load(std::memory_order_acquire), name, hash);
+        return slot ? slot->value.load(std::memory_order_acquire) : nullptr;
+    }
+
+    /// publish new version of the value, the name is interned in the table arena if it is new.
+    /// Returns the stored copy
+    const Value& insertOrAssign(std::string_view name, uint64_t hash, const Value& value)
+    {
+        auto newValue = std::make_unique<const Value>(value);
+        const Value& stored = *newValue;
+        Table* current = table.load(std::memory_order_relaxed);
+        if (Slot* slot = findSlot(current, name, hash))
+        {
+            epochs.retire(slot->value.exchange(newValue.release(), std::memory_order_acq_rel));
+            return stored;
+        }
+        // keep load factor with tombstones under 7/8, so probe sequences stay short and always end with empty slot.
+        // Table grows if live entries take more than half of it, otherwise it's rebuilt to drop tombstones
+        if (!current)
+            rehash(MIN_GROUPS);
+        else if ((count + deleted + 1) * 8 > current->capacity() * 7)
+            rehash((count + 1) * 2 > current->capacity() ? (current->groupMask + 1) * 2 : current->groupMask + 1);
+
+        current = table.load(std::memory_order_relaxed);
+        const char* internedName = arena->intern(name);
+        publishSlot(current, findEmpty(current, hash), hash, internedName, static_cast<uint16_t>(name.size()), newValue.release());
+        ++count;
+        return stored;
+    }
+
+    /// erase entries with the hash, for which predicate on the value returns true.
+    /// Used when the name is not known, full hash collisions are resolved by the predicate
+    template<typename F>
+    size_t eraseIf(uint64_t hash, F&& predicate)
+    {
+        Table* current = table.load(std::memory_order_relaxed);
+        if (!current)
+            return 0;
+        size_t erased = 0;
+        size_t group = current->firstGroup(hash);
+        for (size_t probe = 1;; ++probe)
+        {
+            int8_t* ctrlGroup = current->ctrl.get() + group * FLAT_TABLE_GROUP_SIZE;
+            for (uint32_t match = matchByte(ctrlGroup, controlByte(hash)); match != 0; match &= match - 1)
+            {
+                const size_t index = group * FLAT_TABLE_GROUP_SIZE + __builtin_ctz(match);
+                Slot& slot = current->slots[index];
+                const Value* value = slot.value.load(std::memory_order_relaxed);
+                if (slot.hash != hash || !predicate(*value))
+                    continue;
+                slot.value.store(nullptr, std::memory_order_release);
+                std::atomic_ref<int8_t>(current->ctrl[index]).store(CTRL_DELETED, std::memory_order_release);
+                epochs.retire(value);
+                --count;
+                ++deleted;
+                ++erased;
+            }
+            if (matchByte(ctrlGroup, CTRL_EMPTY) != 0)
+                return erased;
+            group = (group + probe) & current->groupMask;
+        }
+    }
+
+    /// visit all entries, writers must be excluded by the caller
+    template<typename F>
+    void forEach(F&& visitor) const
+    {
+        const Table* current = table.load(std::memory_order_acquire);
+        for (size_t i = 0; current && i < current->capacity(); ++i)
+            if (current->ctrl[i] >= 0)
+                visitor(std::string_view(current->slots[i].name, current->slots[i].nameLength), *current->slots[i].value.load(std::memory_order_acquire));
+    }
+
+    size_t size() const noexcept { return count; }
+    // slot and its control byte, taken by every entry
+    static constexpr size_t slotBytes() noexcept { return sizeof (Slot) + 1; }
+    size_t capacity() const noexcept
+    {
+        const Table* current = table.load(std::memory_order_acquire);
+        return current ? current->capacity() : 0;
+    }
+    size_t memoryUsage() const noexcept { return capacity() * (sizeof (Slot) + 1) + count * sizeof (Value) + arena->allocatedBytes(); }
+};
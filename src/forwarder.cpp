@@ -0,0 +1,367 @@
+#include "forwarder.hpp"
+#include "dnsexception.hpp"
+#include "dnsparser.hpp"
+#include "logger.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+
+Forwarder::Forwarder(const sockaddr_in& fwdServerAddr, unsigned socketCount, uint16_t udpPayload, ThreadPool* pool) :
+    serverAddr(fwdServerAddr), udpPayload(udpPayload), pool(pool)
+{
+    if (socketCount < 1 || socketCount > MAX_UPSTREAM_SOCKETS)
+        throw std::runtime_error("Invalid upstream sockets number, should be in range [1, " + std::to_string(MAX_UPSTREAM_SOCKETS) + "]");
+    try
+    {
+        epollFD = epoll_create1(0);
+        if (epollFD < 0)
+            throw std::runtime_error("Failed to create epoll instance for Forwarder");
+
+        for (unsigned i = 0; i < socketCount; ++i)
+        {
+            int sockFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (sockFD < 0)
+                throw std::runtime_error("Failed to create socket for Forward Server");
+            sockets.push_back(sockFD);
+            // connected socket receives datagrams only from the Forward Server
+            if (connect(sockFD, (const struct sockaddr*) &fwdServerAddr, sizeof (fwdServerAddr)) != 0)
+                throw std::runtime_error("Failed to connect socket to Forward Server");
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = sockFD;
+            if (epoll_ctl(epollFD, EPOLL_CTL_ADD, sockFD, &event) != 0)
+                throw std::runtime_error("Failed to add Forward Server socket to epoll");
+        }
+
+        timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (timerFD < 0)
+            throw std::runtime_error("Failed to create timer for Forwarder");
+        itimerspec tick{};
+        tick.it_interval.tv_nsec = FWD_TICK_INTERVAL * 1000000LL;
+        tick.it_value = tick.it_interval;
+        if (timerfd_settime(timerFD, 0, &tick, nullptr) != 0)
+            throw std::runtime_error("Failed to start timer for Forwarder");
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = timerFD;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &event) != 0)
+            throw std::runtime_error("Failed to add Forwarder timer to epoll");
+
+        processingThread = std::thread(&Forwarder::run, this);
+    } catch (std::exception& e) {
+        for (int sockFD : sockets)
+            close(sockFD);
+        if (timerFD >= 0)
+            close(timerFD);
+        if (epollFD >= 0)
+            close(epollFD);
+        throw;
+    }
+}
+
+Forwarder::~Forwarder()
+{
+    stop();
+    lastLoggedForwarded = 0;
+    logStats();
+    for (int sockFD : sockets)
+        close(sockFD);
+    for (const auto& stream : streams)
+        close(stream.first);
+    close(timerFD);
+    close(epollFD);
+}
+
+void Forwarder::stop() noexcept
+{
+    done = true;  // thread checks the flag on every timer tick
+    if (processingThread.joinable())
+        processingThread.join();
+}
+
+void Forwarder::forward(const DNSQuery& query, Callback callback)
+{
+    if (done)
+        throw DNSException(DNSHeader::ServerFail, query.getId(), "Forwarder is stopped.");
+
+    typename ForwardTable<Pending>::InsertResult inserted;
+    try
+    {
+        std::lock_guard<std::mutex> lk(tableMutex);
+        inserted = table.insert(QuestionKey::fromQuery(query.getData()), Pending{std::move(callback), query.getId()});
+    } catch (std::runtime_error& e) {
+        throw DNSException(DNSHeader::ServerFail, query.getId(), e.what());
+    }
+    if (inserted.coalesced)
+        return;  // will be answered with response to the query in flight
+
+    char buffer[BUFF_SIZE];
+    DNSQuery upstreamQuery = query;
+    const int size = upstreamQuery.write(buffer, udpPayload);
+    buffer[0] = static_cast<char>(inserted.id >> 8);
+    buffer[1] = static_cast<char>(inserted.id & 0xFF);
+
+    const int sockFD = sockets[nextSocket.fetch_add(1, std::memory_order_relaxed) % sockets.size()];
+    if (send(sockFD, buffer, size, 0) == -1)
+    {  // socket buffer is full or upstream is unreachable, don't wait for it
+        std::vector<Pending> waiters;
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            waiters = table.take(inserted.id);
+        }
+        // first waiter is this query, others could attach meanwhile
+        for (size_t i = 1; i < waiters.size(); ++i)
+            complete(std::move(waiters[i].callback), nullptr, 0);
+        throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to send query to Forward Server, consider restarting the server with another forward server.");
+    }
+}
+
+void Forwarder::run() noexcept
+{
+    std::array<epoll_event, MAX_UPSTREAM_SOCKETS + 1> events;
+    while (!done)
+    {
+        int eventCount = epoll_wait(epollFD, events.data(), events.size(), -1);
+        if (eventCount < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            const std::string logMsg(std::string("Forwarder Error waiting for events: ") + std::strerror(errno));
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+            return;
+        }
+        for (int i = 0; i < eventCount; ++i)
+        {
+            try
+            {
+                if (events[i].data.fd == timerFD)
+                    expirePending();
+                else if (streams.count(events[i].data.fd))
+                    serveStream(events[i].data.fd, events[i].events);
+                else
+                    receiveResponses(events[i].data.fd);
+            } catch (std::exception& e) {
+                const std::string logMsg(std::string("Forwarder Error: ") + e.what());
+                Logger::logError(logMsg);
+                Logger::logToStdout(logMsg);
+            }
+        }
+    }
+}
+
+void Forwarder::receiveResponses(int sockFD)
+{
+    char buffer[MAX_UDP_PAYLOAD];
+    for (;;)
+    {
+        const int size = recv(sockFD, buffer, MAX_UDP_PAYLOAD, 0);
+        if (size < 0)
+            return;  // drained the socket
+        if (size < DNSHeader::headerOffset)
+            continue;
+
+        const uint16_t upstreamId = (static_cast<uint8_t>(buffer[0]) << 8) | static_cast<uint8_t>(buffer[1]);
+        std::vector<Pending> waiters;
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            waiters = table.take(upstreamId);
+        }
+        // empty for late response to timed out query or unsolicited datagram
+        if (waiters.empty())
+            continue;
+        if (buffer[2] & (DNSHeader::mask_tc >> 8))
+            retryOverStream(std::move(waiters), buffer, size);
+        else
+            completeWaiters(waiters, buffer, size);
+    }
+}
+
+void Forwarder::completeWaiters(std::vector<Pending>& waiters, char* packet, int size) noexcept
+{
+    for (auto& pending : waiters)
+    {
+        packet[0] = static_cast<char>(pending.clientId >> 8);
+        packet[1] = static_cast<char>(pending.clientId & 0xFF);
+        complete(std::move(pending.callback), packet, size);
+    }
+}
+
+void Forwarder::retryOverStream(std::vector<Pending>&& waiters, char* packet, int size)
+{
+    // question of the answer is sent back as query, with the same upstream id and RD flag
+    DnsParser parser(packet, size);
+    DnsName name;
+    uint16_t type, qClass;
+    if (streams.size() >= MAX_UPSTREAM_STREAMS || parser.read16(4) != 1 || !parser.readQuestion(name, type, qClass))
+        return completeWaiters(waiters, packet, size);
+
+    const int sockFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockFD < 0)
+        return completeWaiters(waiters, packet, size);
+    epoll_event event{};
+    event.events = EPOLLOUT;  // connected
+    event.data.fd = sockFD;
+    if ((connect(sockFD, (const struct sockaddr*) &serverAddr, sizeof (serverAddr)) != 0 && errno != EINPROGRESS)
+        || epoll_ctl(epollFD, EPOLL_CTL_ADD, sockFD, &event) != 0)
+    {
+        close(sockFD);
+        return completeWaiters(waiters, packet, size);
+    }
+
+    StreamQuery& stream = streams[sockFD];
+    stream.waiters = std::move(waiters);
+    stream.truncated.assign(packet, size);
+    const size_t querySize = parser.position();
+    stream.output.reserve(querySize + 2);
+    stream.output.push_back(static_cast<char>(querySize >> 8));
+    stream.output.push_back(static_cast<char>(querySize & 0xFF));
+    stream.output.append(packet, querySize);
+    char* header = stream.output.data() + 2;
+    header[2] = static_cast<char>(header[2] & (DNSHeader::mask_rd >> 8));
+    header[3] = 0;
+    std::fill(header + 6, header + DNSHeader::headerOffset, 0);  // no answer, authority and additional records
+    stream.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FWD_TIMEOUT);
+    ++streamRetries;
+}
+
+void Forwarder::serveStream(int sockFD, uint32_t events)
+{
+    StreamQuery& stream = streams.at(sockFD);
+    if (!stream.output.empty())
+    {
+        int error = 0;
+        socklen_t length = sizeof (error);
+        if (getsockopt(sockFD, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+            return finishStream(sockFD, false);
+        const ssize_t sent = send(sockFD, stream.output.data(), stream.output.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return finishStream(sockFD, false);
+        if (sent > 0)
+            stream.output.erase(0, sent);
+        if (!stream.output.empty())
+            return;  // rest is sent when socket is writable again
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = sockFD;
+        if (epoll_ctl(epollFD, EPOLL_CTL_MOD, sockFD, &event) != 0)
+            finishStream(sockFD, false);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+
+    char buffer[MAX_UDP_PAYLOAD];
+    for (;;)
+    {
+        const ssize_t size = recv(sockFD, buffer, sizeof (buffer), 0);
+        if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            return finishStream(sockFD, false);  // closed before the whole response
+        if (size < 0)
+            return;
+        stream.input.append(buffer, size);
+        if (stream.input.size() < 2)
+            continue;
+        const size_t length = (static_cast<uint8_t>(stream.input[0]) << 8) | static_cast<uint8_t>(stream.input[1]);
+        if (stream.input.size() >= length + 2)
+            return finishStream(sockFD, true);
+    }
+}
+
+void Forwarder::finishStream(int sockFD, bool answered) noexcept
+{
+    auto it = streams.find(sockFD);
+    StreamQuery stream = std::move(it->second);
+    streams.erase(it);
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, sockFD, nullptr);
+    close(sockFD);
+
+    if (answered)
+    {
+        // response is matched by the upstream id, that is kept in the truncated answer
+        char* response = stream.input.data() + 2;
+        const int size = (static_cast<uint8_t>(stream.input[0]) << 8) | static_cast<uint8_t>(stream.input[1]);
+        if (size >= DNSHeader::headerOffset && response[0] == stream.truncated[0] && response[1] == stream.truncated[1])
+            return completeWaiters(stream.waiters, response, size);
+    }
+    completeWaiters(stream.waiters, stream.truncated.data(), static_cast<int>(stream.truncated.size()));
+}
+
+void Forwarder::expirePending()
+{
+    uint64_t expirations;
+    if (read(timerFD, &expirations, sizeof (expirations)) < 0)
+        return;
+
+    std::vector<Pending> expired;
+    {
+        std::lock_guard<std::mutex> lk(tableMutex);
+        table.expire(std::chrono::steady_clock::now(), [&expired](Pending&& pending) { expired.push_back(std::move(pending)); });
+    }
+    for (auto& pending : expired)
+        complete(std::move(pending.callback), nullptr, 0);
+
+    // TCP retry that takes too long is given up, truncated answer is better than none
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<int> expiredStreams;
+    for (const auto& stream : streams)
+        if (stream.second.deadline <= now)
+            expiredStreams.push_back(stream.first);
+    for (int sockFD : expiredStreams)
+        finishStream(sockFD, false);
+
+    if (std::chrono::steady_clock::now() - lastStatsLogTime > std::chrono::seconds(FWD_STATS_LOG_INTERVAL))
+        logStats();
+}
+
+void Forwarder::logStats() noexcept
+{
+    try
+    {
+        uint64_t forwarded, coalesced;
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            forwarded = table.forwarded();
+            coalesced = table.coalesced();
+        }
+        lastStatsLogTime = std::chrono::steady_clock::now();
+        if (forwarded == lastLoggedForwarded)
+            return;  // nothing new to report
+        lastLoggedForwarded = forwarded;
+        const std::string logMsg("Forwarder stats: upstream queries: " + std::to_string(forwarded)
+                                 + ", coalesced queries: " + std::to_string(coalesced)
+                                 + ", retried over TCP: " + std::to_string(streamRetries));
+        Logger::logInfo(logMsg);
+        Logger::logToStdout(logMsg);
+    } catch (std::exception& e) {
+        Logger::logToStdout(std::string("Forwarder Error logging stats: ") + e.what());
+    }
+}
+
+void Forwarder::complete(Callback&& callback, const char* packet, int size) noexcept
+{
+    try
+    {
+        if (!pool)
+            return callback(packet, size);
+
+        std::vector<char> response(packet, packet + size);
+        ThreadPool::Task task([callback = std::move(callback), response = std::move(response)]() {
+            callback(response.empty() ? nullptr : response.data(), static_cast<int>(response.size()));
+        });
+        // completion can't be dropped, coalesced queries wait for it too, so it runs here when the pool is saturated
+        if (!pool->trySubmit(task))
+            task();
+    } catch (std::exception& e) {
+        const std::string logMsg(std::string("Forwarder Error delivering completion: ") + e.what());
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
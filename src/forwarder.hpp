@@ -0,0 +1,217 @@
+#pragma once
+
+#include "dnsmessage.hpp"
+#include "threadpool.hpp"
+#include <netinet/in.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+inline constexpr int FWD_TIMEOUT = 5000;  // in millisec
+inline constexpr int FWD_TICK_INTERVAL = 100;  // in millisec, resolution of forward timeouts
+inline constexpr size_t MAX_PENDING_FORWARDS = 16384;
+inline constexpr unsigned MAX_UPSTREAM_SOCKETS = 64;
+inline constexpr int FWD_STATS_LOG_INTERVAL = 10;  // in sec
+inline constexpr size_t MAX_UPSTREAM_STREAMS = 256;  // truncated answers retried over TCP at once, others are passed on as is
+
+/// Table of queries in flight to the Forward Server, keyed by rewritten transaction id.
+/// Every query gets unique random id, so responses can be matched on shared upstream sockets.
+/// Concurrent queries with the same question are coalesced: they attach as waiters to the query in flight
+/// and are answered from its single response.
+/// Deadlines are kept in insertion order, that is also expiration order for the constant timeout.
+/// Not thread-safe
+template<typename T>
+class ForwardTable
+{
+    struct Entry
+    {
+        QuestionKey key;
+        std::vector<T> waiters;
+        uint32_t generation;
+    };
+    struct Deadline
+    {
+        std::chrono::steady_clock::time_point time;
+        uint16_t id;
+        uint32_t generation;  // id can be reused after response, so deadline is matched by generation too
+    };
+
+    std::unordered_map<uint16_t, Entry> entries;
+    std::unordered_map<QuestionKey, uint16_t> inflight;
+    std::deque<Deadline> deadlines;
+    std::mt19937 idGenerator;
+    uint32_t nextGeneration = 0;
+    std::chrono::milliseconds timeout;
+    size_t capacity;
+    uint64_t forwardedCount = 0;
+    uint64_t coalescedCount = 0;
+
+    void erase(typename std::unordered_map<uint16_t, Entry>::iterator it)
+    {
+        inflight.erase(it->second.key);
+        entries.erase(it);
+    }
+
+public:
+    struct InsertResult
+    {
+        uint16_t id;
+        bool coalesced;  // query with the same question is already in flight, nothing should be sent
+    };
+
+    ForwardTable(std::chrono::milliseconds timeout = std::chrono::milliseconds(FWD_TIMEOUT), size_t capacity = MAX_PENDING_FORWARDS) :
+        idGenerator(std::random_device()()), timeout(timeout), capacity(capacity)
+    {
+        entries.reserve(capacity);
+        inflight.reserve(capacity);
+    }
+
+    /// attach the value to the query in flight with the same question, or store it as a new query
+    /// and return transaction id for upstream query. Throws runtime_error if table is full
+    InsertResult insert(const QuestionKey& key, T&& value)
+    {
+        auto inflightIt = inflight.find(key);
+        if (inflightIt != inflight.end())
+        {
+            entries.at(inflightIt->second).waiters.push_back(std::move(value));
+            ++coalescedCount;
+            return {inflightIt->second, true};
+        }
+
+        if (entries.size() >= capacity)
+            throw std::runtime_error("Too many queries in flight to Forward Server");
+        uint16_t id;
+        do
+            id = static_cast<uint16_t>(idGenerator());
+        while (id == 0 || entries.count(id));
+
+        const uint32_t generation = nextGeneration++;
+        Entry entry{key, {}, generation};
+        entry.waiters.push_back(std::move(value));
+        entries.emplace(id, std::move(entry));
+        inflight.emplace(key, id);
+        deadlines.push_back({std::chrono::steady_clock::now() + timeout, id, generation});
+        ++forwardedCount;
+        return {id, false};
+    }
+
+    /// remove query of the upstream response and return all its waiters, first one is the query that was sent.
+    /// Empty if id is unknown (late or unsolicited response)
+    std::vector<T> take(uint16_t id)
+    {
+        auto it = entries.find(id);
+        if (it == entries.end())
+            return {};
+        std::vector<T> result(std::move(it->second.waiters));
+        erase(it);
+        return result;
+    }
+
+    /// remove queries with passed deadline and hand every waiter to the handler
+    template<typename F>
+    void expire(std::chrono::steady_clock::time_point now, F&& onExpired)
+    {
+        while (!deadlines.empty() && deadlines.front().time <= now)
+        {
+            const Deadline deadline = deadlines.front();
+            deadlines.pop_front();
+            auto it = entries.find(deadline.id);
+            if (it == entries.end() || it->second.generation != deadline.generation)
+                continue;  // already answered
+            std::vector<T> waiters(std::move(it->second.waiters));
+            erase(it);
+            for (auto& waiter : waiters)
+                onExpired(std::move(waiter));
+        }
+    }
+
+    size_t size() const noexcept { return entries.size(); }
+    // number of queries sent upstream
+    uint64_t forwarded() const noexcept { return forwardedCount; }
+    // number of queries answered from the response to another query in flight
+    uint64_t coalesced() const noexcept { return coalescedCount; }
+};
+
+/*
+    Asynchronous multiplexed forwarding engine
+    Queries are sent over a small set of long-lived non-blocking sockets connected to the Forward Server,
+    multiplexed by rewritten transaction id. Dedicated thread waits on the sockets and timeout timerfd with epoll,
+    matches responses and delivers completions to the thread pool, so processing threads never block on the network.
+    Concurrent cache misses for the same question share one upstream query.
+    Truncated answers are retried over a TCP connection to the Forward Server (RFC 7766 5), served by the same thread
+*/
+class Forwarder
+{
+public:
+    // called once with the response, that has original query id, or with nullptr on timeout
+    using Callback = std::function<void(const char* packet, int size)>;
+
+    // completions run in the pool, or in the forwarder thread if the pool is nullptr.
+    // Queries advertise udpPayload in OPT record, so Forward Server answers are not truncated at 512 bytes
+    Forwarder(const sockaddr_in& fwdServerAddr, unsigned socketCount, uint16_t udpPayload, ThreadPool* pool);
+    ~Forwarder();
+    Forwarder(const Forwarder&) = delete;
+    Forwarder& operator=(const Forwarder&) = delete;
+
+    /// send the query upstream or attach it to the query in flight with the same question,
+    /// callback is called when response arrives or query times out.
+    /// Throws DNSException if query can't be sent, callback is not called then
+    void forward(const DNSQuery& query, Callback callback);
+    /// stop forwarder thread, pending queries are not completed, new ones are rejected
+    void stop() noexcept;
+
+private:
+    struct Pending
+    {
+        Callback callback;
+        uint16_t clientId;
+    };
+    // query retried over TCP, touched only by the forwarder thread
+    struct StreamQuery
+    {
+        std::vector<Pending> waiters;
+        std::string truncated;  // UDP answer, waiters get it if the retry fails
+        std::string output;  // length-prefixed query, sent part is removed
+        std::string input;  // length-prefixed response received so far
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void run() noexcept;
+    void receiveResponses(int sockFD);
+    // restore id of every client query and complete it with the response
+    void completeWaiters(std::vector<Pending>& waiters, char* packet, int size) noexcept;
+    // resend the question of truncated answer over new TCP connection, waiters get the answer as is if it can't be sent
+    void retryOverStream(std::vector<Pending>&& waiters, char* packet, int size);
+    void serveStream(int sockFD, uint32_t events);
+    void finishStream(int sockFD, bool answered) noexcept;
+    void expirePending();
+    void complete(Callback&& callback, const char* packet, int size) noexcept;
+    void logStats() noexcept;
+
+    std::vector<int> sockets;
+    sockaddr_in serverAddr;
+    uint16_t udpPayload;
+    int epollFD = -1;
+    int timerFD = -1;
+    ThreadPool* pool;
+    std::mutex tableMutex;
+    ForwardTable<Pending> table;
+    std::unordered_map<int, StreamQuery> streams;  // by socket
+    uint64_t streamRetries = 0;
+    std::atomic<unsigned> nextSocket{0};
+    std::chrono::steady_clock::time_point lastStatsLogTime;
+    uint64_t lastLoggedForwarded = 0;
+    std::atomic_bool done{false};
+    std::thread processingThread;
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+
+enum class IoEngineType
+{
+    Blocking = 0,  // recvfrom/recvmmsg loop, cache misses go to the asynchronous Forwarder
+    Uring  // io_uring completion loop, forwards upstream from the same ring
+};
+
+/*
+    Network I/O backend of the server
+    Engine serves one listening socket: receives requests, passes them to the server
+    request processing stages and sends responses back to the clients
+*/
+class IoEngine
+{
+public:
+    virtual ~IoEngine() {}
+
+    // serve the socket in the calling thread, doesn't return until the server is stopped
+    virtual void serve() = 0;
+    virtual std::string name() const = 0;
+};
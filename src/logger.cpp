@@ -1,18 +1,25 @@
 #include "logger.hpp"
+#include "querylog.hpp"
 #include "queue.hpp"
 #include <bits/types/time_t.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
-#include <fstream>
-#include <iomanip>
 #include <memory>
-#include <sstream>
+#include <optional>
+#include <stdexcept>
 
 
 Logger::Logger()
 {
-    fileHandle.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    fileHandle.open(logFileName, std::ios::app);  // create file if doesn't exist
-    fileHandle.close();
+    openFile();  // create file if doesn't exist
+    batch.reserve(LOG_BATCH_SIZE + 1);
+    iovecs.reserve(3 * (LOG_BATCH_SIZE + 1));
+    queryChunks.reserve(QUERY_LOG_CHUNKS_PER_WRITE);
+    queryIovecs.reserve(QUERY_LOG_CHUNKS_PER_WRITE);
     processingThread = std::thread(processLogRequests);
     Logger::logToStdout("Logger created");
 }
@@ -20,52 +27,240 @@ Logger::Logger()
 Logger::~Logger()
 {
     keepProcessing = false;
-    Logger::instance().logInfo("Logger shutdown");  // also called to wake up processThread to exit main loop
+    Logger::instance().logInfo("Logger shutdown");
+    parking.notifyAll();  // wake up processThread to exit main loop
     processingThread.join();
+    // finish logging unprocessed tasks after thread shutdown, threads still running may hold partial query log chunks
+    if (queryLogFD >= 0)
+        flushQueryRecords();
+    while (writeQueryChunks());
+    while (writeBatch());
+    close(fileFD);
+    if (queryLogFD >= 0)
+        close(queryLogFD);
+    Logger::logToStdout("Logger destroyed");
+}
+
+void Logger::processLogRequests() noexcept
+{
+    Logger& logger = Logger::instance();
+    while(logger.keepProcessing)
+    {
+        const bool wroteChunks = logger.writeQueryChunks();
+        if (logger.writeBatch() || wroteChunks)
+            continue;
+        // queues are checked after registering as a waiter, so task enqueued in between is not missed
+        const uint32_t key = logger.parking.prepareWait();
+        if (logger.logQueue.size() != 0 || logger.queryLogQueue.size() != 0 || !logger.keepProcessing)
+            logger.parking.cancelWait();
+        else
+            logger.parking.wait(key);
+    }
+}
+
+void Logger::enqueue(LogTask&& task) noexcept
+{
+    if (!logQueue.tryEnqueue(std::move(task)))
+    {
+        droppedMessages.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    parking.notifyOne();
+}
+
+bool Logger::writeBatch() noexcept
+{
     try
     {
-        fileHandle.open(logFileName, std::ios::app);
-        while (auto task = logQueue.dequeue())  // finish logging unprocessed tasks after thread shutdown
+        batch.clear();
+        while (batch.size() < LOG_BATCH_SIZE)
+        {
+            std::optional<LogTask> task = logQueue.tryDequeue();
+            if (!task)
+                break;
+            batch.push_back(std::move(*task));
+        }
+        const uint64_t dropped = droppedMessages.load(std::memory_order_relaxed);
+        if (dropped != reportedDrops)
+        {
+            batch.push_back({LogLevel::WARNING, "Logger queue of " + std::to_string(LOG_QUEUE_CAPACITY) + " messages is full, dropped "
+                             + std::to_string(dropped - reportedDrops) + " messages, " + std::to_string(dropped) + " in total", std::time(nullptr)});
+            reportedDrops = dropped;
+        }
+        const uint64_t droppedChunks = droppedQueryChunks.load(std::memory_order_relaxed);
+        if (droppedChunks != reportedQueryDrops)
         {
-            const std::string logMsg = getLogStr(*task);
-            Logger::instance().fileHandle.write(logMsg.data(), std::size(logMsg));
+            batch.push_back({LogLevel::WARNING, "Logger query log queue of " + std::to_string(QUERY_LOG_QUEUE_CAPACITY) + " chunks is full, dropped "
+                             + std::to_string(droppedChunks - reportedQueryDrops) + " chunks of up to " + std::to_string(QUERY_LOG_CHUNK_RECORDS)
+                             + " records, " + std::to_string(droppedChunks) + " in total", std::time(nullptr)});
+            reportedQueryDrops = droppedChunks;
         }
-        fileHandle.close();
+        if (batch.empty())
+            return false;
+
+        for (const LogTask& task : batch)
+        {
+            if (!addEntry(task))
+            {
+                writeEntries();
+                addEntry(task);
+            }
+        }
+        writeEntries();
     } catch (std::exception& e) {
+        iovecs.clear();
+        pendingBytes = 0;
         logToStdout(std::string("Logger Error when writin log file: ") + e.what());
     }
-    Logger::logToStdout("Logger destroyed");
+    return true;
 }
 
-void Logger::processLogRequests() noexcept
+bool Logger::addEntry(const LogTask& task)
 {
-    while(Logger::instance().keepProcessing)
+    // queued entries point to the prefixes of their second, so they are written before prefixes change
+    if (task.time != prefixTime)
     {
-        try
+        if (!iovecs.empty())
+            return false;
+        updatePrefixes(task.time);
+    }
+    const std::string& prefix = prefixes[static_cast<size_t>(task.level)];
+    iovecs.push_back({const_cast<char*>(prefix.data()), prefix.size()});
+    iovecs.push_back({const_cast<char*>(task.msg.data()), task.msg.size()});
+    iovecs.push_back({const_cast<char*>("\n"), 1});
+    pendingBytes += prefix.size() + task.msg.size() + 1;
+    return true;
+}
+
+void Logger::writeEntries() noexcept
+{
+    if (iovecs.empty())
+        return;
+    try
+    {
+        // file is reopened, if the last rotation failed
+        const uint64_t maxSize = maxFileSize.load(std::memory_order_relaxed);
+        if (fileFD < 0)
+            openFile();
+        else if (maxSize != 0 && fileSize != 0 && fileSize + pendingBytes > maxSize)
+            rotateFile();
+    } catch (std::exception& e) {
+        logToStdout(std::string("Logger Error rotating log file: ") + e.what());
+    }
+
+    if (fileFD >= 0)
+        fileSize += writeVectors(fileFD, iovecs.data(), static_cast<int>(iovecs.size()));
+    iovecs.clear();
+    pendingBytes = 0;
+}
+
+bool Logger::writeQueryChunks() noexcept
+{
+    queryChunks.clear();
+    queryIovecs.clear();
+    while (queryChunks.size() < QUERY_LOG_CHUNKS_PER_WRITE)
+    {
+        std::optional<std::string> chunk = queryLogQueue.tryDequeue();
+        if (!chunk)
+            break;
+        queryChunks.push_back(std::move(*chunk));
+        queryIovecs.push_back({queryChunks.back().data(), queryChunks.back().size()});
+    }
+    if (queryChunks.empty())
+        return false;
+    if (queryLogFD >= 0)
+        writeVectors(queryLogFD, queryIovecs.data(), static_cast<int>(queryIovecs.size()));
+    return true;
+}
+
+size_t Logger::writeVectors(int fd, iovec* vec, int count) noexcept
+{
+    size_t total = 0;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, vec, count);
+        if (written < 0)
         {
-            if (std::unique_ptr<LogTask> task = Logger::instance().logQueue.waitDequeue())
-            {
-                const std::string logMsg = getLogStr(*task);
-                Logger::instance().fileHandle.open(logFileName, std::ios::app);
-                Logger::instance().fileHandle.write(logMsg.data(), std::size(logMsg));
-                Logger::instance().fileHandle.close();
-            }
-        } catch (std::exception& e) {
-            logToStdout(std::string("Logger Error when writin log file: ") + e.what());
+            if (errno == EINTR)
+                continue;
+            logToStdout(std::string("Logger Error when writin log file: ") + std::strerror(errno));
+            break;
         }
+        total += written;
+        // continue after partial write
+        while (count > 0 && static_cast<size_t>(written) >= vec->iov_len)
+        {
+            written -= vec->iov_len;
+            ++vec;
+            --count;
+        }
+        if (count > 0)
+        {
+            vec->iov_base = static_cast<char*>(vec->iov_base) + written;
+            vec->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+void Logger::updatePrefixes(time_t currTime)
+{
+    const std::string timeStr = getCurrentTimeStr(currTime);
+    for (const auto& [logLevel, name] : levelNames)
+        prefixes[static_cast<size_t>(logLevel)] = timeStr + separator + PROJECT_NAME + separator + name + separator;
+    prefixTime = currTime;
+}
+
+void Logger::openFile()
+{
+    fileFD = open(logFileName, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fileFD < 0)
+        throw std::runtime_error(std::string("Failed to open log file: ") + std::strerror(errno));
+    struct stat fileStat;
+    fileSize = fstat(fileFD, &fileStat) == 0 ? fileStat.st_size : 0;
+}
+
+void Logger::rotateFile()
+{
+    close(fileFD);
+    fileFD = -1;
+    const std::string name(logFileName);
+    const unsigned files = maxFiles.load(std::memory_order_relaxed);
+    if (files == 0)
+        unlink(name.c_str());
+    else
+    {
+        // the oldest file is replaced by the one before it
+        for (unsigned i = files; i > 1; --i)
+            std::rename((name + '.' + std::to_string(i - 1)).c_str(), (name + '.' + std::to_string(i)).c_str());
+        std::rename(name.c_str(), (name + ".1").c_str());
     }
+    openFile();
+}
+
+void Logger::configure(const LogConfig& config)
+{
+    if (config.maxFiles > MAX_LOG_FILES)
+        throw std::runtime_error("Invalid number of rotated log files, should be in range [0, " + std::to_string(MAX_LOG_FILES) + "]");
+    maxFileSize.store(config.maxFileSize, std::memory_order_relaxed);
+    maxFiles.store(config.maxFiles, std::memory_order_relaxed);
+    if (config.queryLogFile.empty() || queryLogFD >= 0)
+        return;
+    queryLogFD = open(config.queryLogFile.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (queryLogFD < 0)
+        throw std::runtime_error("Failed to open query log file " + config.queryLogFile + ": " + std::strerror(errno));
+    queryLogOn.store(true, std::memory_order_relaxed);
 }
 
 std::string Logger::getLogStr(const LogTask& task) noexcept
 {
-    std::ostringstream ss;
-    ss << getCurrentTimeStr(task.time) << separator << PROJECT_NAME << separator << levelNames.at(task.level) << separator << task.msg << '\n';
-    return ss.str();
+    return getCurrentTimeStr(task.time) + separator + PROJECT_NAME + separator + levelNames.at(task.level) + separator + task.msg + '\n';
 }
 
 std::string Logger::getCurrentTimeStr(time_t currTime) noexcept
 {
-    auto tm = *std::localtime(&currTime);
+    std::tm tm;
+    localtime_r(&currTime, &tm);
     char timeString[std::size("yyyy-mm-ddThh:mm:ssZ")];
     std::strftime(std::data(timeString), std::size(timeString), "%FT%TZ", &tm);
     return timeString;
@@ -88,10 +283,9 @@ void Logger::logMessage(LogLevel level, const std::string& msg) noexcept
 {
     if (instance().shouldLogLevel(level))
     {
-        LogTask task{level, msg, std::time(nullptr)};
         try
         {
-            instance().logQueue.enqueue(std::move(task));
+            instance().enqueue(LogTask{level, msg, std::time(nullptr)});
         } catch (std::exception& e) {
             logToStdout(std::string("Logger Error adding log message: ") + e.what());
         }
@@ -118,15 +312,21 @@ void Logger::logDebug(const std::string& msg) noexcept
     logMessage(LogLevel::DEBUG, msg);
 }
 
+void Logger::logQueryChunk(std::string&& chunk) noexcept
+{
+    Logger& logger = instance();
+    if (!logger.queryLogQueue.tryEnqueue(std::move(chunk)))
+    {
+        logger.droppedQueryChunks.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    logger.parking.notifyOne();
+}
+
 void Logger::logTask(LogTask task) noexcept
 {
     if (instance().shouldLogLevel(task.level))
     {
-        try
-        {
-            instance().logQueue.enqueue(std::move(task));
-        } catch (std::exception& e) {
-            logToStdout(std::string("Logger Error adding log message: ") + e.what());
-        }
+        instance().enqueue(std::move(task));
     }
 }
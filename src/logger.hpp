@@ -1,17 +1,28 @@
 #pragma once
 
+#include "eventcount.hpp"
 #include "queue.hpp"
+#include <sys/uio.h>
+#include <array>
 #include <atomic>
 #include <bits/types/time_t.h>
-#include <fstream>
+#include <cstdint>
 #include <string>
 #include <memory>
 #include <map>
 #include <thread>
 #include <ctime>
 #include <iostream>
+#include <vector>
 
 
+inline constexpr size_t LOG_QUEUE_CAPACITY = 65536;  // messages above it are dropped and counted
+inline constexpr size_t LOG_BATCH_SIZE = 256;  // messages per writev call, 3 iovecs each, within IOV_MAX
+inline constexpr unsigned DEFAULT_LOG_FILES = 4;
+inline constexpr unsigned MAX_LOG_FILES = 100;
+inline constexpr size_t QUERY_LOG_QUEUE_CAPACITY = 4096;  // chunks of binary query log, above it they are dropped and counted
+inline constexpr size_t QUERY_LOG_CHUNKS_PER_WRITE = 64;
+
 enum class LogLevel
 {
     WARNING = 0,
@@ -35,12 +46,28 @@ struct LogTask
     time_t time;
 };
 
+/// log file options, set from command line
+struct LogConfig
+{
+    // log file is moved to name.1 when it would grow over the size, older files are shifted up to name.maxFiles
+    // and the last one is removed. 0 disables rotation
+    uint64_t maxFileSize = 0;
+    unsigned maxFiles = DEFAULT_LOG_FILES;
+    // file of binary per-query log, that replaces text request lines, empty keeps text logging
+    std::string queryLogFile;
+};
+
 
 /*
     File logger singleton class
     Lazy initializes via instance() call and starts a dedicated processing thread
-    for writing log entries in a thread safe queue
-    thread then joins and finishes left over tasks in destructor
+    for writing log entries in a thread safe bounded queue, thread parks while the queue is empty.
+    Thread drains the queue in batches and writes every batch with a single writev to the file, that is kept open
+    with O_APPEND. Message text isn't copied, it's written between the line prefix, formatted once per second, and newline.
+    Producers never wait: message is dropped when the queue is full and the number of dropped ones is logged by the thread.
+    File is rotated by size, thread then joins and finishes left over tasks in destructor.
+    Binary query log chunks, framed by the threads, that process queries, come through their own queue
+    and are written to a separate file by the same thread
 */
 class Logger
 {
@@ -48,16 +75,50 @@ class Logger
     Logger();
 
     bool shouldLogLevel(LogLevel level) const noexcept { return level <= this->level; }
-    // wait for a task and write an entry to the file
+    // wait for tasks and write them to the file in batches
     static void processLogRequests() noexcept;
+    // put task into the queue, or count it as dropped, if the queue is full
+    void enqueue(LogTask&& task) noexcept;
+    // take up to LOG_BATCH_SIZE tasks from the queue and write them, returns false if there was nothing to write
+    bool writeBatch() noexcept;
+    // queue prefix, message and newline of the task, returns false if the batch should be written first
+    bool addEntry(const LogTask& task);
+    // write queued entries with writev, rotating the file before if it would grow over the limit
+    void writeEntries() noexcept;
+    // take up to QUERY_LOG_CHUNKS_PER_WRITE chunks and write them, returns false if there was nothing to write
+    bool writeQueryChunks() noexcept;
+    // write every vector, continuing after partial writes, returns number of bytes written
+    static size_t writeVectors(int fd, iovec* vec, int count) noexcept;
+    void updatePrefixes(time_t currTime);
+    void openFile();
+    void rotateFile();
     static std::string getLogStr(const LogTask& task) noexcept;
     static std::string getCurrentTimeStr(time_t currTime) noexcept;
     
-    std::ofstream fileHandle;
     LogLevel level = LogLevel::DEBUG;
     static constexpr auto logFileName = PROJECT_LOG_NAME;
     static constexpr auto separator = " - ";
-    LockFreeQueue<LogTask> logQueue;
+    BoundedQueue<LogTask> logQueue{LOG_QUEUE_CAPACITY};
+    EventCount parking;
+    std::atomic<uint64_t> droppedMessages{0};
+    BoundedQueue<std::string> queryLogQueue{QUERY_LOG_QUEUE_CAPACITY};
+    std::atomic<uint64_t> droppedQueryChunks{0};
+    std::atomic_bool queryLogOn{false};
+    int queryLogFD = -1;
+    std::atomic<uint64_t> maxFileSize{0};
+    std::atomic<unsigned> maxFiles{DEFAULT_LOG_FILES};
+    // writer state, owned by the processing thread
+    int fileFD = -1;
+    uint64_t fileSize = 0;
+    uint64_t reportedDrops = 0;
+    uint64_t reportedQueryDrops = 0;
+    std::vector<std::string> queryChunks;
+    std::vector<iovec> queryIovecs;
+    std::vector<LogTask> batch;
+    std::vector<iovec> iovecs;
+    size_t pendingBytes = 0;
+    time_t prefixTime = -1;
+    std::array<std::string, 4> prefixes;  // of the current second, by level
     std::thread processingThread;
     std::atomic_bool keepProcessing{true};
 
@@ -73,6 +134,9 @@ public:
     static Logger& instance();  // <- access through this
     static void logToStdout(const std::string& msg) noexcept;
     void setLevel(LogLevel level) noexcept { this->level = level; }
+    // set rotation options and open binary query log, throws runtime_error if they are invalid
+    void configure(const LogConfig& config);
+    static bool queryLogEnabled() noexcept { return instance().queryLogOn.load(std::memory_order_relaxed); }
     LogLevel getLevel() const noexcept { return level; }
 
     // send log task to the process thread for file logging
@@ -82,4 +146,6 @@ public:
     static void logInfo(const std::string& msg) noexcept;
     static void logDebug(const std::string& msg) noexcept;
     static void logTask(LogTask task) noexcept;
+    // send framed chunk of binary query log records to the process thread, it's dropped if the queue is full
+    static void logQueryChunk(std::string&& chunk) noexcept;
 };
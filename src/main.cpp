@@ -5,6 +5,8 @@
 #include <memory>
 #include <arpa/inet.h>
 #include <array>
+#include <string>
+#include <vector>
 
 
 void checkPortValid(int port)
@@ -23,6 +25,78 @@ static constexpr std::array<int, 6> SIGNALS_TO_INTERRUPT = {
 };
 
 
+// parse optional "--name=value" argument into config
+void parseOption(const std::string& option, ServerConfig& config)
+{
+    auto separatorPos = option.find('=');
+    if (separatorPos == std::string::npos)
+        throw std::runtime_error("Invalid option format: " + option);
+
+    const std::string name = option.substr(2, separatorPos - 2);
+    const std::string value = option.substr(separatorPos + 1);
+    if (name == "batch-size")
+        config.batchSize = std::stoul(value);
+    else if (name == "listeners")
+        config.listeners = std::stoul(value);
+    else if (name == "io-engine")
+    {
+        if (value == "blocking")
+            config.ioEngine = IoEngineType::Blocking;
+        else if (value == "uring")
+            config.ioEngine = IoEngineType::Uring;
+        else
+            throw std::runtime_error("Unknown io engine: " + value);
+    }
+    else if (name == "pool-scheduler")
+    {
+        if (value == "global")
+            config.poolScheduler = SchedulerType::GlobalQueue;
+        else if (value == "stealing")
+            config.poolScheduler = SchedulerType::WorkStealing;
+        else
+            throw std::runtime_error("Unknown pool scheduler: " + value);
+    }
+    else if (name == "upstream-sockets")
+        config.upstreamSockets = std::stoul(value);
+    else if (name == "edns-payload")
+    {
+        const unsigned long payload = std::stoul(value);
+        if (payload > MAX_UDP_PAYLOAD)
+            throw std::runtime_error("Invalid EDNS payload size: " + value);
+        config.udpPayload = static_cast<uint16_t>(payload);
+    }
+    else if (name == "tcp-max-connections")
+        config.tcpMaxConnections = std::stoul(value);
+    else if (name == "tcp-idle-timeout")
+        config.tcpIdleTimeout = std::stoul(value);
+    else if (name == "log-max-size")
+        config.log.maxFileSize = std::stoull(value);
+    else if (name == "log-files")
+        config.log.maxFiles = std::stoul(value);
+    else if (name == "query-log")
+        config.log.queryLogFile = value;
+    else if (name == "cache-shards")
+        config.cache.shards = std::stoul(value);
+    else if (name == "cache-min-ttl")
+        config.cache.minTtl = std::stoul(value);
+    else if (name == "cache-max-ttl")
+        config.cache.maxTtl = std::stoul(value);
+    else if (name == "cache-max-bytes")
+        config.cache.maxBytes = std::stoull(value);
+    else if (name == "cache-max-entries")
+        config.cache.maxEntries = std::stoull(value);
+    else if (name == "cache-max-negative-ttl")
+        config.cache.maxNegativeTtl = std::stoul(value);
+    else if (name == "cache-servfail-ttl")
+        config.cache.servfailTtl = std::stoul(value);
+    else if (name == "cache-prefetch")
+        config.cache.prefetchPercent = std::stoul(value);
+    else if (name == "cache-stale-time")
+        config.cache.staleTime = std::stoul(value);
+    else
+        throw std::runtime_error("Unknown option: " + name);
+}
+
 void handleServerInterrupt(int sig)
 {
     exit(sig);
@@ -49,22 +123,53 @@ int main(int argc, char* argv[])
         setupSigHandlers(handleServerInterrupt);
 
         // parse args
-        const std::string usage("Usage: dns_server port \"hosts_file_path\" \"forward_server_addr:fwd_srv_port\"(optional)");
+        const std::string usage("Usage: dns_server port \"hosts_file_path\" \"forward_server_addr:fwd_srv_port\"(optional) [options]\n"
+                                "Options:\n"
+                                "  --batch-size=N  datagrams per recvmmsg/sendmmsg call, 1 disables batching (default 1)\n"
+                                "  --listeners=N   SO_REUSEPORT listener threads processing requests in place, 0 uses thread pool (default 0)\n"
+                                "  --io-engine=E   network I/O backend: blocking or uring (default blocking)\n"
+                                "  --pool-scheduler=S  thread pool scheduling: global queue or per-worker stealing (default global)\n"
+                                "  --upstream-sockets=N  sockets to multiplex forwarded queries over (default 4)\n"
+                                "  --edns-payload=N  UDP payload size advertised with EDNS, in range [512, 4096] (default 1232)\n"
+                                "  --tcp-max-connections=N  TCP connections served at once, 0 disables TCP (default 16384)\n"
+                                "  --tcp-idle-timeout=S  idle TCP connection is closed after S sec, in range [1, 3600] (default 10)\n"
+                                "  --log-max-size=N  log file is rotated when it would grow over N bytes, 0 disables rotation (default 0)\n"
+                                "  --log-files=N  rotated log files kept, in range [0, 100] (default 4)\n"
+                                "  --query-log=PATH  write binary per-query records to PATH instead of text request lines\n"
+                                "  --cache-shards=N  independent cache shards with own locks, power of 2 (default 16)\n"
+                                "  --cache-min-ttl=S  lower bound for TTL of cached answers in sec (default 0)\n"
+                                "  --cache-max-ttl=S  upper bound for TTL of cached answers in sec (default 86400)\n"
+                                "  --cache-max-bytes=N  memory budget of cached answers, 0 is unlimited (default 67108864)\n"
+                                "  --cache-max-entries=N  number of cached answers, 0 is unlimited (default 0)\n"
+                                "  --cache-max-negative-ttl=S  upper bound for TTL of NXDOMAIN and NODATA answers in sec (default 3600)\n"
+                                "  --cache-servfail-ttl=S  how long upstream SERVFAIL is cached in sec, 0 disables (default 5)\n"
+                                "  --cache-prefetch=P  refresh popular answers when P percent of TTL remains, 0 disables (default 10)\n"
+                                "  --cache-stale-time=S  answer from expired entries up to S sec if upstream fails, 0 disables (default 86400)");
+        ServerConfig config;
+        std::vector<std::string> positionalArgs;
         std::string hosts;
         std::string fwdAddr;
         int port, fwdPort;
         sockaddr_in fwdServerAddr;
         try {
-            if (argc <= 2)
+            for (int i = 1; i < argc; ++i)
+            {
+                const std::string arg(argv[i]);
+                if (arg.rfind("--", 0) == 0)
+                    parseOption(arg, config);
+                else
+                    positionalArgs.push_back(arg);
+            }
+            if (positionalArgs.size() < 2)
                 throw std::runtime_error("Argument(s) missing");
 
-            port = atoi(argv[1]);
+            port = atoi(positionalArgs[0].c_str());
             checkPortValid(port);
 
-            hosts = argv[2];
-            if (argc == 4)
+            hosts = positionalArgs[1];
+            if (positionalArgs.size() == 3)
             {
-                std::string fwdStr(argv[3]);
+                const std::string& fwdStr = positionalArgs[2];
                 auto separatorPos = fwdStr.find(':');
                 if (separatorPos == std::string::npos)
                     throw std::runtime_error("Invalid forward server address");
@@ -84,14 +189,17 @@ int main(int argc, char* argv[])
             checkPortValid(fwdPort);
 
             fwdServerAddr.sin_port = htons(fwdPort);
+            Logger::instance().configure(config.log);
+        } catch (std::logic_error& e) {  // thrown by std::stoul
+            throw std::runtime_error("Invalid arguments. " + std::string(e.what()) + '\n' + usage);
         } catch (std::runtime_error e) {
             throw std::runtime_error("Invalid arguments. " + std::string(e.what()) + '\n' + usage);
         }
 
         // create static cache
-        static DnsCache cache(hosts);
+        static DnsCache cache(hosts, config.cache);
         // start server by making static instance, so it will destroy gracefuly during signal handling
-        static Server dnsServer(&cache, port, fwdServerAddr, fwdAddr, fwdPort);
+        static Server dnsServer(&cache, port, fwdServerAddr, fwdAddr, fwdPort, config);
         dnsServer.run();
     }
     catch (std::runtime_error& e)
@@ -0,0 +1,120 @@
+#include "querylog.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+
+class QueryLogChunk;
+
+// chunks of every thread, so old ones are handed over by the threads still serving queries and on shutdown
+struct ChunkRegistry
+{
+    std::mutex mutex;
+    std::vector<QueryLogChunk*> chunks;
+    std::atomic<int64_t> nextSweep{0};  // in sec of steady clock
+};
+
+ChunkRegistry& registry()
+{
+    // never destroyed, logger destructor flushes the chunks, when statics created after the logger are already gone
+    static ChunkRegistry* instance = new ChunkRegistry();
+    return *instance;
+}
+
+// records of a thread, framed as a single chunk, thread hands it over when destroyed
+class QueryLogChunk
+{
+public:
+    QueryLogChunk()
+    {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        registry().chunks.push_back(this);
+    }
+    ~QueryLogChunk()
+    {
+        {
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            auto& chunks = registry().chunks;
+            chunks.erase(std::remove(chunks.begin(), chunks.end(), this), chunks.end());
+        }
+        flush(std::chrono::steady_clock::time_point::max());
+    }
+
+    void append(const QueryLogRecord& record, std::chrono::steady_clock::time_point now) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        try
+        {
+            if (count == 0)
+            {
+                buffer.reserve(QUERY_LOG_CHUNK_HEADER_SIZE + QUERY_LOG_CHUNK_RECORDS * QUERY_LOG_RECORD_SIZE);
+                buffer.resize(QUERY_LOG_CHUNK_HEADER_SIZE);
+                started = now;
+            }
+            buffer.resize(buffer.size() + QUERY_LOG_RECORD_SIZE);
+            record.encode(buffer.data() + buffer.size() - QUERY_LOG_RECORD_SIZE);
+            ++count;
+            if (count == QUERY_LOG_CHUNK_RECORDS || now - started >= std::chrono::seconds(QUERY_LOG_FLUSH_INTERVAL))
+                handOver();
+        } catch (std::exception& e) {
+            Logger::logToStdout(std::string("QueryLog Error adding record: ") + e.what());
+        }
+    }
+
+    // hand the chunk over, if it was started before the deadline
+    void flush(std::chrono::steady_clock::time_point deadline) noexcept
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (count != 0 && started <= deadline)
+            handOver();
+    }
+
+private:
+    void handOver() noexcept
+    {
+        QueryLogRecord::encodeChunkHeader(buffer.data(), count);
+        Logger::logQueryChunk(std::move(buffer));
+        buffer = std::string();
+        count = 0;
+    }
+
+    std::mutex mutex;  // taken by the owner thread, others only to flush old chunk
+    std::string buffer;
+    uint32_t count = 0;
+    std::chrono::steady_clock::time_point started;
+};
+
+void flushChunks(std::chrono::steady_clock::time_point deadline) noexcept
+{
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    for (QueryLogChunk* chunk : registry().chunks)
+        chunk->flush(deadline);
+}
+
+}  // namespace
+
+void appendQueryRecord(const QueryLogRecord& record) noexcept
+{
+    thread_local QueryLogChunk chunk;
+    const auto now = std::chrono::steady_clock::now();
+    chunk.append(record, now);
+
+    // once per interval one of the threads hands over chunks of idle ones, so their records aren't delayed
+    const int64_t seconds = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+    int64_t nextSweep = registry().nextSweep.load(std::memory_order_relaxed);
+    if (seconds >= nextSweep && registry().nextSweep.compare_exchange_strong(nextSweep, seconds + QUERY_LOG_FLUSH_INTERVAL))
+        flushChunks(now - std::chrono::seconds(QUERY_LOG_FLUSH_INTERVAL));
+}
+
+void flushQueryRecords() noexcept
+{
+    flushChunks(std::chrono::steady_clock::time_point::max());
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+
+// binary query log file is a sequence of chunks: header and recordCount fixed-size records, all fields little-endian
+inline constexpr uint32_t QUERY_LOG_MAGIC = 0x314C5144;  // "DQL1"
+inline constexpr uint16_t QUERY_LOG_VERSION = 1;
+inline constexpr size_t QUERY_LOG_CHUNK_HEADER_SIZE = 16;  // magic, version, record size, record count, reserved
+inline constexpr size_t QUERY_LOG_RECORD_SIZE = 128;
+inline constexpr size_t QUERY_LOG_NAME_SIZE = QUERY_LOG_RECORD_SIZE - 27;  // longer names are truncated
+inline constexpr size_t QUERY_LOG_CHUNK_RECORDS = 64;  // records a thread collects before handing the chunk to the logger
+inline constexpr int QUERY_LOG_FLUSH_INTERVAL = 1;  // in sec, chunk of a slow thread is handed over when it's older
+
+enum QueryLogFlags : uint8_t
+{
+    QUERY_LOG_CACHE_HIT = 0x01,  // answered from cache without asking Forward Server
+    QUERY_LOG_FORWARDED = 0x02,
+    QUERY_LOG_STALE = 0x04,  // expired entry was served, because Forward Server failed
+    QUERY_LOG_TCP = 0x08,
+    QUERY_LOG_ANSWERED = 0x10,  // response was sent, unset for queries dropped or unanswered on shutdown
+    QUERY_LOG_NAME_TRUNCATED = 0x20
+};
+
+/// One query of the binary log
+/// Layout on disk: timestamp u64, client IPv4 4 bytes in network order, client port u16, qtype u16,
+/// upstream RTT u32, latency u32, rcode u8, flags u8, qname length u8 and qname of QUERY_LOG_NAME_SIZE bytes
+struct QueryLogRecord
+{
+    uint64_t timestamp = 0;  // microsec since epoch, when processing started
+    uint8_t clientAddr[4] = {};
+    uint16_t clientPort = 0;
+    uint16_t qType = 0;
+    uint32_t upstreamRtt = 0;  // microsec from forwarding to Forward Server response, 0 if not forwarded
+    uint32_t latency = 0;  // microsec from the start of processing to response
+    uint8_t rCode = 0;
+    uint8_t flags = 0;
+    uint8_t qNameLength = 0;  // of the full name, stored part is limited by QUERY_LOG_NAME_SIZE
+    char qName[QUERY_LOG_NAME_SIZE] = {};
+
+    void setName(std::string_view name) noexcept
+    {
+        qNameLength = static_cast<uint8_t>(name.size() > 255 ? 255 : name.size());
+        const size_t stored = name.size() > QUERY_LOG_NAME_SIZE ? QUERY_LOG_NAME_SIZE : name.size();
+        if (stored < name.size())
+            flags |= QUERY_LOG_NAME_TRUNCATED;
+        std::memcpy(qName, name.data(), stored);
+    }
+
+    std::string_view name() const noexcept
+    {
+        return {qName, qNameLength > QUERY_LOG_NAME_SIZE ? QUERY_LOG_NAME_SIZE : qNameLength};
+    }
+
+    void encode(char* out) const noexcept
+    {
+        char* pos = out;
+        putValue(pos, timestamp, 8);
+        std::memcpy(pos, clientAddr, 4);
+        pos += 4;
+        putValue(pos, clientPort, 2);
+        putValue(pos, qType, 2);
+        putValue(pos, upstreamRtt, 4);
+        putValue(pos, latency, 4);
+        putValue(pos, rCode, 1);
+        putValue(pos, flags, 1);
+        putValue(pos, qNameLength, 1);
+        std::memcpy(pos, qName, QUERY_LOG_NAME_SIZE);
+    }
+
+    static QueryLogRecord decode(const char* in) noexcept
+    {
+        QueryLogRecord record;
+        const char* pos = in;
+        record.timestamp = getValue(pos, 8);
+        std::memcpy(record.clientAddr, pos, 4);
+        pos += 4;
+        record.clientPort = static_cast<uint16_t>(getValue(pos, 2));
+        record.qType = static_cast<uint16_t>(getValue(pos, 2));
+        record.upstreamRtt = static_cast<uint32_t>(getValue(pos, 4));
+        record.latency = static_cast<uint32_t>(getValue(pos, 4));
+        record.rCode = static_cast<uint8_t>(getValue(pos, 1));
+        record.flags = static_cast<uint8_t>(getValue(pos, 1));
+        record.qNameLength = static_cast<uint8_t>(getValue(pos, 1));
+        std::memcpy(record.qName, pos, QUERY_LOG_NAME_SIZE);
+        return record;
+    }
+
+    static void encodeChunkHeader(char* out, uint32_t recordCount) noexcept
+    {
+        putValue(out, QUERY_LOG_MAGIC, 4);
+        putValue(out, QUERY_LOG_VERSION, 2);
+        putValue(out, QUERY_LOG_RECORD_SIZE, 2);
+        putValue(out, recordCount, 4);
+        putValue(out, 0, 4);
+    }
+
+    // little-endian field of the size, moves the position past it
+    static void putValue(char*& pos, uint64_t value, size_t size) noexcept
+    {
+        for (size_t i = 0; i < size; ++i)
+            *pos++ = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+
+    static uint64_t getValue(const char*& pos, size_t size) noexcept
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i)
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(*pos++)) << (8 * i);
+        return value;
+    }
+};
+
+static_assert(27 + QUERY_LOG_NAME_SIZE == QUERY_LOG_RECORD_SIZE, "record fields don't fill the record");
+
+// add the record to the chunk of the calling thread, full or old chunk is handed to the logger thread
+void appendQueryRecord(const QueryLogRecord& record) noexcept;
+// hand partial chunks of every thread to the logger thread
+void flushQueryRecords() noexcept;
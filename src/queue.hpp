@@ -1,12 +1,20 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
 #include <condition_variable>
 
 
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+
+
 /// Basic blocking thread-safe queue with mutex and condition_variable with waiting pop functionality
 template<typename T>
 class ThreadSafeQueue
@@ -52,191 +60,214 @@ public:
     
 };
 
-/// Multiple Producer - Multiple Consumer thread-safe lock-free queue with custom type support
-/// through atomic pointer template spec, more flexible than boost, that uses atomic<shared_ptr> and requires trivial data types
-/// Code has been mostly taken from C++ Concurrency In Action book, with few modifications:
-/// bug-fixes in memory managment and ref-counting, wait poping ability
+/// Bounded Multiple Producer - Multiple Consumer lock-free ring (D. Vyukov)
+/// Every slot carries a sequence number, that tells whose turn it is: producer of position pos waits for pos,
+/// consumer for pos + 1. Claiming a position is a single CAS on the producer or consumer counter, each on its own
+/// cache line, and slots are cache line padded, so neighbours don't share lines. Nothing is allocated after construction.
+/// Full queue is reported to the producer instead of growing, caller decides whether to drop, retry or run the task itself
 template<typename T>
-class LockFreeQueue
+class BoundedQueue
 {
-    struct Node;
-    struct CountedPtrNode
+    static_assert(std::is_nothrow_move_constructible_v<T>, "value is moved into claimed slot, that can't be given back");
+
+    struct alignas(CACHE_LINE_SIZE) Slot
     {
-        int extCount = 0;  // reference counting reads from all threads
-        Node* ptr = nullptr;
+        std::atomic<size_t> sequence;
+        alignas(T) unsigned char storage[sizeof (T)];
+
+        T* value() noexcept { return std::launder(reinterpret_cast<T*>(storage)); }
     };
-    struct NodeCounter
+
+    static size_t roundUpPowerOf2(size_t value) noexcept
     {
-        int intCount = 0;  // ref counting from queue nodes
-        int extCounters = 2;  // number of active references (2 max possible (from head or tail ptr and from Node::next))
-    };
-    struct Node
+        size_t result = 2;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueuePos{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeuePos{0};
+
+public:
+    /// capacity is rounded up to power of 2
+    explicit BoundedQueue(size_t capacity) :
+        mask(roundUpPowerOf2(capacity) - 1), slots(std::make_unique<Slot[]>(mask + 1))
+    {
+        for (size_t i = 0; i <= mask; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ~BoundedQueue()
     {
-        std::atomic<T*> data;
-        std::atomic<CountedPtrNode> next;
-        std::atomic<NodeCounter> count;
+        while (tryDequeue());
+    }
+    BoundedQueue(const BoundedQueue<T>& other) = delete;
+    BoundedQueue<T>& operator=(const BoundedQueue<T>& other) = delete;
 
-        void releaseInternal() noexcept
+    /// returns false if the queue is full, value is left untouched then
+    bool tryEnqueue(T&& value) noexcept
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;)
         {
-            NodeCounter oldCounter = count.load(std::memory_order_relaxed);
-            NodeCounter newCounter;
-            do
+            slot = &slots[pos & mask];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
             {
-                newCounter = oldCounter;
-                --newCounter.intCount;
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
             }
-            while (!count.compare_exchange_strong(oldCounter, newCounter, std::memory_order_acquire, std::memory_order_relaxed));
-            if (!newCounter.intCount && !newCounter.extCounters)
-                delete this;
+            else if (diff < 0)
+                return false;  // slot still holds the value of previous turn
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed);
         }
-    };
+        new (slot->storage) T(std::move(value));
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
 
-    // used when thread makes read of node
-    static void increaseNodeExtCount(std::atomic<CountedPtrNode>& node, CountedPtrNode& oldNode) noexcept
+    /// empty optional if there is nothing to take
+    std::optional<T> tryDequeue() noexcept
     {
-        CountedPtrNode newNodeCount;
-        do 
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;)
         {
-            newNodeCount = oldNode;
-            ++newNodeCount.extCount;
+            slot = &slots[pos & mask];
+            const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return std::nullopt;
+            else
+                pos = dequeuePos.load(std::memory_order_relaxed);
         }
-        while (!node.compare_exchange_strong(oldNode, newNodeCount, std::memory_order_acquire, std::memory_order_relaxed));
-        oldNode.extCount = newNodeCount.extCount;
+        std::optional<T> result(std::move(*slot->value()));
+        slot->value()->~T();
+        // slot is free for the producer of the next turn
+        slot->sequence.store(pos + mask + 1, std::memory_order_release);
+        return result;
     }
-    // used when poping or changing tail of queue
-    static void freeNodeExtCount(CountedPtrNode& node) noexcept
+
+    size_t capacity() const noexcept { return mask + 1; }
+    /// approximate while producers and consumers are active
+    size_t size() const noexcept
     {
-        Node* const ptr = node.ptr;
-        int countIncrease = node.extCount - 2;
-        NodeCounter oldCounter = ptr->count.load(std::memory_order_relaxed);
-        NodeCounter newCounter;
-        do
-        {
-            newCounter = oldCounter;
-            --newCounter.extCounters;
-            newCounter.intCount += countIncrease;
-        }
-        while(!ptr->count.compare_exchange_strong(oldCounter, newCounter, std::memory_order_acquire, std::memory_order_relaxed));
-        if (!newCounter.extCounters && !newCounter.intCount)
-            delete ptr;
+        const size_t head = dequeuePos.load(std::memory_order_relaxed);
+        const size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
     }
-    void setNewTail(CountedPtrNode& oldTail, CountedPtrNode const& newTail) noexcept
+};
+
+/// Chase-Lev work-stealing deque (bounded, with C11 memory orders of Le et al.)
+/// Owner thread pushes and pops at the bottom in LIFO order without contention, other threads steal from the top
+/// with a single CAS, that only races with the owner for the last element. Elements are kept in the slots, so pushing
+/// allocates nothing: thief moves the element out only after its CAS won, and every slot carries a sequence number,
+/// like the slots of BoundedQueue, so the owner doesn't reuse the slot, that a thief is still moving out of
+template<typename T>
+class WorkStealingDeque
+{
+    static_assert(std::is_nothrow_move_constructible_v<T>, "value is moved into claimed slot, that can't be given back");
+
+    struct Slot
     {
-        Node* const currentTailPtr = oldTail.ptr;
-        while (!tail.compare_exchange_weak(oldTail, newTail) && oldTail.ptr == currentTailPtr);
-        if (oldTail.ptr == currentTailPtr)
-            freeNodeExtCount(oldTail);
-        else
-            currentTailPtr->releaseInternal(); 
-    }
+        std::atomic<int64_t> sequence;  // position the slot is free for, the next turn once its element left the top
+        alignas(T) unsigned char storage[sizeof (T)];
+
+        T* value() noexcept { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
 
-    void notifyOnEnqueue() noexcept
+    // move the element out of the slot taken from the top, so it's free for the push of the next turn
+    std::optional<T> take(Slot& slot, int64_t position) noexcept
     {
-        isEmpty = false;
-        isEmpty.notify_one();
+        std::optional<T> result(std::move(*slot.value()));
+        slot.value()->~T();
+        slot.sequence.store(position + mask + 1, std::memory_order_release);
+        return result;
     }
 
-    std::atomic<CountedPtrNode> head;
-    std::atomic<CountedPtrNode> tail;
-    std::atomic_bool isEmpty;
+    const int64_t mask;
+    std::unique_ptr<Slot[]> slots;
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom{0};
 
 public:
-    LockFreeQueue()
+    /// capacity should be power of 2
+    explicit WorkStealingDeque(size_t capacity) :
+        mask(static_cast<int64_t>(capacity) - 1), slots(std::make_unique<Slot[]>(capacity))
     {
-        head.store({0, new Node});
-        tail.store(head.load(std::memory_order_relaxed));
+        for (int64_t i = 0; i <= mask; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
     }
-    LockFreeQueue(const LockFreeQueue<T>& other) = delete;
-    LockFreeQueue<T>& operator=(const LockFreeQueue<T>& other) = delete;
-    ~LockFreeQueue()
+    ~WorkStealingDeque()
     {
-        while(true)
-        {
-            CountedPtrNode oldHead = head.load();
-            if (oldHead.ptr)
-            {
-                head.store(oldHead.ptr->next);
-                delete oldHead.ptr;
-            }
-            else
-                return;
-        }
+        for (int64_t i = top.load(std::memory_order_relaxed), b = bottom.load(std::memory_order_relaxed); i < b; ++i)
+            slots[i & mask].value()->~T();
     }
+    WorkStealingDeque(const WorkStealingDeque<T>& other) = delete;
+    WorkStealingDeque<T>& operator=(const WorkStealingDeque<T>& other) = delete;
 
-    void enqueue(T&& newVal)
-    {  // can potentially throw
-        std::unique_ptr<T> newData = std::make_unique<T>(std::move(newVal));
-        std::unique_ptr<Node> newNode = std::make_unique<Node>();
-        CountedPtrNode newNext{1, newNode.get()};
-        CountedPtrNode oldTail = tail.load(std::memory_order_relaxed);
-        for(;;)
-        {
-            increaseNodeExtCount(tail, oldTail);
-            T* oldData = nullptr;
-            if (oldTail.ptr->data.compare_exchange_strong(oldData, newData.get(), std::memory_order_acquire, std::memory_order_relaxed))
-            {  // try update tail data with new one
-                CountedPtrNode oldNext;
-                if (!oldTail.ptr->next.compare_exchange_strong(oldNext, newNext, std::memory_order_acquire, std::memory_order_relaxed))
-                {  // failed to set next ptr, try again
-                    oldTail.ptr->releaseInternal();
-                    continue;
-                }
-                else
-                {  // successfuly added element
-                    newNode.release();  // to prevent unique_ptr<Node> from auto freeing
-                    setNewTail(oldTail, newNext);
-                    notifyOnEnqueue();
-                }
-                newData.release();  // to prevent unique_ptr<T> from auto freeing
-                return;
-            }
-            else
-            {  // if failed, then help other thread update next ptr
-                CountedPtrNode oldNext;
-                if (oldTail.ptr->next.compare_exchange_strong(oldNext, newNext, std::memory_order_acquire, std::memory_order_relaxed))
-                {  // successfuly added element
-                    newNode.release();  // to prevent unique_ptr<Node> from auto freeing
-                    newData.release();  // to prevent unique_ptr<T> from auto freeing
-                    setNewTail(oldTail, newNext);
-                    notifyOnEnqueue();
-                    return;
-                }
-                else  // try to help again
-                    oldTail.ptr->releaseInternal();
-            }
-        }
+    /// owner only, returns false if the deque is full, value is left untouched then
+    bool push(T&& value) noexcept
+    {
+        const int64_t b = bottom.load(std::memory_order_relaxed);
+        const int64_t t = top.load(std::memory_order_acquire);
+        Slot& slot = slots[b & mask];
+        // slot of the previous turn may still be moved out by the thief, that advanced top
+        if (b - t > mask || slot.sequence.load(std::memory_order_acquire) != b)
+            return false;
+        new (slot.storage) T(std::move(value));
+        // pairs with acquire load of bottom in steal, so thief sees the element
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
     }
 
-    /// can return empty ptr
-    std::unique_ptr<T> dequeue() noexcept
+    /// owner only, takes the element pushed last
+    std::optional<T> pop() noexcept
     {
-        CountedPtrNode oldHead = head.load(std::memory_order_relaxed);
-        for(;;)
-        {
-            increaseNodeExtCount(head, oldHead);
-            Node* const ptr = oldHead.ptr;
-            if (ptr == tail.load().ptr)
-            {  // got empty queue, update atomic bool, don't notify waitDequeue, because it's empty
-                isEmpty = true;
-                ptr->releaseInternal();
-                return std::unique_ptr<T>();
-            }
-
-            CountedPtrNode newNext = ptr->next.load();
-            if (head.compare_exchange_strong(oldHead, newNext, std::memory_order_acquire, std::memory_order_relaxed))
-            {  // try and loop to update head with  next element until successfull or other thread did it first
-                T* const res = ptr->data.exchange(nullptr);
-                freeNodeExtCount(oldHead);
-                return std::unique_ptr<T>(res);
-            }
-            ptr->releaseInternal();
+        const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b)
+        {  // empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+        Slot& slot = slots[b & mask];
+        if (t < b)
+        {  // thieves take elements above it, slot stays free for the next push at b
+            std::optional<T> result(std::move(*slot.value()));
+            slot.value()->~T();
+            return result;
         }
+        // last element, thieves may take it too
+        const bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        if (!won)
+            return std::nullopt;
+        return take(slot, b);
     }
 
-    /// can return empty ptr, use only with single consumer
-    std::unique_ptr<T> waitDequeue() noexcept
+    /// any thread, takes the oldest element. Empty optional if the deque is empty or the race was lost
+    std::optional<T> steal() noexcept
     {
-        isEmpty.wait(true);
-        return dequeue();
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return std::nullopt;
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return std::nullopt;
+        return take(slots[t & mask], t);
     }
 };
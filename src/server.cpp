@@ -2,35 +2,181 @@
 #include "dnsexception.hpp"
 #include "logger.hpp"
 #include "threadpool.hpp"
+#include "uringengine.hpp"
 #include <exception>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <thread>
+#include <pthread.h>
+#include <sched.h>
 #include <cstring>
 #include <sstream>
 #include <functional>
+#include <iomanip>
+#include <cerrno>
+#include <algorithm>
+#include <cctype>
 
 
-Server::Server(DnsCache* cachePtr, int port, const sockaddr_in &fwdSrvAddr, const std::string &fwdAddrStr, int fwdPort) :
-    cache(cachePtr), fwdServerAddr(fwdSrvAddr), threadPool(std::chrono::microseconds(THREAD_POOL_TASK_POLL_LATENCY))
+std::string BatchStats::toString(unsigned batchSize) const
 {
+    const uint64_t rCalls = recvCalls.load(std::memory_order_relaxed);
+    const uint64_t rPackets = recvPackets.load(std::memory_order_relaxed);
+    const uint64_t sCalls = sendCalls.load(std::memory_order_relaxed);
+    const uint64_t sPackets = sendPackets.load(std::memory_order_relaxed);
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(2) << "DNS Server batch stats: batch size: " << batchSize
+        << ", recvmmsg calls: " << rCalls << ", packets: " << rPackets
+        << ", avg recv fill: " << (rCalls ? static_cast<double>(rPackets) / rCalls : 0.0)
+        << ", sendmmsg calls: " << sCalls << ", packets: " << sPackets
+        << ", avg send fill: " << (sCalls ? static_cast<double>(sPackets) / sCalls : 0.0);
+    return ss.str();
+}
+
+Server::RequestLogger::~RequestLogger()
+{
+    try
+    {
+        if (binaryLog)
+            appendQueryRecord(record);
+        else
+        {
+            char clientAddrStr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &clientAddr.sin_addr, clientAddrStr, INET_ADDRSTRLEN);
+            const std::string logMsg("DNS Server received request from " + std::string(clientAddrStr) + ", with size: " + std::to_string(requestSize));
+            Logger::logInfo(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+        for (const auto& task : pendingTasks)
+        {
+            Logger::logTask(task);
+            Logger::logToStdout(task.msg);
+        }
+    } catch (std::exception& e) {
+        Logger::logToStdout(std::string("RequestLogger Error: ") + e.what());
+    }
+}
+
+void Server::RequestLogger::setQuestion(const DNSQuery& query) noexcept
+{
+    if (!binaryLog)
+        return;
+    const QueryData question = query.getData();
+    record.setName(question.qName);
+    record.qType = question.qType;
+}
+
+void Server::RequestLogger::setForwarded() noexcept
+{
+    if (!binaryLog)
+        return;
+    record.flags |= QUERY_LOG_FORWARDED;
+    forwarded = std::chrono::steady_clock::now();
+}
+
+void Server::RequestLogger::setUpstreamAnswered() noexcept
+{
+    // prefetch of the entry doesn't count, the client was answered from cache
+    if (binaryLog && (record.flags & QUERY_LOG_FORWARDED) && !(record.flags & QUERY_LOG_ANSWERED) && record.upstreamRtt == 0)
+        record.upstreamRtt = std::max(elapsedMicroseconds(forwarded), 1u);
+}
+
+void Server::RequestLogger::setResponse(const char* response, int size, uint8_t flags) noexcept
+{
+    if (!binaryLog || (record.flags & QUERY_LOG_ANSWERED) || size < DNSHeader::headerOffset)
+        return;
+    record.rCode = static_cast<uint8_t>(response[3]) & 0x0F;
+    record.flags |= flags | QUERY_LOG_ANSWERED;
+    record.latency = elapsedMicroseconds(started);
+}
+
+void Server::RequestLogger::setError(uint16_t rCode) noexcept
+{
+    // malformed query is answered with the error right away
+    if (!binaryLog || (record.flags & QUERY_LOG_ANSWERED))
+        return;
+    record.rCode = static_cast<uint8_t>(rCode);
+    record.flags |= QUERY_LOG_ANSWERED;
+    record.latency = elapsedMicroseconds(started);
+}
+
+uint32_t Server::RequestLogger::elapsedMicroseconds(std::chrono::steady_clock::time_point from) const noexcept
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - from).count();
+    return static_cast<uint32_t>(std::min<int64_t>(elapsed, UINT32_MAX));
+}
+
+Server::Server(DnsCache* cachePtr, int port, const sockaddr_in &fwdSrvAddr, const std::string &fwdAddrStr, int fwdPort,
+               const ServerConfig& config) :
+    cache(cachePtr), fwdServerAddr(fwdSrvAddr), config(config),
+    // every receive thread keeps a batch of slots to receive into
+    requestPool(REQUEST_POOL_SLOTS + std::clamp(config.listeners, 1u, MAX_LISTENERS) * std::clamp(config.batchSize, 1u, MAX_BATCH_SIZE)),
+    // listener threads and io_uring engine process requests themselves, so the pool is not needed
+    threadPool(config.listeners || config.ioEngine == IoEngineType::Uring ? 0u : std::max(std::thread::hardware_concurrency(), 1u), std::chrono::microseconds(THREAD_POOL_SPIN_TIME),
+               THREAD_POOL_QUEUE_CAPACITY, config.poolScheduler)
+{
+    if (this->config.batchSize < 1 || this->config.batchSize > MAX_BATCH_SIZE)
+        throw std::runtime_error("Invalid batch size, should be in range [1, " + std::to_string(MAX_BATCH_SIZE) + "]");
+    if (this->config.listeners > MAX_LISTENERS)
+        throw std::runtime_error("Invalid listeners number, should be in range [0, " + std::to_string(MAX_LISTENERS) + "]");
+    if (this->config.udpPayload < MIN_UDP_PAYLOAD || this->config.udpPayload > MAX_UDP_PAYLOAD)
+        throw std::runtime_error("Invalid EDNS payload size, should be in range [" + std::to_string(MIN_UDP_PAYLOAD) + ", "
+                                 + std::to_string(MAX_UDP_PAYLOAD) + "]");
+    udpPayload = this->config.udpPayload;
+
+    // forward completions continue in the pool, or in the forwarder thread, if the pool is not used
+    const bool poolUsed = !this->config.listeners && this->config.ioEngine != IoEngineType::Uring;
+    forwarder = std::make_unique<Forwarder>(fwdServerAddr, this->config.upstreamSockets, udpPayload, poolUsed ? &threadPool : nullptr);
+
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
-    socketFD = makeUdpSocket(address);
+    if (this->config.tcpMaxConnections != 0)
+        tcpListener = std::make_unique<TcpListener>(address, this->config.tcpMaxConnections, this->config.tcpIdleTimeout,
+                                                    *cache, *forwarder);
+    if (this->config.listeners == 0)
+        socketFD = makeUdpSocket(address);
+    else
+    {
+        try
+        {
+            for (unsigned i = 0; i < this->config.listeners; ++i)
+                listenerSockets.push_back(makeUdpSocket(address, true));
+        } catch (std::exception& e) {
+            for (int sock : listenerSockets)
+                close(sock);
+            throw;
+        }
+        socketFD = listenerSockets.front();
+    }
 
     std::ostringstream ss;
     ss << "DNS Server is initialized. Listening on port: " << port << " sockFD: " << socketFD
-        << ". Forward server: ip: " << fwdAddrStr << " port: " << fwdPort;
+        << ". Forward server: ip: " << fwdAddrStr << " port: " << fwdPort << ". Batch size: " << this->config.batchSize
+        << ". Listeners: " << this->config.listeners << ". Upstream sockets: " << this->config.upstreamSockets
+        << ". Request slots: " << requestPool.capacity() << ". Pool scheduler: " << (this->config.poolScheduler == SchedulerType::WorkStealing ? "stealing" : "global")
+        << ". TCP connections: " << this->config.tcpMaxConnections << ", idle timeout: " << this->config.tcpIdleTimeout << " sec";
     Logger::logInfo(ss.str());
     Logger::logToStdout(ss.str());
 }
 
 Server::~Server()
 {
-    close(socketFD);
+    stopListeners();
+    // TCP thread is stopped first, forward completions only post to it then
+    if (tcpListener)
+        tcpListener->stop();
+    forwarder->stop();
+    // queued requests are answered before their socket is closed
+    threadPool.shutdown();
+    if (listenerSockets.empty())
+        close(socketFD);
+    for (int sock : listenerSockets)
+        close(sock);
+    if (config.batchSize > 1)
+        logBatchStats();
 
     const std::string logMsg = "DNS Server shutdown";
     Logger::logInfo(logMsg);
@@ -43,18 +189,110 @@ void Server::run()
     Logger::logInfo(logMsg);
     Logger::logToStdout(logMsg);
 
-    struct sockaddr_in clientAddr;
-    socklen_t clientAddrLen = sizeof (clientAddr);
-    char buffer[BUFF_SIZE];
-    while(true)
+    if (config.listeners == 0)
+        return makeIoEngine(socketFD)->serve();
+
+    runningListeners = listenerSockets.size();
+    for (unsigned i = 0; i < listenerSockets.size(); ++i)
+        listenerThreads.emplace_back(&Server::listenerWorker, this, i);
+    // listeners are joined by the destructor, that can run from the signal handler on this thread,
+    // so they are awaited without join until all of them exit
+    for (unsigned running = runningListeners.load(); running != 0; running = runningListeners.load())
+        runningListeners.wait(running);
+}
+
+void Server::stopListeners() noexcept
+{
+    stopping = true;
+    // blocked receive returns 0 on shut down socket, io_uring engine sees the flag on its next tick
+    for (int sock : listenerSockets)
+        shutdown(sock, SHUT_RD);
+    for (auto& thread : listenerThreads)
+    {
+        if (!thread.joinable())
+            continue;
+        // signal handler could run on the listener thread itself, it's not resumed after exit
+        if (thread.get_id() == std::this_thread::get_id())
+            thread.detach();
+        else
+            thread.join();
+    }
+}
+
+void Server::listenerWorker(unsigned index) noexcept
+{
+    // keep receiving, processing and replying on the same core
+    const unsigned cpuCount = std::max(std::thread::hardware_concurrency(), 1u);
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(index % cpuCount, &cpuSet);
+    if (pthread_setaffinity_np(pthread_self(), sizeof (cpuSet), &cpuSet) != 0)
+    {
+        const std::string logMsg("DNS Server failed to pin listener " + std::to_string(index) + " to cpu");
+        Logger::logWarning(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+    try
+    {
+        makeIoEngine(listenerSockets[index])->serve();
+    } catch (std::exception& e) {
+        const std::string logMsg("DNS Server listener " + std::to_string(index) + " failed: " + e.what());
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+    if (runningListeners.fetch_sub(1) == 1)
+        runningListeners.notify_all();
+}
+
+std::unique_ptr<IoEngine> Server::makeIoEngine(int sockFD)
+{
+    std::unique_ptr<IoEngine> engine;
+    if (config.ioEngine == IoEngineType::Uring)
     {
         try
         {
-            int requestSize = recvfrom(socketFD, buffer, BUFF_SIZE, 0, (struct sockaddr*) &clientAddr, &clientAddrLen);
-            std::array<char, BUFF_SIZE> arr;
-            std::copy(buffer, buffer + BUFF_SIZE, arr.data());
-            threadPool.submit(&requestProcessor, RequestData{socketFD, arr, requestSize, clientAddr, fwdServerAddr}, std::ref(*cache));
-            std::memset(buffer, 0, BUFF_SIZE);
+            engine = std::make_unique<UringIoEngine>(sockFD, fwdServerAddr, *cache, stopping);
+        } catch (std::runtime_error& e) {
+            const std::string logMsg(std::string("DNS Server io_uring engine is unavailable, falling back to blocking I/O: ") + e.what());
+            Logger::logWarning(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+    }
+    if (!engine)  // pool has no threads in listener or io_uring mode
+        engine = std::make_unique<BlockingIoEngine>(*this, sockFD, config.listeners || config.ioEngine == IoEngineType::Uring);
+
+    const std::string logMsg("DNS Server serving sockFD: " + std::to_string(sockFD) + " with " + engine->name() + " I/O engine");
+    Logger::logInfo(logMsg);
+    Logger::logToStdout(logMsg);
+    return engine;
+}
+
+void Server::receiveLoop(int sockFD, bool processInline)
+{
+    if (config.batchSize > 1)
+        return receiveBatches(sockFD, processInline);
+
+    RequestHandle data;
+    while(!stopping.load(std::memory_order_relaxed))
+    {
+        try
+        {
+            // slot is kept until a request is received into it
+            if (!data && !(data = requestPool.acquire()))
+            {
+                discardRequest(sockFD);
+                continue;
+            }
+            socklen_t clientAddrLen = sizeof (data->clientAddr);
+            data->size = recvfrom(sockFD, data->buffer.data(), BUFF_SIZE, 0, (struct sockaddr*) &data->clientAddr, &clientAddrLen);
+            if (data->size <= 0)
+                continue;
+            data->sockFD = sockFD;
+            data->forwarder = forwarder.get();
+            if (processInline)
+                requestProcessor(std::move(data), *cache);
+            else if (!threadPool.submit(&requestProcessor, std::move(data), std::ref(*cache)))
+                dropRequests(1);
         } catch (std::exception& e) {
             const std::string logMsg(std::string("DNS Server Error receiving request") + e.what());
             Logger::logError(logMsg);
@@ -63,12 +301,127 @@ void Server::run()
     }
 }
 
-int Server::makeUdpSocket(const sockaddr_in &addr)
+void Server::receiveBatches(int sockFD, bool processInline)
+{
+    const unsigned batchSize = config.batchSize;
+    std::vector<RequestHandle> slots(batchSize);
+    std::vector<iovec> iovecs(batchSize);
+    std::vector<mmsghdr> msgs(batchSize);
+    for (unsigned i = 0; i < batchSize; ++i)
+    {
+        iovecs[i].iov_len = BUFF_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(!stopping.load(std::memory_order_relaxed))
+    {
+        try
+        {
+            // slots handed off with the previous batch are replaced, datagrams are received straight into them
+            unsigned ready = 0;
+            for (; ready < batchSize; ++ready)
+            {
+                if (!slots[ready] && !(slots[ready] = requestPool.acquire()))
+                    break;
+                iovecs[ready].iov_base = slots[ready]->buffer.data();
+                msgs[ready].msg_hdr.msg_name = &slots[ready]->clientAddr;
+                msgs[ready].msg_hdr.msg_namelen = sizeof (sockaddr_in);
+            }
+            if (ready == 0)
+            {
+                discardRequest(sockFD);
+                continue;
+            }
+            // block until at least one datagram arrives, then take everything that is already queued
+            int received = recvmmsg(sockFD, msgs.data(), ready, MSG_WAITFORONE, nullptr);
+            if (received <= 0)
+                continue;
+            batchStats.recvCalls.fetch_add(1, std::memory_order_relaxed);
+            batchStats.recvPackets.fetch_add(received, std::memory_order_relaxed);
+
+            // received slots are chained behind the first one and travel as a single handle. Pool tasks get
+            // shorter chains, so the batch is spread over workers and a slow request delays only its neighbours
+            const int chainSize = processInline ? received : static_cast<int>(BATCH_TASK_SIZE);
+            for (int first = 0; first < received; first += chainSize)
+            {
+                const int last = std::min(first + chainSize, received);
+                for (int i = first; i < last; ++i)
+                {
+                    RequestData& data = *slots[i];
+                    data.sockFD = sockFD;
+                    data.size = static_cast<int>(msgs[i].msg_len);
+                    data.forwarder = forwarder.get();
+                    data.next = i + 1 < last ? slots[i + 1].get() : nullptr;
+                }
+                for (int i = first + 1; i < last; ++i)
+                    slots[i].release();
+                RequestHandle batch = std::move(slots[first]);
+                if (processInline)
+                    batchProcessor(std::move(batch), *cache, batchStats);
+                else if (!threadPool.submit(&batchProcessor, std::move(batch), std::ref(*cache), std::ref(batchStats)))
+                    dropRequests(last - first);
+            }
+
+            // only one of the listeners logs per interval
+            const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t lastLogTime = lastStatsLogTime.load(std::memory_order_relaxed);
+            if (now - lastLogTime > BATCH_STATS_LOG_INTERVAL && lastStatsLogTime.compare_exchange_strong(lastLogTime, now))
+                logBatchStats();
+        } catch (std::exception& e) {
+            const std::string logMsg(std::string("DNS Server Error receiving request batch") + e.what());
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+    }
+}
+
+void Server::discardRequest(int sockFD) noexcept
+{
+    // drain the socket, so receiving doesn't spin while workers hold every slot
+    char buffer[BUFF_SIZE];
+    if (recv(sockFD, buffer, BUFF_SIZE, 0) > 0)
+        dropRequests(1);
+}
+
+void Server::dropRequests(size_t count) noexcept
+{
+    // first drop is logged and then one per interval, overload shouldn't flood the log
+    const uint64_t dropped = droppedRequests.fetch_add(count, std::memory_order_relaxed);
+    if (dropped / DROPPED_REQUESTS_LOG_INTERVAL == (dropped + count) / DROPPED_REQUESTS_LOG_INTERVAL && dropped != 0)
+        return;
+    const std::string logMsg("DNS Server is overloaded, thread pool queue of " + std::to_string(threadPool.queueCapacity())
+                             + " tasks or " + std::to_string(requestPool.capacity()) + " request slots are full, requests dropped: "
+                             + std::to_string(dropped + count));
+    Logger::logWarning(logMsg);
+    Logger::logToStdout(logMsg);
+}
+
+void Server::logBatchStats() const noexcept
+{
+    try
+    {
+        const std::string logMsg = batchStats.toString(config.batchSize);
+        Logger::logInfo(logMsg);
+        Logger::logToStdout(logMsg);
+    } catch (std::exception& e) {
+        Logger::logToStdout(std::string("DNS Server Error logging batch stats: ") + e.what());
+    }
+}
+
+int Server::makeUdpSocket(const sockaddr_in &addr, bool reusePort)
 {
     int socketFD;
     if ((socketFD = socket(AF_INET, SOCK_DGRAM, 0)) <= 0)
         throw std::runtime_error("Failed to create socket");
 
+    const int enable = 1;
+    if (reusePort && setsockopt(socketFD, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof (enable)) != 0)
+    {
+        close(socketFD);
+        throw std::runtime_error("Failed to set SO_REUSEPORT on listen socket");
+    }
+
     if (bind(socketFD,(struct sockaddr*) &addr, sizeof (addr)) != 0)
     {
         close(socketFD);
@@ -77,87 +430,310 @@ int Server::makeUdpSocket(const sockaddr_in &addr)
     return socketFD;
 }
 
-void Server::requestProcessor(Server::RequestData data, DnsCache& cache) noexcept
+void Server::requestProcessor(RequestHandle data, DnsCache& cache) noexcept
 {
-    try {
-        RequestLogger logRequest(data);  // log when out of scope
-        DNSQuery query(data.buffer.data(), data.size);
+    int bytesWritten = processRequest(*data, cache, data->response.data());
+    if (bytesWritten > 0 && sendto(data->sockFD, data->response.data(), bytesWritten, 0, (struct sockaddr*) &data->clientAddr, sizeof(data->clientAddr)) == -1)
+    {
+        const std::string logMsg(std::string("RequestProccessor Error sending response to client"));
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
 
-        logRequest.addLogTask(LogLevel::DEBUG, getLogMessage(query));
+void Server::batchProcessor(RequestHandle batch, DnsCache& cache, BatchStats& stats) noexcept
+{
+    // headers are reused by the worker thread, responses are written into the request slots
+    thread_local std::vector<iovec> iovecs(MAX_BATCH_SIZE);
+    thread_local std::vector<mmsghdr> msgs(MAX_BATCH_SIZE);
+    unsigned msgCount = 0;
+    for (RequestData* data = batch.get(); data; data = data->next)
+    {
+        int bytesWritten = processRequest(*data, cache, data->response.data());
+        if (bytesWritten <= 0)
+            continue;
+        iovecs[msgCount].iov_base = data->response.data();
+        iovecs[msgCount].iov_len = bytesWritten;
+        msgs[msgCount].msg_hdr = {};
+        msgs[msgCount].msg_hdr.msg_iov = &iovecs[msgCount];
+        msgs[msgCount].msg_hdr.msg_iovlen = 1;
+        msgs[msgCount].msg_hdr.msg_name = &data->clientAddr;
+        msgs[msgCount].msg_hdr.msg_namelen = sizeof (sockaddr_in);
+        ++msgCount;
+    }
 
-        DnsEntry entry = cache.lookupEntry(query.getData().qName);
-        uint64_t currentTime = DnsCache::getCurrentTimestamp();
-        char responseBuffer[BUFF_SIZE];
-        int bytesWritten = 0;
-        if (entry.isEmpty() || ((currentTime - entry.lastUpdated > TIMEOUT_TIME) && !entry.preloaded))
-        {  // if not found in cache or cache entry time-outed and is not preloaded from file
-            // create socket for forward server and send the request
-            logRequest.addLogTask(LogLevel::INFO, "RequestProccessor get entry from Forward Server");
-
-            int fwdSock = socket(AF_INET, SOCK_DGRAM, 0);
-            if (fwdSock <= 0)
-                throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to create socket for Forward Server.");
-            bytesWritten = query.write(responseBuffer);
-            int resultBytes = sendto(fwdSock, responseBuffer, bytesWritten, 0, (struct sockaddr*) &data.forwardServerAddr, sizeof (data.forwardServerAddr));
-            if (resultBytes == -1)
-                throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to send query to Forward Server, consider restarting the server with another forward server.");
-
-            struct timeval tv;
-            tv.tv_sec = FWD_SOCK_TIMEOUT;
-            tv.tv_usec = 0;
-            if (setsockopt(fwdSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-                throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to set Forward Server socket timeout");
-
-            std::memset(responseBuffer, 0, BUFF_SIZE);
-            socklen_t addrLen = sizeof (data.forwardServerAddr);
-            resultBytes = recvfrom(fwdSock, responseBuffer, BUFF_SIZE, 0, (struct sockaddr *) &data.forwardServerAddr, &addrLen);
-            if (resultBytes == -1)
-                throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to get response from Forward Server, consider restarting the server with another forward server.");
-
-            auto fwdResponse = DNSResponse(DNSHeader::RCode::NoError, responseBuffer, resultBytes);
-            std::memset(responseBuffer, 0, BUFF_SIZE);
-            bytesWritten = fwdResponse.write(responseBuffer);
-
-            logMessage<DNSResponse>(fwdResponse);
-            logRequest.addLogTask(LogLevel::DEBUG, getLogMessage(fwdResponse));
-            // update cache with one answer
-            const auto newData = fwdResponse.getData();
-            if (newData.rData.empty())
-                throw DNSException(DNSHeader::ServerFail, query.getId(), "Invalid response from Forward Server");
-
-            cache.updateOrInsertEntry(newData.name, DnsEntry{newData.rData.front(), currentTime, false});
+    // all requests of the batch came from the same listening socket
+    unsigned sent = 0;
+    while (sent < msgCount)
+    {
+        int result = sendmmsg(batch->sockFD, msgs.data() + sent, msgCount - sent, 0);
+        if (result == -1)
+        {  // skip the failed datagram and continue with the rest of the batch
+            const std::string logMsg(std::string("BatchProccessor Error sending response to client: ") + std::strerror(errno));
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+            ++sent;
+            continue;
         }
-        else
-        {  // send entry directly from cache
-            logRequest.addLogTask(LogLevel::INFO, "RequestProccessor get entry from cache");
+        stats.sendCalls.fetch_add(1, std::memory_order_relaxed);
+        stats.sendPackets.fetch_add(result, std::memory_order_relaxed);
+        sent += result;
+    }
+}
 
-            auto response = DNSResponse(DNSHeader::RCode::NoError, query, entry);
-            bytesWritten = response.write(responseBuffer);
+int Server::processRequest(const Server::RequestData& data, DnsCache& cache, char* responseBuffer) noexcept
+{
+    try {
+        // log when out of scope, shared with forward completion
+        auto logRequest = std::make_shared<RequestLogger>(data.clientAddr, data.size);
+        DNSQuery query = readQuery(data.buffer.data(), data.size, *logRequest);
 
-            logRequest.addLogTask(LogLevel::DEBUG, getLogMessage(response));
+        bool prefetch = false;
+        int bytesWritten = answerFromCache(query, cache, responseBuffer, *logRequest, &prefetch);
+        if (prefetch)
+            prefetchEntry(query, *data.forwarder, cache, logRequest);
+        if (bytesWritten == 0)
+        {  // if not found in cache or cache entry time-outed and is not preloaded from file
+            // forward the request and continue, when response arrives, without blocking the thread
+            logRequest->addLogTask(LogLevel::INFO, "RequestProccessor get entry from Forward Server");
+            logRequest->setForwarded();
+            try {
+                data.forwarder->forward(query, [sockFD = data.sockFD, clientAddr = data.clientAddr, query, logRequest, &cache](const char* packet, int size) {
+                    forwardProcessor(sockFD, clientAddr, query, *logRequest, cache, packet, size);
+                });
+            } catch (DNSException& e) {
+                return answerForwardError(e, query, cache, responseBuffer, *logRequest);
+            }
         }
-        int result = sendto(data.sockFD, responseBuffer, bytesWritten, 0, (struct sockaddr*) &data.clientAddr, sizeof(data.clientAddr));
-        if (result == -1)
-            throw std::runtime_error("Failed to send response to client.");
+        return bytesWritten;
 
     } catch (DNSException& e) {
-        const std::string logMsg(std::string("RequestProccessor Caught DNS Exception: ") + e.what());
+        return writeErrorResponse(e, responseBuffer);
+    } catch (std::exception& e) {
+        const std::string logMsg(std::string("RequestProccessor Caught Unhandled Exception: ") + e.what());
         Logger::logError(logMsg);
         Logger::logToStdout(logMsg);
+    }
+    return 0;
+}
 
-        auto response = DNSResponse(e.code, e.id);
-        char responseBuffer[BUFF_SIZE];
-        int bytesWritten = response.write(responseBuffer);
-        int result = sendto(data.sockFD, responseBuffer, bytesWritten, 0, (struct sockaddr*) &data.clientAddr, sizeof(data.clientAddr));
-        if (result == -1)
-        {
-            const std::string logMsg(std::string("RequestProccessor Error sending error responce to client"));
-            Logger::logError(logMsg);
-            Logger::logToStdout(logMsg);
-        }
+void Server::forwardProcessor(int sockFD, const sockaddr_in& clientAddr, const DNSQuery& query, RequestLogger& logRequest,
+                              DnsCache& cache, const char* packet, int size) noexcept
+{
+    char responseBuffer[MAX_UDP_PAYLOAD];
+    const int bytesWritten = answerForwarded(query, packet, size, cache, responseBuffer, logRequest);
+    if (bytesWritten > 0 && sendto(sockFD, responseBuffer, bytesWritten, 0, (const struct sockaddr*) &clientAddr, sizeof(clientAddr)) == -1)
+    {
+        const std::string logMsg(std::string("ForwardProccessor Error sending response to client"));
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+int Server::answerForwarded(const DNSQuery& query, const char* packet, int size, DnsCache& cache, char* responseBuffer,
+                            RequestLogger& logRequest) noexcept
+{
+    try {
+        if (!packet)
+            throw DNSException(DNSHeader::ServerFail, query.getId(), "Failed to get response from Forward Server, consider restarting the server with another forward server.");
+        return answerFromForwardResponse(query, packet, size, cache, responseBuffer, logRequest);
+    } catch (DNSException& e) {
+        return answerForwardError(e, query, cache, responseBuffer, logRequest);
     } catch (std::exception& e) {
-        const std::string logMsg(std::string("RequestProccessor Caught Unhandled Exception: ") + e.what());
+        const std::string logMsg(std::string("ForwardProccessor Caught Unhandled Exception: ") + e.what());
         Logger::logError(logMsg);
         Logger::logToStdout(logMsg);
     }
+    return 0;
+}
+
+void Server::prefetchEntry(const DNSQuery& query, Forwarder& forwarder, DnsCache& cache,
+                           const std::shared_ptr<RequestLogger>& logRequest) noexcept
+{
+    try {
+        logRequest->addLogTask(LogLevel::INFO, "RequestProccessor prefetch entry from Forward Server");
+        forwarder.forward(query, [query, logRequest, &cache](const char* packet, int size) {
+            refreshProcessor(query, *logRequest, cache, packet, size);
+        });
+    } catch (std::exception& e) {
+        // client is answered from cache anyway
+        const std::string logMsg(std::string("RequestProccessor Error prefetching entry: ") + e.what());
+        Logger::logWarning(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+void Server::refreshProcessor(const DNSQuery& query, RequestLogger& logRequest, DnsCache& cache,
+                              const char* packet, int size) noexcept
+{
+    // hit, that started the refresh, could come over TCP
+    char udpBuffer[MAX_UDP_PAYLOAD];
+    char* responseBuffer = query.overStream() ? streamResponseBuffer() : udpBuffer;
+    try {
+        if (!packet)
+            throw std::runtime_error("no response from Forward Server");
+        answerFromForwardResponse(query, packet, size, cache, responseBuffer, logRequest);
+    } catch (std::exception& e) {
+        // entry stays in cache until it expires
+        const std::string logMsg(std::string("RefreshProccessor Failed to prefetch entry: ") + e.what());
+        Logger::logWarning(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+DNSQuery Server::readQuery(const char* packet, int size, RequestLogger& logRequest)
+{
+    try
+    {
+        DNSQuery query(packet, size);
+        logRequest.setQuestion(query);
+        if (logRequest.detailed())
+            logRequest.addLogTask(LogLevel::DEBUG, getLogMessage(query));
+        return query;
+    } catch (DNSException& e) {
+        logRequest.setError(e.code);
+        throw;
+    }
+}
+
+int Server::answerFromCache(const DNSQuery& query, DnsCache& cache, char* responseBuffer, RequestLogger& logRequest,
+                            bool* prefetch)
+{
+    const QueryData& question = query.getData();
+    // send encoded entry directly from cache
+    const int bytesWritten = cache.readResponse(question.qName, question.qType, question.qClass, query.getId(),
+                                                query.recursionDesired(), responseBuffer, responseCapacity(query), prefetch);
+    if (bytesWritten == 0)
+        return 0;
+    logRequest.addLogTask(LogLevel::INFO, "RequestProccessor get entry from cache");
+    const int size = finishResponse(query, responseBuffer, bytesWritten);
+    logRequest.setResponse(responseBuffer, size, QUERY_LOG_CACHE_HIT);
+    return size;
+}
+
+int Server::answerFromForwardResponse(const DNSQuery& query, const char* packet, int size, DnsCache& cache,
+                                      char* responseBuffer, RequestLogger& logRequest)
+{
+    logRequest.setUpstreamAnswered();
+    auto fwdResponse = DNSResponse(DNSHeader::RCode::NoError, packet, size);
+    const ResponseData& answer = fwdResponse.getData();
+    const QueryData& question = query.getData();
+    if (fwdResponse.getId() != query.getId() || !equalNames(answer.name, question.qName)
+        || answer.type != question.qType || answer.dataClass != question.qClass)
+        throw DNSException(DNSHeader::ServerFail, query.getId(), "Forward Server response doesn't match the query");
+    if (logRequest.detailed())
+    {
+        logMessage<DNSResponse>(fwdResponse);
+        logRequest.addLogTask(LogLevel::DEBUG, getLogMessage(fwdResponse));
+    }
+    if (fwdResponse.getRCode() == DNSHeader::ServerFail)
+    {
+        // expired answer is kept instead of caching the failure
+        const int bytesWritten = cache.readStaleResponse(question.qName, question.qType, question.qClass, query.getId(),
+                                                         query.recursionDesired(), responseBuffer, responseCapacity(query));
+        if (bytesWritten > 0)
+        {
+            logRequest.addLogTask(LogLevel::WARNING, "RequestProccessor get stale entry from cache: Forward Server failed");
+            const int staleSize = finishResponse(query, responseBuffer, bytesWritten);
+            logRequest.setResponse(responseBuffer, staleSize, QUERY_LOG_STALE);
+            return staleSize;
+        }
+    }
+
+    // response is encoded at full size, so cached entry can answer TCP clients too, UDP ones get it truncated
+    thread_local std::vector<char> encoded(MAX_TCP_MESSAGE);
+    DnsEntry entry;
+    bool truncated = false;
+    int bytesWritten = fwdResponse.write(encoded.data(), MAX_TCP_MESSAGE - OPT_RECORD_SIZE, &entry.ttlOffsets, &truncated);
+    // truncated answer is sent, but not cached (RFC 2181 9)
+    if (!truncated)
+    {
+        // update cache with encoded response, address of the first answer is kept for hosts file
+        entry.negative = fwdResponse.isNegative();
+        entry.rcode = fwdResponse.getRCode();
+        entry.lastUpdated = DnsCache::getCurrentTimestamp();
+        if (!answer.rData.empty())
+        {
+            const DnsEntry addressEntry = DnsEntry::fromString(answer.rData.front(), entry.lastUpdated, false);
+            entry.address = addressEntry.address;
+            entry.addressLength = addressEntry.addressLength;
+        }
+        entry.ttl = answer.ttl;
+        entry.response.assign(encoded.data(), encoded.data() + bytesWritten);
+        entry.response[0] = entry.response[1] = 0;
+        cache.updateOrInsertEntry(question.qName, question.qType, question.qClass, entry);
+    }
+    if (bytesWritten > responseCapacity(query))
+        bytesWritten = DNSResponse::truncate(encoded.data(), bytesWritten);
+    std::memcpy(responseBuffer, encoded.data(), bytesWritten);
+    bytesWritten = finishResponse(query, responseBuffer, bytesWritten);
+    logRequest.setResponse(responseBuffer, bytesWritten);
+    return bytesWritten;
+}
+
+int Server::responseCapacity(const DNSQuery& query) noexcept
+{
+    if (query.overStream())
+        return MAX_TCP_MESSAGE - (query.hasEdns() ? static_cast<int>(OPT_RECORD_SIZE) : 0);
+    if (!query.hasEdns())
+        return MIN_UDP_PAYLOAD;
+    return std::min(query.getUdpPayload(), udpPayload) - static_cast<int>(OPT_RECORD_SIZE);
+}
+
+char* Server::streamResponseBuffer() noexcept
+{
+    thread_local std::vector<char> buffer(MAX_TCP_MESSAGE);
+    return buffer.data();
+}
+
+int Server::finishResponse(const DNSQuery& query, char* responseBuffer, int size) noexcept
+{
+    if (!query.hasEdns() || size <= 0)
+        return size;
+    return DNSResponse::appendOpt(responseBuffer, size, udpPayload);
+}
+
+bool Server::equalNames(std::string_view lhs, std::string_view rhs) noexcept
+{
+    // domain names are case-insensitive
+    return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(),
+        [](char l, char r) { return std::tolower(static_cast<unsigned char>(l)) == std::tolower(static_cast<unsigned char>(r)); });
+}
+
+int Server::answerForwardError(const DNSException& e, const DNSQuery& query, DnsCache& cache, char* responseBuffer,
+                               RequestLogger& logRequest) noexcept
+{
+    logRequest.setUpstreamAnswered();
+    // serve-stale (RFC 8767): expired answer is better than no answer when Forward Server is unreachable,
+    // negative answers from it are not errors
+    if (e.code == DNSHeader::ServerFail)
+    {
+        const QueryData& question = query.getData();
+        const int bytesWritten = cache.readStaleResponse(question.qName, question.qType, question.qClass, query.getId(),
+                                                         query.recursionDesired(), responseBuffer, responseCapacity(query));
+        if (bytesWritten > 0)
+        {
+            logRequest.addLogTask(LogLevel::WARNING, std::string("RequestProccessor get stale entry from cache: ") + e.what());
+            const int size = finishResponse(query, responseBuffer, bytesWritten);
+            logRequest.setResponse(responseBuffer, size, QUERY_LOG_STALE);
+            return size;
+        }
+    }
+    const int size = finishResponse(query, responseBuffer, writeErrorResponse(e, responseBuffer));
+    logRequest.setResponse(responseBuffer, size);
+    return size;
+}
+
+int Server::writeErrorResponse(const DNSException& e, char* responseBuffer) noexcept
+{
+    const std::string logMsg(std::string("RequestProccessor Caught DNS Exception: ") + e.what());
+    Logger::logError(logMsg);
+    Logger::logToStdout(logMsg);
+
+    auto response = DNSResponse(static_cast<DNSHeader::RCode>(e.code & 0x0F), e.id);
+    const int size = response.write(responseBuffer, MIN_UDP_PAYLOAD);
+    // extended RCODE is completed by OPT record (RFC 6891)
+    if (e.code > 0x0F)
+        return DNSResponse::appendOpt(responseBuffer, size, udpPayload, static_cast<uint8_t>(e.code >> 4));
+    return size;
 }
@@ -2,8 +2,17 @@
 
 #include "dnscache.hpp"
 #include "dnsmessage.hpp"
+#include "dnsexception.hpp"
+#include "ioengine.hpp"
+#include "forwarder.hpp"
 #include "logger.hpp"
+#include "querylog.hpp"
+#include "slabpool.hpp"
+#include "tcplistener.hpp"
 #include "threadpool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <exception>
 #include <netinet/in.h>
 #include <array>
@@ -15,64 +24,188 @@
 #include <vector>
 
 
-inline constexpr int BUFF_SIZE = 512;
-inline constexpr int FWD_SOCK_TIMEOUT = 5; // in sec
-inline constexpr int THREAD_POOL_TASK_POLL_LATENCY = 10000; // in microsec
+inline constexpr int BUFF_SIZE = MIN_UDP_PAYLOAD;  // client queries, responses use MAX_UDP_PAYLOAD buffers
+inline constexpr int THREAD_POOL_SPIN_TIME = 50; // in microsec, idle worker polls for new task before parking
+inline constexpr unsigned MAX_BATCH_SIZE = 1024;
+inline constexpr unsigned BATCH_TASK_SIZE = 32;  // requests of a received batch processed by one pool task
+inline constexpr unsigned MAX_LISTENERS = 256;
+inline constexpr int BATCH_STATS_LOG_INTERVAL = 10; // in sec
+inline constexpr uint64_t DROPPED_REQUESTS_LOG_INTERVAL = 1024;  // in dropped requests
+inline constexpr size_t REQUEST_POOL_SLOTS = 8192;  // requests in flight, receive threads hold batchSize slots each on top
+
+/// runtime options of the server, set from command line
+struct ServerConfig
+{
+    // max number of datagrams received per recvmmsg() call and sent per sendmmsg() call,
+    // 1 disables batched I/O and uses plain recvfrom/sendto per packet
+    unsigned batchSize = 1;
+    // number of SO_REUSEPORT sockets, each served by its own thread pinned to a core,
+    // that receives, processes and replies without the thread pool. 0 uses single socket and the pool
+    unsigned listeners = 0;
+    // network I/O backend for every listening socket, blocking engine is used as a fallback
+    // if io_uring is not supported by the kernel
+    IoEngineType ioEngine = IoEngineType::Blocking;
+    // how thread pool workers share submitted requests, used without listeners and io_uring
+    SchedulerType poolScheduler = SchedulerType::GlobalQueue;
+    // number of long-lived sockets to the Forward Server, queries are multiplexed over them
+    unsigned upstreamSockets = 4;
+    // UDP payload size advertised in EDNS OPT record to clients and Forward Server,
+    // responses to EDNS clients are limited by the smaller of it and their own. 512 is the limit without EDNS
+    uint16_t udpPayload = DEFAULT_EDNS_PAYLOAD;
+    // TCP connections served on the same port by a single epoll thread, 0 disables TCP
+    unsigned tcpMaxConnections = DEFAULT_TCP_MAX_CONNECTIONS;
+    // connection without queries in progress is closed after that many seconds
+    unsigned tcpIdleTimeout = DEFAULT_TCP_IDLE_TIMEOUT;
+    CacheConfig cache;
+    LogConfig log;
+};
+
+/// counters for batched I/O, used to tune batch size under real load
+struct BatchStats
+{
+    std::atomic<uint64_t> recvCalls{0};
+    std::atomic<uint64_t> recvPackets{0};
+    std::atomic<uint64_t> sendCalls{0};
+    std::atomic<uint64_t> sendPackets{0};
+
+    std::string toString(unsigned batchSize) const;
+};
 
 class Server
 {
 public:
+    // pooled slot, that the request is received into and its response is written to,
+    // it's handed from the receive thread to the worker by pointer and returned to the pool after send
     struct RequestData
     {
-        int sockFD;
-        const std::array<char, BUFF_SIZE> buffer;
-        int size;
-        const sockaddr_in clientAddr;
-        const sockaddr_in forwardServerAddr;
+        int sockFD = -1;
+        int size = 0;
+        sockaddr_in clientAddr{};
+        Forwarder* forwarder = nullptr;
+        RequestData* next = nullptr;  // rest of the batch received by the same call
+        alignas(CACHE_LINE_SIZE) std::array<char, BUFF_SIZE> buffer;
+        alignas(CACHE_LINE_SIZE) std::array<char, MAX_UDP_PAYLOAD> response;
     };
-    // RequestLogger is used to log received request at the end of the processing
+    using RequestPool = SlabPool<RequestData>;
+    using RequestHandle = RequestPool::Handle;
+    // RequestLogger is used to log received request at the end of the processing,
+    // with binary query log it collects fields of the query record instead of the text lines
     struct RequestLogger
     {
-        RequestLogger(const RequestData& data) :
-        clientAddr(data.clientAddr), requestSize(data.size) {}
-        ~RequestLogger()
+        RequestLogger(const sockaddr_in& clientAddr, int requestSize) :
+            clientAddr(clientAddr), requestSize(requestSize), binaryLog(Logger::queryLogEnabled())
         {
-            try
+            if (binaryLog)
             {
-                char clientAddrStr[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &clientAddr.sin_addr, clientAddrStr, INET_ADDRSTRLEN);
-                const std::string logMsg("DNS Server received request from " + std::string(clientAddrStr) + ", with size: " + std::to_string(requestSize));
-                Logger::logInfo(logMsg);
-                Logger::logToStdout(logMsg);
-                for (const auto& task : pendingTasks)
-                {
-                    Logger::logTask(task);
-                    Logger::logToStdout(task.msg);
-                }
-            } catch (std::exception& e) {
-                Logger::logToStdout(std::string("RequestLogger Error: ") + e.what());
+                record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                std::memcpy(record.clientAddr, &clientAddr.sin_addr, sizeof (record.clientAddr));
+                record.clientPort = ntohs(clientAddr.sin_port);
+                started = std::chrono::steady_clock::now();
             }
         }
+        ~RequestLogger();
 
         void addLogTask(LogLevel level, const std::string& msg)
         {
-            pendingTasks.push_back({level, msg, std::time(nullptr)});
+            // only warnings and errors go to the text log next to the binary one
+            if (!binaryLog || level <= LogLevel::ERROR)
+                pendingTasks.push_back({level, msg, std::time(nullptr)});
         }
+        // detailed message dumps are skipped with binary query log
+        bool detailed() const noexcept { return !binaryLog; }
+
+        // fields of the binary record, set by the processing stages. Only the first response is recorded,
+        // so refreshing the entry after the client was answered from cache doesn't change it
+        void setQuestion(const DNSQuery& query) noexcept;
+        void setStreamTransport() noexcept { record.flags |= QUERY_LOG_TCP; }
+        void setForwarded() noexcept;
+        void setUpstreamAnswered() noexcept;
+        void setResponse(const char* response, int size, uint8_t flags = 0) noexcept;
+        void setError(uint16_t rCode) noexcept;
 
     private:
+        uint32_t elapsedMicroseconds(std::chrono::steady_clock::time_point from) const noexcept;
+
         std::vector<LogTask> pendingTasks;
         const sockaddr_in clientAddr;
         int requestSize;
+        const bool binaryLog;
+        QueryLogRecord record;
+        std::chrono::steady_clock::time_point started;
+        std::chrono::steady_clock::time_point forwarded;
     };
 
-    Server(DnsCache* cachePtr, int port, const sockaddr_in& fwdSrvAddr, const std::string& fwdAddrStr, int fwdPort);
+    Server(DnsCache* cachePtr, int port, const sockaddr_in& fwdSrvAddr, const std::string& fwdAddrStr, int fwdPort,
+           const ServerConfig& config = ServerConfig());
     ~Server();
 
     void run();
-    static int makeUdpSocket(const struct sockaddr_in& addr);
+    static int makeUdpSocket(const struct sockaddr_in& addr, bool reusePort = false);
+
+    // request processing stages, shared by the I/O engines. Stages log into the request logger
+    // and throw DNSException, that should be answered with writeErrorResponse
+    static DNSQuery readQuery(const char* packet, int size, RequestLogger& logRequest);
+    // write response for the query from cache, returns response size or 0 if entry is missing or timed out.
+    // Sets prefetch if the entry should be refreshed in background
+    static int answerFromCache(const DNSQuery& query, DnsCache& cache, char* responseBuffer, RequestLogger& logRequest,
+                               bool* prefetch = nullptr);
+    // parse Forward Server response to the query, update cache and write response for the client.
+    // Response buffers of queries over TCP should have MAX_TCP_MESSAGE bytes, of others MAX_UDP_PAYLOAD
+    static int answerFromForwardResponse(const DNSQuery& query, const char* packet, int size, DnsCache& cache,
+                                         char* responseBuffer, RequestLogger& logRequest);
+    // continue query with Forward Server response, or answer ServerFail if packet is nullptr. Returns response size
+    static int answerForwarded(const DNSQuery& query, const char* packet, int size, DnsCache& cache, char* responseBuffer,
+                               RequestLogger& logRequest) noexcept;
+    // answer query, that Forward Server failed to resolve, from expired cache entry if there is one, or with the error
+    static int answerForwardError(const DNSException& e, const DNSQuery& query, DnsCache& cache, char* responseBuffer,
+                                  RequestLogger& logRequest) noexcept;
+    static int writeErrorResponse(const DNSException& e, char* responseBuffer) noexcept;
+    // largest response to the query without OPT record, from its EDNS payload bounded by ours or 512 bytes,
+    // queries over TCP get the whole message the length prefix allows
+    static int responseCapacity(const DNSQuery& query) noexcept;
+    // response buffer of MAX_TCP_MESSAGE bytes for queries over TCP, one per thread, as it's too large for the stack
+    static char* streamResponseBuffer() noexcept;
+    // append OPT record to response to EDNS query, returns new size
+    static int finishResponse(const DNSQuery& query, char* responseBuffer, int size) noexcept;
+    // EDNS payload size of the server, advertised to clients and Forward Server
+    static uint16_t advertisedPayload() noexcept { return udpPayload; }
+    static bool equalNames(std::string_view lhs, std::string_view rhs) noexcept;
 
 private:
-    static void requestProcessor(RequestData data, DnsCache& cache) noexcept;
+    friend class BlockingIoEngine;
+    friend class TcpListener;
+
+    // create engine of configured type for the listening socket
+    std::unique_ptr<IoEngine> makeIoEngine(int sockFD);
+    // thread function of a SO_REUSEPORT listener
+    void listenerWorker(unsigned index) noexcept;
+    // stop and join listener threads, they use the sockets and the request pool until they exit
+    void stopListeners() noexcept;
+    // receive requests from the socket, either process them in the calling thread or submit to the pool
+    void receiveLoop(int sockFD, bool processInline);
+    // receive up to batchSize datagrams per syscall, pool tasks get them in chains of up to BATCH_TASK_SIZE
+    void receiveBatches(int sockFD, bool processInline);
+    void logBatchStats() const noexcept;
+    // count requests, that didn't fit into the pool queue or got no packet slot. They are not answered, so clients retry
+    void dropRequests(size_t count) noexcept;
+    // receive and drop a datagram, when every packet slot is in use
+    void discardRequest(int sockFD) noexcept;
+
+    static void requestProcessor(RequestHandle data, DnsCache& cache) noexcept;
+    // process every request of the batch chain and send all responses with sendmmsg
+    static void batchProcessor(RequestHandle batch, DnsCache& cache, BatchStats& stats) noexcept;
+    // handle query and write response to the buffer, returns response size, 0 if there is nothing to send
+    // cache misses are forwarded asynchronously and answered from forwardProcessor
+    static int processRequest(const RequestData& data, DnsCache& cache, char* responseBuffer) noexcept;
+    // send answer to Forward Server response, or ServerFail if packet is nullptr, to the client
+    static void forwardProcessor(int sockFD, const sockaddr_in& clientAddr, const DNSQuery& query, RequestLogger& logRequest,
+                                 DnsCache& cache, const char* packet, int size) noexcept;
+    // forward the query answered from cache to refresh the entry, failures are only logged
+    static void prefetchEntry(const DNSQuery& query, Forwarder& forwarder, DnsCache& cache,
+                              const std::shared_ptr<RequestLogger>& logRequest) noexcept;
+    // update cache with Forward Server response to prefetch query, nothing is sent to the client
+    static void refreshProcessor(const DNSQuery& query, RequestLogger& logRequest, DnsCache& cache,
+                                 const char* packet, int size) noexcept;
 
     template<typename Msg>
     static void logMessage(const Msg& msg) noexcept
@@ -91,9 +224,42 @@ private:
         return logMsg.append(ss.str());
     }
 
+    // EDNS payload size of the server, stages are static so it's set once from config
+    static inline uint16_t udpPayload = DEFAULT_EDNS_PAYLOAD;
+
     DnsCache* cache;
     sockaddr_in fwdServerAddr;
     struct sockaddr_in address;
     int socketFD;
+    ServerConfig config;
+    BatchStats batchStats;
+    std::atomic<int64_t> lastStatsLogTime{0};
+    std::atomic<uint64_t> droppedRequests{0};
+    std::vector<int> listenerSockets;
+    std::vector<std::thread> listenerThreads;
+    // set on destruction, receive loops exit when their sockets are shut down
+    std::atomic<bool> stopping{false};
+    std::atomic<unsigned> runningListeners{0};
+    // everything the pool tasks use is declared before the pool and destroyed after it: draining the pool runs
+    // queued requests, that hold request slots and forward queries, and forward completions, that answer TCP clients
+    RequestPool requestPool;
+    std::unique_ptr<Forwarder> forwarder;
+    std::unique_ptr<TcpListener> tcpListener;
     ThreadPool threadPool;
 };
+
+/// I/O engine with blocking recvfrom/recvmmsg loop, requests are processed in the pool or in the calling thread
+class BlockingIoEngine : public IoEngine
+{
+public:
+    BlockingIoEngine(Server& server, int sockFD, bool processInline) :
+        server(server), sockFD(sockFD), processInline(processInline) {}
+
+    void serve() override { server.receiveLoop(sockFD, processInline); }
+    std::string name() const override { return processInline ? "blocking, inline processing" : "blocking, thread pool processing"; }
+
+private:
+    Server& server;
+    int sockFD;
+    bool processInline;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+inline constexpr size_t SLAB_SLOTS = 64;  // slots allocated at once when the pool grows
+
+/// Pool of fixed-size slots handed between threads by pointer
+/// Slots are allocated in slabs, when there is no free one, up to maxSlots and are kept until the pool is destroyed,
+/// so in steady state acquire and release are a single operation on the lock-free free list and nothing is allocated.
+/// Slot type is aligned to cache line by the caller, so neighbours owned by different threads don't share lines.
+/// Slots are linked through their next member, release returns the whole chain, that lets a batch travel as one handle
+template<typename T>
+class SlabPool
+{
+public:
+    struct Releaser
+    {
+        SlabPool<T>* pool = nullptr;
+        void operator()(T* slot) const noexcept { pool->release(slot); }
+    };
+    /// owner of a slot or a chain of them, returns it to the pool when destroyed
+    using Handle = std::unique_ptr<T, Releaser>;
+
+    explicit SlabPool(size_t maxSlots) :
+        maxSlots(std::max(maxSlots, SLAB_SLOTS)), freeSlots(this->maxSlots) {}
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    /// free slot with its previous content, empty handle if maxSlots are in use
+    Handle acquire()
+    {
+        if (auto slot = freeSlots.tryDequeue())
+            return Handle(*slot, Releaser{this});
+        return grow();
+    }
+
+    /// return the slot and every slot linked after it
+    void release(T* slot) noexcept
+    {
+        while (slot)
+        {
+            T* next = slot->next;
+            slot->next = nullptr;
+            putFree(slot);
+            slot = next;
+        }
+    }
+
+    size_t capacity() const noexcept { return maxSlots; }
+    size_t allocated() const noexcept { return allocatedSlots.load(std::memory_order_relaxed); }
+
+private:
+    void putFree(T* slot) noexcept
+    {
+        // free list has room for every slot, but its cell can still be taken by a consumer, that was preempted
+        // in the middle of dequeue, so the slot is kept until that one finishes
+        while (!freeSlots.tryEnqueue(std::move(slot)))
+            std::this_thread::yield();
+    }
+
+    Handle grow()
+    {
+        std::lock_guard<std::mutex> lock(growMutex);
+        // other thread could grow the pool while we waited
+        if (auto slot = freeSlots.tryDequeue())
+            return Handle(*slot, Releaser{this});
+        const size_t allocatedNow = allocatedSlots.load(std::memory_order_relaxed);
+        if (allocatedNow >= maxSlots)
+            return Handle(nullptr, Releaser{this});
+
+        const size_t count = std::min(SLAB_SLOTS, maxSlots - allocatedNow);
+        slabs.emplace_back(new T[count]);
+        T* slab = slabs.back().get();
+        for (size_t i = 1; i < count; ++i)
+            putFree(slab + i);
+        allocatedSlots.store(allocatedNow + count, std::memory_order_relaxed);
+        return Handle(slab, Releaser{this});
+    }
+
+    const size_t maxSlots;
+    BoundedQueue<T*> freeSlots;
+    std::mutex growMutex;
+    std::vector<std::unique_ptr<T[]>> slabs;
+    std::atomic<size_t> allocatedSlots{0};
+};
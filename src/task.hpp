@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+
+inline constexpr size_t TASK_INLINE_SIZE = 56;  // task with its dispatch pointer takes one cache line
+
+/// Move-only type-erased callable for the thread pool
+/// Callable, that fits into TASK_INLINE_SIZE and is nothrow movable, is kept inside the task, so submitting it
+/// allocates nothing, larger ones are moved to the heap. Unlike std::function it doesn't require copyable callables,
+/// so tasks can own buffers and other move-only handles
+class Task
+{
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        void (*relocate)(void* from, void* to) noexcept;  // move to other storage and destroy the source
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<typename F>
+    static constexpr bool storedInline = sizeof (F) <= TASK_INLINE_SIZE && alignof(F) <= alignof(std::max_align_t)
+                                         && std::is_nothrow_move_constructible_v<F>;
+
+    template<typename F>
+    struct InlineOps
+    {
+        static F* get(void* storage) noexcept { return std::launder(static_cast<F*>(storage)); }
+        static void invoke(void* storage) { (*get(storage))(); }
+        static void relocate(void* from, void* to) noexcept
+        {
+            new (to) F(std::move(*get(from)));
+            get(from)->~F();
+        }
+        static void destroy(void* storage) noexcept { get(storage)->~F(); }
+        static constexpr Ops ops{invoke, relocate, destroy};
+    };
+
+    template<typename F>
+    struct HeapOps
+    {
+        static F*& get(void* storage) noexcept { return *std::launder(static_cast<F**>(storage)); }
+        static void invoke(void* storage) { (*get(storage))(); }
+        static void relocate(void* from, void* to) noexcept { new (to) F*(get(from)); }
+        static void destroy(void* storage) noexcept { delete get(storage); }
+        static constexpr Ops ops{invoke, relocate, destroy};
+    };
+
+    void reset() noexcept
+    {
+        if (ops)
+            ops->destroy(storage);
+        ops = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[TASK_INLINE_SIZE];
+    const Ops* ops = nullptr;
+
+public:
+    Task() noexcept = default;
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f)
+    {
+        using Fn = std::decay_t<F>;
+        if constexpr (storedInline<Fn>)
+        {
+            new (storage) Fn(std::forward<F>(f));
+            ops = &InlineOps<Fn>::ops;
+        }
+        else
+        {
+            new (storage) Fn*(new Fn(std::forward<F>(f)));
+            ops = &HeapOps<Fn>::ops;
+        }
+    }
+    Task(Task&& other) noexcept :
+        ops(other.ops)
+    {
+        if (ops)
+            ops->relocate(other.storage, storage);
+        other.ops = nullptr;
+    }
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            if (other.ops)
+                other.ops->relocate(other.storage, storage);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { reset(); }
+
+    void operator()() { ops->invoke(storage); }
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+    /// callable of the type is stored without allocation
+    template<typename F>
+    static constexpr bool fitsInline() noexcept { return storedInline<std::decay_t<F>>; }
+};
+
+/// Result of awaitable task, shared between the task and the waiting thread
+/// State is a single allocation, waiting is std::atomic wait on the ready flag, that is a futex on Linux
+template<typename T>
+class TaskFuture
+{
+    struct State
+    {
+        std::atomic<uint32_t> ready{0};
+        std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> value;
+        std::exception_ptr error;
+    };
+
+    std::shared_ptr<State> state;
+
+    explicit TaskFuture(std::shared_ptr<State> state) noexcept :
+        state(std::move(state)) {}
+
+public:
+    TaskFuture() noexcept = default;
+
+    /// future and the task, that completes it, exceptions of the callable are passed to get()
+    template<typename F>
+    static std::pair<TaskFuture<T>, Task> makeTask(F&& f)
+    {
+        auto state = std::make_shared<State>();
+        Task task([state, f = std::forward<F>(f)]() mutable {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    f();
+                    state->value.emplace(true);
+                }
+                else
+                    state->value.emplace(f());
+            } catch (...) {
+                state->error = std::current_exception();
+            }
+            state->ready.store(1, std::memory_order_release);
+            state->ready.notify_all();
+        });
+        return {TaskFuture<T>(std::move(state)), std::move(task)};
+    }
+
+    bool valid() const noexcept { return state != nullptr; }
+    bool ready() const noexcept { return state && state->ready.load(std::memory_order_acquire) != 0; }
+
+    void wait() const
+    {
+        if (!state)
+            throw std::runtime_error("TaskFuture has no state");
+        while (state->ready.load(std::memory_order_acquire) == 0)
+            state->ready.wait(0, std::memory_order_acquire);
+    }
+
+    /// wait for the task and take its result, future is not valid after that
+    T get()
+    {
+        wait();
+        const std::shared_ptr<State> finished = std::move(state);
+        if (finished->error)
+            std::rethrow_exception(finished->error);
+        if constexpr (!std::is_void_v<T>)
+            return std::move(*finished->value);
+    }
+};
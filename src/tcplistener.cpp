@@ -0,0 +1,426 @@
+#include "tcplistener.hpp"
+#include "dnsexception.hpp"
+#include "logger.hpp"
+#include "server.hpp"
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+TcpListener::TcpListener(const sockaddr_in& address, unsigned maxConnections, unsigned idleTimeout, DnsCache& cache,
+                         Forwarder& forwarder) :
+    cache(cache), forwarder(forwarder), maxConnections(maxConnections),
+    idleTicks(static_cast<uint64_t>(idleTimeout) * 1000 / TCP_TICK_INTERVAL), readBuffer(TCP_READ_SIZE),
+    idleTimers(currentTick())
+{
+    if (maxConnections < 1 || maxConnections > MAX_TCP_CONNECTIONS)
+        throw std::runtime_error("Invalid TCP connections number, should be in range [1, " + std::to_string(MAX_TCP_CONNECTIONS) + "]");
+    if (idleTimeout < 1 || idleTimeout > MAX_TCP_IDLE_TIMEOUT)
+        throw std::runtime_error("Invalid TCP idle timeout, should be in range [1, " + std::to_string(MAX_TCP_IDLE_TIMEOUT) + "]");
+
+    // every connection takes a descriptor, default soft limit is usually far below the connection limit
+    rlimit fileLimit;
+    const rlim_t needed = static_cast<rlim_t>(maxConnections) + TCP_RESERVED_FDS;
+    if (getrlimit(RLIMIT_NOFILE, &fileLimit) == 0 && fileLimit.rlim_cur < needed)
+    {
+        fileLimit.rlim_cur = std::min(needed, fileLimit.rlim_max);
+        if (setrlimit(RLIMIT_NOFILE, &fileLimit) != 0 || fileLimit.rlim_cur < needed)
+        {
+            const std::string logMsg("TcpListener open files limit " + std::to_string(fileLimit.rlim_cur)
+                                     + " is below TCP connections limit, connections are accepted while descriptors last");
+            Logger::logWarning(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+    }
+
+    try
+    {
+        listenFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFD < 0)
+            throw std::runtime_error("Failed to create TCP socket");
+        const int enable = 1;
+        if (setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof (enable)) != 0)
+            throw std::runtime_error("Failed to set SO_REUSEADDR on TCP socket");
+        if (bind(listenFD, (const struct sockaddr*) &address, sizeof (address)) != 0)
+            throw std::runtime_error("Failed to bind TCP socket");
+        if (listen(listenFD, TCP_LISTEN_BACKLOG) != 0)
+            throw std::runtime_error("Failed to listen on TCP socket");
+
+        eventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFD < 0)
+            throw std::runtime_error("Failed to create eventfd for TcpListener");
+        epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFD < 0)
+            throw std::runtime_error("Failed to create epoll instance for TcpListener");
+        for (int fd : {listenFD, eventFD})
+        {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) != 0)
+                throw std::runtime_error("Failed to add TcpListener socket to epoll");
+        }
+
+        processingThread = std::thread(&TcpListener::run, this);
+    } catch (std::exception& e) {
+        for (int fd : {listenFD, eventFD, epollFD})
+            if (fd >= 0)
+                close(fd);
+        throw;
+    }
+}
+
+TcpListener::~TcpListener()
+{
+    stop();
+    for (auto& connection : connections)
+        if (connection.fd >= 0)
+            closeConnection(connection);
+    close(listenFD);
+    close(eventFD);
+    close(epollFD);
+}
+
+void TcpListener::stop() noexcept
+{
+    done = true;  // thread checks the flag on every tick
+    if (processingThread.joinable())
+        processingThread.join();
+}
+
+uint64_t TcpListener::currentTick() noexcept
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count() / TCP_TICK_INTERVAL;
+}
+
+void TcpListener::run() noexcept
+{
+    std::array<epoll_event, TCP_EVENTS_PER_WAIT> events;
+    while (!done)
+    {
+        const int eventCount = epoll_wait(epollFD, events.data(), events.size(), TCP_TICK_INTERVAL);
+        if (eventCount < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            const std::string logMsg(std::string("TcpListener Error waiting for events: ") + std::strerror(errno));
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+            return;
+        }
+        for (int i = 0; i < eventCount; ++i)
+        {
+            const int fd = events[i].data.fd;
+            try
+            {
+                if (fd == listenFD)
+                    acceptConnections();
+                else if (fd == eventFD)
+                    deliverCompletions();
+                else if (static_cast<size_t>(fd) < connections.size() && connections[fd].fd >= 0)
+                {
+                    Connection& connection = connections[fd];
+                    if (events[i].events & (EPOLLERR | EPOLLHUP))
+                        closeConnection(connection);
+                    else if (events[i].events & EPOLLIN)
+                        readConnection(connection);
+                    else if (events[i].events & EPOLLOUT)
+                        flush(connection);
+                }
+            } catch (std::exception& e) {
+                const std::string logMsg(std::string("TcpListener Caught Unhandled Exception: ") + e.what());
+                Logger::logError(logMsg);
+                Logger::logToStdout(logMsg);
+            }
+        }
+        expireIdle();
+    }
+}
+
+void TcpListener::acceptConnections()
+{
+    for (;;)
+    {
+        sockaddr_in peer{};
+        socklen_t peerLength = sizeof (peer);
+        const int fd = accept4(listenFD, (struct sockaddr*) &peer, &peerLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EMFILE || errno == ENFILE)
+            {
+                // listening socket would stay readable, so it's paused until a descriptor is released
+                const std::string logMsg("TcpListener out of descriptors with " + std::to_string(connectionCount) + " connections, accepting is paused");
+                Logger::logWarning(logMsg);
+                Logger::logToStdout(logMsg);
+                epoll_event event{};
+                event.data.fd = listenFD;
+                epoll_ctl(epollFD, EPOLL_CTL_MOD, listenFD, &event);
+                acceptPaused = true;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+        if (connectionCount >= maxConnections)
+        {
+            close(fd);  // client retries later or with another server
+            continue;
+        }
+
+        const int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof (enable));  // responses are written as whole messages
+        if (static_cast<size_t>(fd) >= connections.size())
+            connections.resize(fd + 1);
+        Connection& connection = connections[fd];
+        connection.fd = fd;
+        connection.generation = nextGeneration++;
+        connection.peer = peer;
+        connection.lastActive = currentTick();
+        connection.events = EPOLLIN;
+        epoll_event event{};
+        event.events = connection.events;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            connection = Connection();
+            continue;
+        }
+        ++connectionCount;
+        idleTimers.schedule(connection.lastActive + idleTicks, {fd, connection.generation});
+    }
+}
+
+void TcpListener::readConnection(Connection& connection)
+{
+    const ssize_t received = recv(connection.fd, readBuffer.data(), readBuffer.size(), 0);
+    if (received < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            closeConnection(connection);
+        return;
+    }
+    if (received == 0)
+    {
+        // client is done sending, queries in progress are still answered
+        connection.peerClosed = true;
+        return flush(connection);
+    }
+
+    connection.lastActive = currentTick();
+    if (connection.input.empty())
+    {
+        // usual case of whole messages is handled in place
+        const size_t consumed = handleMessages(connection, readBuffer.data(), received);
+        connection.input.assign(readBuffer.data() + consumed, received - consumed);
+    }
+    else
+    {
+        connection.input.append(readBuffer.data(), received);
+        connection.input.erase(0, handleMessages(connection, connection.input.data(), connection.input.size()));
+    }
+    flush(connection);
+}
+
+size_t TcpListener::handleMessages(Connection& connection, const char* data, size_t size)
+{
+    size_t consumed = 0;
+    while (connection.pending < MAX_TCP_PIPELINE && size - consumed >= 2)
+    {
+        const size_t length = static_cast<uint8_t>(data[consumed]) << 8 | static_cast<uint8_t>(data[consumed + 1]);
+        if (size - consumed - 2 < length)
+            break;
+        handleQuery(connection, data + consumed + 2, static_cast<int>(length));
+        consumed += length + 2;
+    }
+    return consumed;
+}
+
+void TcpListener::handleQuery(Connection& connection, const char* packet, int size)
+{
+    char* responseBuffer = Server::streamResponseBuffer();
+    int bytesWritten = 0;
+    try
+    {
+        // log when out of scope, shared with forward completion
+        auto logRequest = std::make_shared<Server::RequestLogger>(connection.peer, size);
+        DNSQuery query = Server::readQuery(packet, size, *logRequest);
+        query.setStreamTransport();
+        logRequest->setStreamTransport();
+
+        bool prefetch = false;
+        bytesWritten = Server::answerFromCache(query, cache, responseBuffer, *logRequest, &prefetch);
+        if (prefetch)
+            Server::prefetchEntry(query, forwarder, cache, logRequest);
+        if (bytesWritten == 0)
+        {
+            logRequest->addLogTask(LogLevel::INFO, "TcpListener get entry from Forward Server");
+            logRequest->setForwarded();
+            try
+            {
+                forwarder.forward(query, [this, key = ConnectionKey{connection.fd, connection.generation}, query, logRequest](const char* packet, int size) {
+                    char* responseBuffer = Server::streamResponseBuffer();
+                    post(key, responseBuffer, Server::answerForwarded(query, packet, size, cache, responseBuffer, *logRequest));
+                });
+                ++connection.pending;
+            } catch (DNSException& e) {
+                bytesWritten = Server::answerForwardError(e, query, cache, responseBuffer, *logRequest);
+            }
+        }
+    } catch (DNSException& e) {
+        bytesWritten = Server::writeErrorResponse(e, responseBuffer);
+    } catch (std::exception& e) {
+        const std::string logMsg(std::string("TcpListener Caught Unhandled Exception: ") + e.what());
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+    if (bytesWritten > 0)
+        queueResponse(connection, responseBuffer, bytesWritten);
+}
+
+void TcpListener::queueResponse(Connection& connection, const char* response, int size)
+{
+    connection.output.push_back(static_cast<char>(size >> 8));
+    connection.output.push_back(static_cast<char>(size & 0xFF));
+    connection.output.append(response, size);
+}
+
+void TcpListener::flush(Connection& connection)
+{
+    while (connection.outputSent < connection.output.size())
+    {
+        const ssize_t sent = send(connection.fd, connection.output.data() + connection.outputSent,
+                                  connection.output.size() - connection.outputSent, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return closeConnection(connection);
+        }
+        connection.outputSent += sent;
+        connection.lastActive = currentTick();
+    }
+    if (connection.outputSent == connection.output.size())
+    {
+        // memory of large bursts is released, idle connection keeps nothing
+        connection.output.clear();
+        connection.output.shrink_to_fit();
+        connection.outputSent = 0;
+        if (connection.peerClosed && connection.pending == 0)
+            return closeConnection(connection);
+    }
+    updateEvents(connection);
+}
+
+void TcpListener::updateEvents(Connection& connection)
+{
+    uint32_t events = 0;
+    // slow readers and long pipelines are paused, so memory of a connection stays bounded
+    if (!connection.peerClosed && connection.pending < MAX_TCP_PIPELINE
+        && connection.output.size() - connection.outputSent < MAX_TCP_OUTPUT)
+        events |= EPOLLIN;
+    if (connection.outputSent < connection.output.size())
+        events |= EPOLLOUT;
+    if (events == connection.events)
+        return;
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = connection.fd;
+    if (epoll_ctl(epollFD, EPOLL_CTL_MOD, connection.fd, &event) != 0)
+        return closeConnection(connection);
+    connection.events = events;
+}
+
+void TcpListener::closeConnection(Connection& connection) noexcept
+{
+    close(connection.fd);  // removes it from epoll too
+    connection = Connection();
+    --connectionCount;
+    if (acceptPaused)
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listenFD;
+        acceptPaused = epoll_ctl(epollFD, EPOLL_CTL_MOD, listenFD, &event) != 0;
+    }
+}
+
+TcpListener::Connection* TcpListener::find(ConnectionKey key) noexcept
+{
+    if (static_cast<size_t>(key.fd) >= connections.size())
+        return nullptr;
+    Connection& connection = connections[key.fd];
+    return connection.fd >= 0 && connection.generation == key.generation ? &connection : nullptr;
+}
+
+void TcpListener::post(ConnectionKey key, const char* response, int size) noexcept
+{
+    bool wake;
+    try
+    {
+        std::lock_guard<std::mutex> lk(completionMutex);
+        wake = completions.empty();  // otherwise thread is already woken up for the earlier ones
+        completions.push_back({key, size > 0 ? std::string(response, size) : std::string()});
+    } catch (std::exception& e) {
+        const std::string logMsg(std::string("TcpListener Error posting response: ") + e.what());
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+        return;
+    }
+    const uint64_t one = 1;
+    if (wake && write(eventFD, &one, sizeof (one)) != sizeof (one))
+    {
+        const std::string logMsg(std::string("TcpListener Error waking up thread: ") + std::strerror(errno));
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+void TcpListener::deliverCompletions()
+{
+    // counter is reset before taking the queue, so completion posted after that wakes the thread again
+    uint64_t counter;
+    if (read(eventFD, &counter, sizeof (counter)) < 0 && errno != EAGAIN)
+        throw std::runtime_error(std::string("Failed to read TcpListener eventfd: ") + std::strerror(errno));
+    std::vector<Completion> ready;
+    {
+        std::lock_guard<std::mutex> lk(completionMutex);
+        ready.swap(completions);
+    }
+    for (auto& completion : ready)
+    {
+        Connection* connection = find(completion.key);
+        if (!connection)
+            continue;  // client is gone
+        --connection->pending;
+        if (!completion.response.empty())
+            queueResponse(*connection, completion.response.data(), static_cast<int>(completion.response.size()));
+        // messages left behind the pipeline limit
+        connection->input.erase(0, handleMessages(*connection, connection->input.data(), connection->input.size()));
+        flush(*connection);
+    }
+}
+
+void TcpListener::expireIdle()
+{
+    const uint64_t now = currentTick();
+    idleTimers.advance(now, [this, now](ConnectionKey key) {
+        Connection* connection = find(key);
+        if (!connection)
+            return;
+        const bool busy = connection->pending != 0 || connection->outputSent < connection->output.size();
+        if (!busy && connection->lastActive + idleTicks <= now)
+            return closeConnection(*connection);
+        // activity moved the deadline, timer is rescheduled instead of updated on every message
+        idleTimers.schedule(std::max(connection->lastActive + idleTicks, now + 1), key);
+    });
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "dnscache.hpp"
+#include "forwarder.hpp"
+#include "timerwheel.hpp"
+#include <netinet/in.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+inline constexpr unsigned DEFAULT_TCP_MAX_CONNECTIONS = 16384;
+inline constexpr unsigned MAX_TCP_CONNECTIONS = 1000000;
+inline constexpr unsigned DEFAULT_TCP_IDLE_TIMEOUT = 10;  // in sec
+inline constexpr unsigned MAX_TCP_IDLE_TIMEOUT = 3600;  // in sec
+inline constexpr int TCP_TICK_INTERVAL = 100;  // in millisec, resolution of idle timeouts
+inline constexpr int TCP_LISTEN_BACKLOG = 4096;
+inline constexpr unsigned TCP_EVENTS_PER_WAIT = 256;
+inline constexpr unsigned MAX_TCP_PIPELINE = 64;  // queries of a connection waiting for Forward Server, reading stops above it
+inline constexpr size_t MAX_TCP_OUTPUT = 64 * 1024;  // unsent responses of a connection, reading stops above it
+inline constexpr size_t TCP_READ_SIZE = 64 * 1024;
+inline constexpr unsigned TCP_RESERVED_FDS = 256;  // descriptors kept for the server sockets beyond connection limit
+
+/*
+    DNS over TCP listener (RFC 7766) driven by epoll in a single thread
+    Messages are framed with 2-byte length, connections are persistent and queries may be pipelined.
+    Every query goes through the same stages as UDP ones: cache hits are answered in place, misses are forwarded
+    and their completions are posted back to the thread over eventfd, so answers are sent in the order they are ready.
+    Connection keeps only its partial input and unsent output, so a single thread holds tens of thousands of them.
+    Idle connections are closed from a timing wheel, connections above the limit are closed right after accept
+*/
+class TcpListener
+{
+public:
+    // listening socket is bound to the address and served by own thread until stop
+    TcpListener(const sockaddr_in& address, unsigned maxConnections, unsigned idleTimeout, DnsCache& cache, Forwarder& forwarder);
+    ~TcpListener();
+    TcpListener(const TcpListener&) = delete;
+    TcpListener& operator=(const TcpListener&) = delete;
+
+    /// stop the thread and close every connection, queries in progress are not answered
+    void stop() noexcept;
+
+private:
+    struct Connection
+    {
+        int fd = -1;
+        uint32_t generation = 0;  // fd is reused after close, so completions and timers are matched by generation too
+        sockaddr_in peer{};
+        std::string input;  // received bytes of incomplete messages
+        std::string output;  // framed responses not sent yet
+        size_t outputSent = 0;
+        unsigned pending = 0;  // queries waiting for Forward Server
+        uint64_t lastActive = 0;  // in ticks
+        uint32_t events = 0;  // registered in epoll
+        bool peerClosed = false;
+    };
+    struct ConnectionKey
+    {
+        int fd;
+        uint32_t generation;
+    };
+    struct Completion
+    {
+        ConnectionKey key;
+        std::string response;  // empty if there is nothing to send
+    };
+
+    void run() noexcept;
+    void acceptConnections();
+    void readConnection(Connection& connection);
+    // handle every complete message of the data up to the pipeline limit, returns number of bytes consumed
+    size_t handleMessages(Connection& connection, const char* data, size_t size);
+    void handleQuery(Connection& connection, const char* packet, int size);
+    void queueResponse(Connection& connection, const char* response, int size);
+    // send queued output and update events, connection is closed if it's finished or failed
+    void flush(Connection& connection);
+    void updateEvents(Connection& connection);
+    void closeConnection(Connection& connection) noexcept;
+    // called from forward completion threads
+    void post(ConnectionKey key, const char* response, int size) noexcept;
+    void deliverCompletions();
+    void expireIdle();
+    Connection* find(ConnectionKey key) noexcept;
+    static uint64_t currentTick() noexcept;
+
+    DnsCache& cache;
+    Forwarder& forwarder;
+    unsigned maxConnections;
+    uint64_t idleTicks;
+    int listenFD = -1;
+    int epollFD = -1;
+    int eventFD = -1;
+    std::vector<Connection> connections;  // indexed by fd
+    unsigned connectionCount = 0;
+    uint32_t nextGeneration = 0;
+    bool acceptPaused = false;  // out of descriptors, accepting is resumed when a connection is closed
+    std::vector<char> readBuffer;
+    TimerWheel<ConnectionKey> idleTimers;
+    std::mutex completionMutex;
+    std::vector<Completion> completions;
+    std::atomic_bool done{false};
+    std::thread processingThread;
+};
@@ -1,13 +1,21 @@
 #pragma once
 
+#include "eventcount.hpp"
 #include "queue.hpp"
+#include "task.hpp"
 #include <chrono>
 #include <functional>
-#include <future>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
 
+inline constexpr size_t THREAD_POOL_QUEUE_CAPACITY = 65536;
+inline constexpr size_t WORK_STEALING_DEQUE_CAPACITY = 1024;  // tasks submitted by a worker itself, power of 2
+
 /// class for RAII graceful thread stopping
 class ThreadJoiner
 {
@@ -24,91 +32,259 @@ public:
     }
 };
 
+enum class SchedulerType
+{
+    GlobalQueue,  // all workers take tasks from one shared queue
+    WorkStealing  // every worker has own queues, idle workers steal from others
+};
+
 /// Thread pool with fixed size of threads, either ideal count of user-provided.
-/// it uses global lock-free task queue, and accepts all bindable function call tasks
+/// it uses global bounded lock-free task queue, and accepts all invocable function call tasks.
+/// Tasks are move-only and keep small callables inline, so submitting a pointer-sized handle doesn't allocate.
+/// Submit to the full queue fails, so overload is pushed back to the caller instead of growing memory.
+/// Idle worker spins on the queue for a short time and then parks on a futex until the next submit,
+/// so task is picked up in microseconds without burning idle CPU.
+/// In work-stealing mode external submissions are spread round-robin over per-worker inboxes,
+/// tasks submitted from a worker go to its own Chase-Lev deque and are taken back in LIFO order.
+/// Worker without tasks steals from the deques and inboxes of others, starting from a random one,
+/// so workers don't contend on a single queue head
 class ThreadPool
 {
-    using Task = std::function<void()>;
+public:
+    using Task = ::Task;
+
+private:
+    struct alignas(CACHE_LINE_SIZE) Worker
+    {
+        Worker(size_t inboxCapacity) :
+            inbox(inboxCapacity), deque(WORK_STEALING_DEQUE_CAPACITY) {}
 
-    void threadWorker()
+        BoundedQueue<Task> inbox;  // tasks submitted from other threads
+        WorkStealingDeque<Task> deque;  // tasks submitted by the worker itself
+    };
+
+    void threadWorker(unsigned index)
     {
+        currentPool = this;
+        currentWorker = index;
         while(!done)
         {
-            if (auto task = workQueue.dequeue())
+            if (auto task = findTask(index))
+            {
+                (*task)();
+                continue;
+            }
+            if (auto task = spinFindTask(index))
+            {
                 (*task)();
-            else if (pollLatency != std::chrono::microseconds::zero())  // if latency was specified in constructor then thread blocks for the time
-                std::this_thread::sleep_for(std::chrono::microseconds(pollLatency));
+                continue;
+            }
+            // queue is checked after registering as a waiter, so submit in between is not missed
+            const uint32_t key = parking.prepareWait();
+            if (auto task = findTask(index))
+            {
+                parking.cancelWait();
+                (*task)();
+            }
+            else if (done)
+                parking.cancelWait();
             else
-                std::this_thread::yield();
+                parking.wait(key);
         }
         // finish remaining tasks
-        while (auto task = workQueue.dequeue())
+        while (auto task = findTask(index))
             (*task)();
+        currentPool = nullptr;
+    }
+
+    std::optional<Task> findTask(unsigned index)
+    {
+        if (scheduler == SchedulerType::GlobalQueue)
+            return workQueue.tryDequeue();
+
+        Worker& worker = *workers[index];
+        if (auto task = worker.deque.pop())
+            return task;
+        if (auto task = worker.inbox.tryDequeue())
+            return task;
+        return steal(index);
     }
 
-    void initializeThreads()
+    std::optional<Task> steal(unsigned index)
+    {
+        // random victim first, so thieves don't line up on the same worker
+        thread_local std::minstd_rand random(index + 1);
+        const size_t count = workers.size();
+        const size_t first = random() % count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t victim = (first + i) % count;
+            if (victim == index)
+                continue;
+            if (auto task = workers[victim]->deque.steal())
+                return task;
+            if (auto task = workers[victim]->inbox.tryDequeue())
+                return task;
+        }
+        return {};
+    }
+
+    // poll the queue for spinTime, bursts of requests are taken without going through the futex
+    std::optional<Task> spinFindTask(unsigned index)
+    {
+        if (spinTime == std::chrono::microseconds::zero())
+            return {};
+        const auto deadline = std::chrono::steady_clock::now() + spinTime;
+        do
+        {
+            std::this_thread::yield();
+            if (auto task = findTask(index))
+                return task;
+        }
+        while (!done && std::chrono::steady_clock::now() < deadline);
+        return {};
+    }
+
+    bool enqueue(Task& task)
+    {
+        if (scheduler == SchedulerType::GlobalQueue)
+            return workQueue.tryEnqueue(std::move(task));
+
+        if (currentPool == this && workers[currentWorker]->deque.push(std::move(task)))
+            return true;
+        // next inbox with free space
+        const size_t count = workers.size();
+        const size_t first = nextWorker.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i)
+            if (workers[(first + i) % count]->inbox.tryEnqueue(std::move(task)))
+                return true;
+        return false;
+    }
+
+    void initializeThreads(size_t queueCapacity)
     {
         try
         {
+            if (scheduler == SchedulerType::WorkStealing)
+            {
+                // queue capacity is shared by the inboxes
+                const unsigned workerCount = std::max(threadNum, 1u);
+                for (unsigned i = 0; i < workerCount; ++i)
+                    workers.push_back(std::make_unique<Worker>(std::max<size_t>(queueCapacity / workerCount, 2)));
+            }
             for (unsigned i = 0; i < threadNum; ++i)
-                threads.emplace_back(&ThreadPool::threadWorker, this);
+                threads.emplace_back(&ThreadPool::threadWorker, this, i);
         } catch (const std::exception& e) {
             done = true;
             throw std::runtime_error(std::string("Error creating thread pool: ") + e.what());
         }
     }
 
-    std::chrono::microseconds pollLatency;
+    // function and its arguments are moved into the task and moved out on the single call,
+    // so move-only arguments are accepted and nothing is copied
+    template<typename F, typename ...Args>
+    static auto bindTask(F&& f, Args&&... args)
+    {
+        if constexpr (sizeof...(Args) == 0)
+            return std::forward<F>(f);
+        else
+            return [f = std::forward<F>(f), ...args = std::forward<Args>(args)]() mutable -> decltype(auto) {
+                return std::invoke(std::move(f), std::move(args)...);
+            };
+    }
+
+    // worker, that runs on this thread, if any
+    static inline thread_local ThreadPool* currentPool = nullptr;
+    static inline thread_local unsigned currentWorker = 0;
+
+    std::chrono::microseconds spinTime;
     unsigned threadNum;
+    SchedulerType scheduler;
     std::atomic_bool done;
-    LockFreeQueue<Task> workQueue;
+    BoundedQueue<Task> workQueue;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> nextWorker{0};
+    EventCount parking;
     std::vector<std::thread> threads;
     ThreadJoiner joiner;
 
 public:
-    /// optionally provide time in micro-seconds for thread workers to sleep for between task polling
-    ThreadPool(std::chrono::microseconds pollLatencyMicroseconds = std::chrono::microseconds::zero()) :
-        pollLatency(pollLatencyMicroseconds),
-        threadNum(std::max(std::thread::hardware_concurrency(), 1u)),
-        done(false), 
-        joiner(threads)
-    {
-        initializeThreads();
-    }
+    /// optionally provide time in micro-seconds for idle thread workers to poll for new task before parking,
+    /// number of tasks, that can wait in the queues, and scheduler type
+    ThreadPool(std::chrono::microseconds spinTimeMicroseconds = std::chrono::microseconds::zero(),
+               size_t queueCapacity = THREAD_POOL_QUEUE_CAPACITY, SchedulerType scheduler = SchedulerType::GlobalQueue) :
+        ThreadPool(std::max(std::thread::hardware_concurrency(), 1u), spinTimeMicroseconds, queueCapacity, scheduler) {}
     /// provide custom number of threads in the pool
-    ThreadPool(unsigned threadNumber, std::chrono::microseconds pollLatencyMicroseconds = std::chrono::microseconds::zero()) :
-        pollLatency(pollLatencyMicroseconds),
+    ThreadPool(unsigned threadNumber, std::chrono::microseconds spinTimeMicroseconds = std::chrono::microseconds::zero(),
+               size_t queueCapacity = THREAD_POOL_QUEUE_CAPACITY, SchedulerType scheduler = SchedulerType::GlobalQueue) :
+        spinTime(spinTimeMicroseconds),
         threadNum(threadNumber),
+        scheduler(scheduler),
         done(false), 
+        workQueue(scheduler == SchedulerType::GlobalQueue ? queueCapacity : 2),
         joiner(threads)
     {
-        initializeThreads();
+        initializeThreads(queueCapacity);
     }
     ~ThreadPool()
     {
-        done = true;
+        shutdown();
     }
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
 
-    /// submit awaitable task with future, exception safety is not guaranteed for the task function 
-    /// and should be handled inside the provided function internally
+    /// run queued tasks and join the workers, tasks submitted afterwards are never run.
+    /// Worker, that calls it, e.g. from exit in signal handler, is detached, it's not resumed
+    void shutdown() noexcept
+    {
+        done = true;
+        parking.notifyAll();
+        for (auto& thread : threads)
+        {
+            if (!thread.joinable())
+                continue;
+            if (thread.get_id() == std::this_thread::get_id())
+                thread.detach();
+            else
+                thread.join();
+        }
+    }
+
+    /// submit awaitable task with future, exception of the task function is rethrown from the future's get.
+    /// Throws runtime_error if the queue is full
     template<typename F, typename ...Args>
     auto awaitSubmit(F&& f, Args&&... args)
     {
-        using FuncResType = typename std::result_of<F(Args...)>::type;
-        auto task = std::make_shared<std::packaged_task<FuncResType()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        std::future<FuncResType> res(task.get()->get_future());
-        workQueue.enqueue([task]() { (*task)(); });
-        return res;
+        using FuncResType = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+        auto [res, task] = TaskFuture<FuncResType>::makeTask(bindTask(std::forward<F>(f), std::forward<Args>(args)...));
+        if (!trySubmit(task))
+            throw std::runtime_error("Thread pool queue is full");
+        return std::move(res);
     }
 
     /// submit non-awaitable task as-is, exception safety is not guaranteed for the task function 
-    /// and should be handled inside the provided function internally
+    /// and should be handled inside the provided function internally.
+    /// Returns false if the queue is full, task is not run then
     template<typename F, typename ...Args>
-    void submit(F&& f, Args&&... args)
+    [[nodiscard]] bool submit(F&& f, Args&&... args)
+    {
+        Task task(bindTask(std::forward<F>(f), std::forward<Args>(args)...));
+        return trySubmit(task);
+    }
+
+    /// submit prepared task, it's moved into the queue on success and left to the caller if the queue is full
+    [[nodiscard]] bool trySubmit(Task& task)
+    {
+        if (!enqueue(task))
+            return false;
+        parking.notifyOne();
+        return true;
+    }
+
+    size_t queueCapacity() const noexcept
     {
-        workQueue.enqueue(std::move(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
-        return;
+        if (scheduler == SchedulerType::GlobalQueue)
+            return workQueue.capacity();
+        return workers.empty() ? 0 : workers.size() * workers.front()->inbox.capacity();
     }
 };
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+
+inline constexpr unsigned TIMER_WHEEL_LEVELS = 4;
+inline constexpr unsigned TIMER_WHEEL_BITS = 6;  // 64 buckets per level
+inline constexpr uint64_t TIMER_WHEEL_BUCKETS = 1u << TIMER_WHEEL_BITS;
+inline constexpr uint32_t NO_TIMER = UINT32_MAX;  // handle of no timer
+
+/// Hierarchical timing wheel with tick resolution
+/// Level 0 has a bucket per tick, every next level has a bucket per full turn of the previous one,
+/// so 4 levels of 64 buckets cover 2^24 ticks. Timers further than that wait in the last level and are rescheduled.
+/// Buckets of the upper level are cascaded down when the lower level wraps, so schedule and expiry are O(1) amortized.
+/// Timers are nodes of intrusive bucket lists in one vector, their slots are reused after expiry or cancel,
+/// so the handle returned by schedule can move or cancel the timer in O(1) and memory is bounded by live timers.
+/// Not thread-safe
+template<typename T>
+class TimerWheel
+{
+    struct Timer
+    {
+        uint64_t expiresAt;
+        T item;
+        uint32_t prev;
+        uint32_t next;  // in the bucket, or in the free list
+        uint32_t bucket;  // level * TIMER_WHEEL_BUCKETS + index
+    };
+
+    void place(uint32_t handle)
+    {
+        Timer& timer = timers[handle];
+        const uint64_t delta = timer.expiresAt > now ? timer.expiresAt - now : 0;
+        unsigned level = 0;
+        while (level + 1 < TIMER_WHEEL_LEVELS && delta >= (TIMER_WHEEL_BUCKETS << (TIMER_WHEEL_BITS * level)))
+            ++level;
+        // expired timers go to the next bucket of level 0
+        const uint64_t at = std::max(timer.expiresAt, now + 1);
+        timer.bucket = static_cast<uint32_t>(level * TIMER_WHEEL_BUCKETS + ((at >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_BUCKETS - 1)));
+        timer.prev = NO_TIMER;
+        timer.next = heads[timer.bucket];
+        if (timer.next != NO_TIMER)
+            timers[timer.next].prev = handle;
+        heads[timer.bucket] = handle;
+    }
+
+    void unlink(uint32_t handle) noexcept
+    {
+        const Timer& timer = timers[handle];
+        if (timer.prev != NO_TIMER)
+            timers[timer.prev].next = timer.next;
+        else
+            heads[timer.bucket] = timer.next;
+        if (timer.next != NO_TIMER)
+            timers[timer.next].prev = timer.prev;
+    }
+
+    void release(uint32_t handle) noexcept
+    {
+        timers[handle].next = freeList;
+        freeList = handle;
+        --count;
+    }
+
+    // take all timers of the bucket, their list stays linked by next
+    uint32_t detach(uint32_t bucket) noexcept
+    {
+        const uint32_t first = heads[bucket];
+        heads[bucket] = NO_TIMER;
+        return first;
+    }
+
+    // move timers of the current bucket of the level down, as they are closer now
+    void cascade(unsigned level)
+    {
+        for (uint32_t handle = detach(level * TIMER_WHEEL_BUCKETS + ((now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_BUCKETS - 1)));
+             handle != NO_TIMER;)
+        {
+            const uint32_t next = timers[handle].next;
+            place(handle);
+            handle = next;
+        }
+    }
+
+    std::vector<Timer> timers;
+    std::array<uint32_t, TIMER_WHEEL_LEVELS * TIMER_WHEEL_BUCKETS> heads;
+    uint32_t freeList = NO_TIMER;
+    uint64_t now;
+    size_t count = 0;
+
+public:
+    explicit TimerWheel(uint64_t startTime) :
+        now(startTime)
+    {
+        heads.fill(NO_TIMER);
+    }
+
+    /// returns handle of the timer, valid until it expires or is cancelled
+    uint32_t schedule(uint64_t expiresAt, T item)
+    {
+        uint32_t handle = freeList;
+        if (handle != NO_TIMER)
+        {
+            freeList = timers[handle].next;
+            timers[handle].expiresAt = expiresAt;
+            timers[handle].item = std::move(item);
+        }
+        else
+        {
+            handle = static_cast<uint32_t>(timers.size());
+            timers.push_back(Timer{expiresAt, std::move(item), NO_TIMER, NO_TIMER, 0});
+        }
+        ++count;
+        place(handle);
+        return handle;
+    }
+
+    /// move pending timer to the new time
+    void reschedule(uint32_t handle, uint64_t expiresAt)
+    {
+        unlink(handle);
+        timers[handle].expiresAt = expiresAt;
+        place(handle);
+    }
+
+    /// drop pending timer, its item is not passed to the handler
+    void cancel(uint32_t handle) noexcept
+    {
+        unlink(handle);
+        release(handle);
+    }
+
+    /// advance wheel tick by tick up to the time, and pass every expired item to the handler.
+    /// Handler may schedule new timers, but not cancel or reschedule pending ones
+    template<typename F>
+    void advance(uint64_t time, F&& onExpired)
+    {
+        while (now < time)
+        {
+            ++now;
+            for (unsigned level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+            {
+                if ((now & ((uint64_t(1) << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+                    break;
+                cascade(level);
+            }
+            for (uint32_t handle = detach(now & (TIMER_WHEEL_BUCKETS - 1)); handle != NO_TIMER;)
+            {
+                const uint32_t next = timers[handle].next;
+                if (timers[handle].expiresAt <= now)
+                {
+                    T item = std::move(timers[handle].item);
+                    release(handle);
+                    onExpired(std::move(item));
+                }
+                else
+                    place(handle);  // beyond the wheel range, wait another turn
+                handle = next;
+            }
+        }
+    }
+
+    size_t size() const noexcept { return count; }
+    // memory taken by every pending timer
+    static constexpr size_t timerBytes() noexcept { return sizeof (Timer); }
+};
@@ -0,0 +1,570 @@
+#include "uringengine.hpp"
+#include "dnsexception.hpp"
+#include "logger.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+namespace
+{
+constexpr uint16_t BUFFER_GROUP_ID = 0;
+
+int uringSetup(unsigned entries, io_uring_params* params) noexcept
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) noexcept
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+int uringRegister(int fd, unsigned opcode, void* arg, unsigned argCount) noexcept
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, argCount));
+}
+
+// kernel and user space share ring indexes, access them with acquire/release semantics
+unsigned loadAcquire(unsigned* ptr) noexcept
+{
+    return std::atomic_ref<unsigned>(*ptr).load(std::memory_order_acquire);
+}
+
+void storeRelease(unsigned* ptr, unsigned value) noexcept
+{
+    std::atomic_ref<unsigned>(*ptr).store(value, std::memory_order_release);
+}
+}
+
+
+UringIoEngine::UringIoEngine(int sockFD, const sockaddr_in& fwdServerAddr, DnsCache& cache, const std::atomic<bool>& stopping) :
+    sockFD(sockFD), cache(cache), stopping(stopping)
+{
+    try
+    {
+        setupRing();
+        setupBufferRing();
+
+        upstreamFD = socket(AF_INET, SOCK_DGRAM, 0);
+        if (upstreamFD < 0)
+            throw std::runtime_error("Failed to create socket for Forward Server");
+        // connected socket receives datagrams only from the Forward Server
+        if (connect(upstreamFD, (const struct sockaddr*) &fwdServerAddr, sizeof (fwdServerAddr)) != 0)
+            throw std::runtime_error("Failed to connect socket to Forward Server");
+    } catch (std::exception& e) {
+        release();
+        throw;
+    }
+
+    sendSlots.resize(URING_SEND_SLOTS);
+    freeSendSlots.reserve(URING_SEND_SLOTS);
+    for (int i = URING_SEND_SLOTS - 1; i >= 0; --i)
+        freeSendSlots.push_back(i);
+
+    clientRecvMsg.msg_namelen = sizeof (sockaddr_in);
+    upstreamRecvMsg.msg_namelen = sizeof (sockaddr_in);
+}
+
+UringIoEngine::~UringIoEngine()
+{
+    release();
+}
+
+void UringIoEngine::release() noexcept
+{
+    if (upstreamFD >= 0)
+        close(upstreamFD);
+    if (bufRing)
+        munmap(bufRing, bufRingSize);
+    if (sqes)
+        munmap(sqes, sqesSize);
+    if (ringPtr)
+        munmap(ringPtr, ringSize);
+    if (ringFD >= 0)
+        close(ringFD);
+    upstreamFD = ringFD = -1;
+    bufRing = nullptr;
+    sqes = nullptr;
+    ringPtr = nullptr;
+}
+
+void UringIoEngine::setupRing()
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof (params));
+    // multishot receives produce more completions than submissions
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_QUEUE_DEPTH * 4;
+    ringFD = uringSetup(URING_QUEUE_DEPTH, &params);
+    if (ringFD < 0)
+        throw std::runtime_error(std::string("io_uring_setup failed: ") + std::strerror(errno));
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+        throw std::runtime_error("io_uring single mmap is not supported by the kernel");
+
+    const size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    const size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+    ringSize = std::max(sqRingSize, cqRingSize);
+    ringPtr = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQ_RING);
+    if (ringPtr == MAP_FAILED)
+    {
+        ringPtr = nullptr;
+        throw std::runtime_error("Failed to map io_uring rings");
+    }
+    sqesSize = params.sq_entries * sizeof (io_uring_sqe);
+    void* sqesPtr = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFD, IORING_OFF_SQES);
+    if (sqesPtr == MAP_FAILED)
+        throw std::runtime_error("Failed to map io_uring submission entries");
+    sqes = static_cast<io_uring_sqe*>(sqesPtr);
+
+    char* ring = static_cast<char*>(ringPtr);
+    sqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+    sqEntries = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_entries);
+    sqArray = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+    sqLocalTail = *sqTail;
+    cqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+}
+
+void UringIoEngine::setupBufferRing()
+{
+    // every buffer holds recvmsg header, source address and the datagram
+    bufferSize = sizeof (io_uring_recvmsg_out) + sizeof (sockaddr_in) + MAX_UDP_PAYLOAD;
+    bufferMemory.resize(static_cast<size_t>(bufferSize) * URING_RECV_BUFFERS);
+
+    bufRingSize = URING_RECV_BUFFERS * sizeof (io_uring_buf);
+    void* ringMemory = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ringMemory == MAP_FAILED)
+        throw std::runtime_error("Failed to allocate provided buffer ring");
+    bufRing = static_cast<io_uring_buf_ring*>(ringMemory);
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof (reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufRing);
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = BUFFER_GROUP_ID;
+    if (uringRegister(ringFD, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        throw std::runtime_error(std::string("io_uring provided buffer ring is not supported: ") + std::strerror(errno));
+
+    for (unsigned i = 0; i < URING_RECV_BUFFERS; ++i)
+        recycleBuffer(static_cast<uint16_t>(i));
+}
+
+io_uring_sqe* UringIoEngine::getSqe()
+{
+    if (sqLocalTail - loadAcquire(sqHead) >= sqEntries)
+        submitAndWait(0);  // submission queue is full, flush it to the kernel
+    if (sqLocalTail - loadAcquire(sqHead) >= sqEntries)
+        throw std::runtime_error("io_uring submission queue overflow");
+
+    const unsigned index = sqLocalTail & sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof (io_uring_sqe));
+    sqArray[index] = index;
+    ++sqLocalTail;
+    ++toSubmit;
+    return sqe;
+}
+
+void UringIoEngine::submitAndWait(unsigned waitCount)
+{
+    storeRelease(sqTail, sqLocalTail);
+    for (;;)
+    {
+        int result = uringEnter(ringFD, toSubmit, waitCount, waitCount ? IORING_ENTER_GETEVENTS : 0);
+        if (result >= 0)
+        {
+            toSubmit -= std::min<unsigned>(toSubmit, result);
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EBUSY || errno == EAGAIN)
+        {  // completion queue is backed up, reap it and try again
+            processCompletions();
+            continue;
+        }
+        throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+    }
+}
+
+void UringIoEngine::processCompletions()
+{
+    // head is re-read on every iteration, handlers can reap completions themselves when submission queue is full
+    for (unsigned head = *cqHead; head != loadAcquire(cqTail); head = *cqHead)
+    {
+        const io_uring_cqe cqe = cqes[head & cqMask];
+        storeRelease(cqHead, head + 1);  // release entry before handling it, handlers can submit new entries
+        const auto type = static_cast<OpType>(cqe.user_data >> 32);
+        const auto index = static_cast<uint32_t>(cqe.user_data & 0xFFFFFFFF);
+        try
+        {
+            switch (type)
+            {
+            case ClientRecv:
+            case UpstreamRecv:
+                handleRecv(cqe, type);
+                break;
+            case ClientSend:
+            case UpstreamSend:
+                if (cqe.res < 0)
+                {
+                    const std::string logMsg(std::string("UringIoEngine Error sending datagram: ") + std::strerror(-cqe.res));
+                    Logger::logError(logMsg);
+                    Logger::logToStdout(logMsg);
+                }
+                freeSendSlots.push_back(index);
+                break;
+            case Tick:
+                expireForwards();
+                armTick();
+                break;
+            case ProvideBuffers:
+                if (cqe.res < 0)
+                    throw std::runtime_error(std::string("Failed to provide receive buffers: ") + std::strerror(-cqe.res));
+                break;
+            }
+        } catch (std::exception& e) {
+            const std::string logMsg(std::string("UringIoEngine Error processing completion: ") + e.what());
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+    }
+}
+
+void UringIoEngine::serve()
+{
+    armRecv(sockFD, &clientRecvMsg, ClientRecv);
+    armRecv(upstreamFD, &upstreamRecvMsg, UpstreamRecv);
+    armTick();
+    while (!stopping.load(std::memory_order_relaxed))
+    {
+        // submit replies and forwards queued while handling the previous completions in one call
+        submitAndWait(1);
+        processCompletions();
+    }
+}
+
+void UringIoEngine::armRecv(int fd, msghdr* msg, OpType type)
+{
+    io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP_ID;
+    sqe->user_data = makeUserData(type, 0);
+}
+
+void UringIoEngine::armTick()
+{
+    tickTimeout.tv_sec = 0;
+    tickTimeout.tv_nsec = FWD_TICK_INTERVAL * 1000000LL;
+    io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(&tickTimeout);
+    sqe->len = 1;
+    sqe->user_data = makeUserData(Tick, 0);
+}
+
+void UringIoEngine::recycleBuffer(uint16_t bufferId)
+{
+    if (classicBuffers)
+        return provideBuffers(bufferId, 1);
+
+    io_uring_buf* buf = &bufRing->bufs[bufTail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(bufferMemory.data() + static_cast<size_t>(bufferId) * bufferSize);
+    buf->len = bufferSize;
+    buf->bid = bufferId;
+    ++bufTail;
+    std::atomic_ref<uint16_t>(bufRing->tail).store(bufTail, std::memory_order_release);
+}
+
+void UringIoEngine::provideBuffers(uint16_t firstBufferId, unsigned count)
+{
+    io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(bufferMemory.data() + static_cast<size_t>(firstBufferId) * bufferSize);
+    sqe->len = bufferSize;
+    sqe->off = firstBufferId;
+    sqe->buf_group = BUFFER_GROUP_ID;
+    sqe->user_data = makeUserData(ProvideBuffers, firstBufferId);
+}
+
+void UringIoEngine::switchToClassicBuffers()
+{
+    const std::string logMsg("UringIoEngine kernel doesn't consume provided buffer ring, switching to classic provided buffers");
+    Logger::logWarning(logMsg);
+    Logger::logToStdout(logMsg);
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof (reg));
+    reg.bgid = BUFFER_GROUP_ID;
+    if (uringRegister(ringFD, IORING_UNREGISTER_PBUF_RING, &reg, 1) != 0)
+        throw std::runtime_error(std::string("Failed to unregister provided buffer ring: ") + std::strerror(errno));
+    classicBuffers = true;
+    provideBuffers(0, URING_RECV_BUFFERS);
+}
+
+int UringIoEngine::acquireSendSlot() noexcept
+{
+    if (freeSendSlots.empty())
+        return -1;
+    int index = freeSendSlots.back();
+    freeSendSlots.pop_back();
+    return index;
+}
+
+void UringIoEngine::submitSend(int slotIndex, int fd, const sockaddr_in* addr, int size, OpType type)
+{
+    SendSlot& slot = sendSlots[slotIndex];
+    slot.iov.iov_base = slot.buffer.data();
+    slot.iov.iov_len = size;
+    std::memset(&slot.msg, 0, sizeof (slot.msg));
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+    if (addr)
+    {
+        slot.addr = *addr;
+        slot.msg.msg_name = &slot.addr;
+        slot.msg.msg_namelen = sizeof (sockaddr_in);
+    }
+
+    io_uring_sqe* sqe = getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = makeUserData(type, slotIndex);
+}
+
+void UringIoEngine::sendResponse(int slotIndex, char* buffer, int size, const sockaddr_in& clientAddr)
+{
+    if (slotIndex >= 0)
+        return submitSend(slotIndex, sockFD, &clientAddr, size, ClientSend);
+
+    // all send slots are in flight, reply synchronously
+    if (sendto(sockFD, buffer, size, 0, (const struct sockaddr*) &clientAddr, sizeof (clientAddr)) == -1)
+    {
+        const std::string logMsg("UringIoEngine Error sending response to client");
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+void UringIoEngine::handleRecv(const io_uring_cqe& cqe, OpType type)
+{
+    msghdr* msg = type == ClientRecv ? &clientRecvMsg : &upstreamRecvMsg;
+    // some kernels accept buffer ring registration, but never select buffers from it
+    if (cqe.res == -ENOBUFS && !bufferRingUsed && !classicBuffers)
+        switchToClassicBuffers();
+    if (!(cqe.flags & IORING_CQE_F_MORE))  // multishot receive was terminated, arm it again
+        armRecv(type == ClientRecv ? sockFD : upstreamFD, msg, type);
+    if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+    {
+        if (cqe.res != -ENOBUFS)
+        {
+            const std::string logMsg(std::string("UringIoEngine Error receiving datagram: ") + std::strerror(-cqe.res));
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+        return;
+    }
+
+    bufferRingUsed = true;
+    const auto bufferId = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+    char* buffer = bufferMemory.data() + static_cast<size_t>(bufferId) * bufferSize;
+    const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(buffer);
+    char* name = buffer + sizeof (io_uring_recvmsg_out);
+    char* payload = name + msg->msg_namelen + msg->msg_controllen;
+    try
+    {
+        if (out->flags & MSG_TRUNC)
+            Logger::logWarning("UringIoEngine dropped truncated datagram");
+        else if (type == ClientRecv)
+        {
+            sockaddr_in clientAddr;
+            std::memcpy(&clientAddr, name, sizeof (clientAddr));
+            handleRequest(payload, static_cast<int>(out->payloadlen), clientAddr);
+        }
+        else
+            handleUpstreamResponse(payload, static_cast<int>(out->payloadlen));
+    } catch (...) {
+        recycleBuffer(bufferId);
+        throw;
+    }
+    recycleBuffer(bufferId);
+}
+
+void UringIoEngine::handleRequest(char* packet, int size, const sockaddr_in& clientAddr)
+{
+    const int slotIndex = acquireSendSlot();
+    char fallbackBuffer[MAX_UDP_PAYLOAD];
+    char* responseBuffer = slotIndex >= 0 ? sendSlots[slotIndex].buffer.data() : fallbackBuffer;
+    int bytesWritten = 0;
+    try
+    {
+        auto logRequest = std::make_unique<Server::RequestLogger>(clientAddr, size);  // log when request is finished
+        DNSQuery query = Server::readQuery(packet, size, *logRequest);
+        bool prefetch = false;
+        bytesWritten = Server::answerFromCache(query, cache, responseBuffer, *logRequest, &prefetch);
+        if (prefetch)
+        {
+            try
+            {
+                forward(query, clientAddr, logRequest, true);
+            } catch (DNSException& e) {
+                // client is answered from cache anyway
+                const std::string logMsg(std::string("UringIoEngine Error prefetching entry: ") + e.what());
+                Logger::logWarning(logMsg);
+                Logger::logToStdout(logMsg);
+            }
+        }
+        else if (bytesWritten == 0)
+        {
+            try
+            {
+                forward(query, clientAddr, logRequest);
+            } catch (DNSException& e) {
+                bytesWritten = Server::answerForwardError(e, query, cache, responseBuffer, *logRequest);
+            }
+        }
+    } catch (DNSException& e) {
+        bytesWritten = Server::writeErrorResponse(e, responseBuffer);
+    } catch (std::exception& e) {
+        const std::string logMsg(std::string("UringIoEngine Caught Unhandled Exception: ") + e.what());
+        Logger::logError(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+
+    if (bytesWritten > 0)
+        sendResponse(slotIndex, responseBuffer, bytesWritten, clientAddr);
+    else if (slotIndex >= 0)
+        freeSendSlots.push_back(slotIndex);
+}
+
+void UringIoEngine::forward(const DNSQuery& query, const sockaddr_in& clientAddr, std::unique_ptr<Server::RequestLogger>& logRequest,
+                            bool refresh)
+{
+    logRequest->addLogTask(LogLevel::INFO, refresh ? "RequestProccessor prefetch entry from Forward Server" : "RequestProccessor get entry from Forward Server");
+    if (!refresh)
+        logRequest->setForwarded();
+    typename ForwardTable<PendingForward>::InsertResult inserted;
+    PendingForward pending{query, clientAddr, std::move(logRequest), refresh};
+    try
+    {
+        inserted = pendingForwards.insert(QuestionKey::fromQuery(query.getData()), std::move(pending));
+    } catch (std::runtime_error& e) {
+        logRequest = std::move(pending.logRequest);  // table is full, pending is not taken
+        throw DNSException(DNSHeader::ServerFail, query.getId(), e.what());
+    }
+    if (inserted.coalesced)
+        return;  // will be answered with response to the query in flight
+
+    const int slotIndex = acquireSendSlot();
+    if (slotIndex < 0)
+    {
+        logRequest = std::move(pendingForwards.take(inserted.id).front().logRequest);
+        throw DNSException(DNSHeader::ServerFail, query.getId(), "No free buffers to send query to Forward Server.");
+    }
+    DNSQuery upstreamQuery = query;
+    char* buffer = sendSlots[slotIndex].buffer.data();
+    const int size = upstreamQuery.write(buffer, Server::advertisedPayload());
+    buffer[0] = static_cast<char>(inserted.id >> 8);
+    buffer[1] = static_cast<char>(inserted.id & 0xFF);
+    submitSend(slotIndex, upstreamFD, nullptr, size, UpstreamSend);
+}
+
+void UringIoEngine::handleUpstreamResponse(char* packet, int size)
+{
+    if (size < DNSHeader::headerOffset)
+        return;
+    const uint16_t upstreamId = (static_cast<uint8_t>(packet[0]) << 8) | static_cast<uint8_t>(packet[1]);
+    // empty for late response to timed out query or unsolicited datagram
+    for (PendingForward& pending : pendingForwards.take(upstreamId))
+    {
+        // restore id of every client query
+        const uint16_t clientId = pending.query.getId();
+        packet[0] = static_cast<char>(clientId >> 8);
+        packet[1] = static_cast<char>(clientId & 0xFF);
+        if (pending.refresh)
+        {
+            refreshEntry(pending, packet, size);
+            continue;
+        }
+
+        const int slotIndex = acquireSendSlot();
+        char fallbackBuffer[MAX_UDP_PAYLOAD];
+        char* responseBuffer = slotIndex >= 0 ? sendSlots[slotIndex].buffer.data() : fallbackBuffer;
+        int bytesWritten = 0;
+        try
+        {
+            bytesWritten = Server::answerFromForwardResponse(pending.query, packet, size, cache, responseBuffer, *pending.logRequest);
+        } catch (DNSException& e) {
+            bytesWritten = Server::answerForwardError(e, pending.query, cache, responseBuffer, *pending.logRequest);
+        } catch (std::exception& e) {
+            const std::string logMsg(std::string("UringIoEngine Caught Unhandled Exception: ") + e.what());
+            Logger::logError(logMsg);
+            Logger::logToStdout(logMsg);
+        }
+
+        if (bytesWritten > 0)
+            sendResponse(slotIndex, responseBuffer, bytesWritten, pending.clientAddr);
+        else if (slotIndex >= 0)
+            freeSendSlots.push_back(slotIndex);
+    }
+}
+
+void UringIoEngine::refreshEntry(PendingForward& pending, const char* packet, int size) noexcept
+{
+    char responseBuffer[MAX_UDP_PAYLOAD];
+    try
+    {
+        if (!packet)
+            throw std::runtime_error("no response from Forward Server");
+        Server::answerFromForwardResponse(pending.query, packet, size, cache, responseBuffer, *pending.logRequest);
+    } catch (std::exception& e) {
+        // entry stays in cache until it expires
+        const std::string logMsg(std::string("UringIoEngine Failed to prefetch entry: ") + e.what());
+        Logger::logWarning(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
+
+void UringIoEngine::expireForwards()
+{
+    pendingForwards.expire(std::chrono::steady_clock::now(), [this](PendingForward&& pending) {
+        if (pending.refresh)
+            return refreshEntry(pending, nullptr, 0);
+        const DNSException e(DNSHeader::ServerFail, pending.query.getId(),
+                             "Failed to get response from Forward Server, consider restarting the server with another forward server.");
+        const int slotIndex = acquireSendSlot();
+        char fallbackBuffer[MAX_UDP_PAYLOAD];
+        char* responseBuffer = slotIndex >= 0 ? sendSlots[slotIndex].buffer.data() : fallbackBuffer;
+        const int bytesWritten = Server::answerForwardError(e, pending.query, cache, responseBuffer, *pending.logRequest);
+        sendResponse(slotIndex, responseBuffer, bytesWritten, pending.clientAddr);
+    });
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - lastStatsLogTime > std::chrono::seconds(FWD_STATS_LOG_INTERVAL) && pendingForwards.forwarded() != lastLoggedForwarded)
+    {
+        lastStatsLogTime = now;
+        lastLoggedForwarded = pendingForwards.forwarded();
+        const std::string logMsg("UringIoEngine forward stats: upstream queries: " + std::to_string(pendingForwards.forwarded())
+                                 + ", coalesced queries: " + std::to_string(pendingForwards.coalesced()));
+        Logger::logInfo(logMsg);
+        Logger::logToStdout(logMsg);
+    }
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "ioengine.hpp"
+#include "server.hpp"
+#include "forwarder.hpp"
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+inline constexpr unsigned URING_QUEUE_DEPTH = 1024;
+inline constexpr unsigned URING_RECV_BUFFERS = 1024;  // power of 2, size of provided buffer ring
+inline constexpr unsigned URING_SEND_SLOTS = 1024;
+
+/*
+    io_uring based I/O engine
+    Client socket and upstream socket are served with multishot recvmsg into a provided buffer ring
+    (or classic provided buffers, if the ring is not usable),
+    replies and forwarded queries are queued as sendmsg SQEs and submitted in batches with one io_uring_enter.
+    Requests are processed in the engine thread and never block it: cache misses are forwarded
+    with rewritten transaction id and continue when upstream response or timeout completes
+*/
+class UringIoEngine : public IoEngine
+{
+public:
+    // throws runtime_error if io_uring or provided buffer rings are not supported by the kernel.
+    // serve returns after stopping is set, it's checked at least every forward tick
+    UringIoEngine(int sockFD, const sockaddr_in& fwdServerAddr, DnsCache& cache, const std::atomic<bool>& stopping);
+    ~UringIoEngine() override;
+    UringIoEngine(const UringIoEngine&) = delete;
+    UringIoEngine& operator=(const UringIoEngine&) = delete;
+
+    void serve() override;
+    std::string name() const override { return "io_uring"; }
+
+private:
+    enum OpType : uint32_t
+    {
+        ClientRecv = 0,
+        UpstreamRecv,
+        ClientSend,
+        UpstreamSend,
+        Tick,
+        ProvideBuffers
+    };
+
+    struct SendSlot
+    {
+        std::array<char, MAX_UDP_PAYLOAD> buffer;
+        iovec iov;
+        msghdr msg;
+        sockaddr_in addr;
+    };
+
+    struct PendingForward
+    {
+        DNSQuery query;
+        sockaddr_in clientAddr;
+        std::unique_ptr<Server::RequestLogger> logRequest;
+        bool refresh = false;  // prefetch of entry answered from cache, response only updates the cache
+    };
+
+    // unmap rings and close descriptors
+    void release() noexcept;
+    void setupRing();
+    void setupBufferRing();
+    io_uring_sqe* getSqe();
+    void submitAndWait(unsigned waitCount);
+    void processCompletions();
+
+    void armRecv(int fd, msghdr* msg, OpType type);
+    void armTick();
+    // return buffer to the kernel after the datagram in it is processed
+    void recycleBuffer(uint16_t bufferId);
+    // classic IORING_OP_PROVIDE_BUFFERS, used when buffer ring doesn't work
+    void provideBuffers(uint16_t firstBufferId, unsigned count);
+    void switchToClassicBuffers();
+    // returns index of free send slot or -1 if all are in flight
+    int acquireSendSlot() noexcept;
+    void submitSend(int slotIndex, int fd, const sockaddr_in* addr, int size, OpType type);
+    void sendResponse(int slotIndex, char* buffer, int size, const sockaddr_in& clientAddr);
+
+    void handleRecv(const io_uring_cqe& cqe, OpType type);
+    void handleRequest(char* packet, int size, const sockaddr_in& clientAddr);
+    void handleUpstreamResponse(char* packet, int size);
+    // forward the query and keep it pending until response or timeout, the logger is taken unless it throws
+    void forward(const DNSQuery& query, const sockaddr_in& clientAddr, std::unique_ptr<Server::RequestLogger>& logRequest,
+                 bool refresh = false);
+    // update cache with response to prefetch query, or log failure if packet is nullptr
+    void refreshEntry(PendingForward& pending, const char* packet, int size) noexcept;
+    void expireForwards();
+
+    static uint64_t makeUserData(OpType type, uint32_t index) noexcept { return (static_cast<uint64_t>(type) << 32) | index; }
+
+    int sockFD;
+    int upstreamFD = -1;
+    DnsCache& cache;
+    const std::atomic<bool>& stopping;
+
+    // submission and completion rings mapping
+    int ringFD = -1;
+    void* ringPtr = nullptr;
+    size_t ringSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned sqLocalTail = 0;
+    unsigned toSubmit = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    // provided buffer ring for multishot receives
+    io_uring_buf_ring* bufRing = nullptr;
+    size_t bufRingSize = 0;
+    std::vector<char> bufferMemory;
+    unsigned bufferSize = 0;
+    uint16_t bufTail = 0;
+    bool bufferRingUsed = false;
+    bool classicBuffers = false;
+
+    msghdr clientRecvMsg{};
+    msghdr upstreamRecvMsg{};
+    __kernel_timespec tickTimeout{};
+
+    std::vector<SendSlot> sendSlots;
+    std::vector<int> freeSendSlots;
+    ForwardTable<PendingForward> pendingForwards;
+    std::chrono::steady_clock::time_point lastStatsLogTime;
+    uint64_t lastLoggedForwarded = 0;
+};
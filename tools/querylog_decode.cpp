@@ -0,0 +1,247 @@
+// Decoder of binary query log written with --query-log, prints records or their summary
+// Usage: querylog_decode [--summary] [--top=N] file...
+
+#include "querylog.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace
+{
+
+inline constexpr size_t DEFAULT_TOP = 10;
+
+std::string typeName(uint16_t qType)
+{
+    static const std::map<uint16_t, std::string> names = {
+        {1, "A"}, {2, "NS"}, {5, "CNAME"}, {6, "SOA"}, {12, "PTR"}, {15, "MX"}, {16, "TXT"}, {28, "AAAA"},
+        {33, "SRV"}, {35, "NAPTR"}, {43, "DS"}, {46, "RRSIG"}, {48, "DNSKEY"}, {64, "SVCB"}, {65, "HTTPS"}, {255, "ANY"}
+    };
+    auto it = names.find(qType);
+    return it != names.end() ? it->second : "TYPE" + std::to_string(qType);
+}
+
+std::string rCodeName(uint8_t rCode)
+{
+    static const std::map<uint8_t, std::string> names = {
+        {0, "NOERROR"}, {1, "FORMERR"}, {2, "SERVFAIL"}, {3, "NXDOMAIN"}, {4, "NOTIMP"}, {5, "REFUSED"}, {16, "BADVERS"}
+    };
+    auto it = names.find(rCode);
+    return it != names.end() ? it->second : "RCODE" + std::to_string(rCode);
+}
+
+std::string clientName(const QueryLogRecord& record)
+{
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, record.clientAddr, addr, INET_ADDRSTRLEN);
+    return std::string(addr) + ':' + std::to_string(record.clientPort);
+}
+
+std::string timeStr(uint64_t timestamp)
+{
+    const time_t seconds = static_cast<time_t>(timestamp / 1000000);
+    std::tm tm;
+    gmtime_r(&seconds, &tm);
+    char buffer[std::size("yyyy-mm-ddThh:mm:ss")];
+    std::strftime(buffer, sizeof (buffer), "%FT%T", &tm);
+    char result[64];
+    std::snprintf(result, sizeof (result), "%s.%06uZ", buffer, static_cast<unsigned>(timestamp % 1000000));
+    return result;
+}
+
+void printRecord(const QueryLogRecord& record)
+{
+    std::string name(record.name());
+    if (record.flags & QUERY_LOG_NAME_TRUNCATED)
+        name += "...";
+    const char* source = record.flags & QUERY_LOG_STALE ? "stale" : record.flags & QUERY_LOG_CACHE_HIT ? "hit" : "miss";
+    std::printf("%s %s %s %s %s %s %s rtt=%uus latency=%uus%s\n", timeStr(record.timestamp).c_str(), clientName(record).c_str(),
+                record.flags & QUERY_LOG_TCP ? "tcp" : "udp", name.empty() ? "." : name.c_str(), typeName(record.qType).c_str(),
+                record.flags & QUERY_LOG_ANSWERED ? rCodeName(record.rCode).c_str() : "-", source, record.upstreamRtt,
+                record.latency, record.flags & QUERY_LOG_ANSWERED ? "" : " unanswered");
+}
+
+/// aggregated counters of every decoded record
+class Summary
+{
+public:
+    void add(const QueryLogRecord& record)
+    {
+        ++total;
+        first = std::min(first, record.timestamp);
+        last = std::max(last, record.timestamp);
+        if (record.flags & QUERY_LOG_CACHE_HIT)
+            ++hits;
+        if (record.flags & QUERY_LOG_STALE)
+            ++stale;
+        if (record.flags & QUERY_LOG_TCP)
+            ++tcp;
+        if (!(record.flags & QUERY_LOG_ANSWERED))
+            ++unanswered;
+        else
+        {
+            ++rCodes[rCodeName(record.rCode)];
+            latencies.push_back(record.latency);
+        }
+        if (record.flags & QUERY_LOG_FORWARDED)
+        {
+            ++forwarded;
+            if (record.upstreamRtt != 0)
+                rtts.push_back(record.upstreamRtt);
+        }
+        ++qTypes[typeName(record.qType)];
+        ++names[std::string(record.name())];
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, record.clientAddr, addr, INET_ADDRSTRLEN);
+        ++clients[addr];
+    }
+
+    void print(size_t top)
+    {
+        const double span = total ? (last - first) / 1e6 : 0.0;
+        std::printf("queries: %llu, from %s to %s, %.1f queries/s\n", static_cast<unsigned long long>(total),
+                    total ? timeStr(first).c_str() : "-", total ? timeStr(last).c_str() : "-", span > 0 ? total / span : 0.0);
+        std::printf("cache hits: %llu (%.1f%%), forwarded: %llu, stale answers: %llu, tcp: %llu, unanswered: %llu\n",
+                    static_cast<unsigned long long>(hits), total ? 100.0 * hits / total : 0.0, static_cast<unsigned long long>(forwarded),
+                    static_cast<unsigned long long>(stale), static_cast<unsigned long long>(tcp), static_cast<unsigned long long>(unanswered));
+        printPercentiles("latency", latencies);
+        printPercentiles("upstream rtt", rtts);
+        printCounts("rcodes", rCodes, rCodes.size());
+        printCounts("qtypes", qTypes, top);
+        printCounts("top names", names, top);
+        printCounts("top clients", clients, top);
+    }
+
+private:
+    static void printPercentiles(const char* title, std::vector<uint32_t>& values)
+    {
+        if (values.empty())
+            return;
+        std::sort(values.begin(), values.end());
+        auto at = [&values](double share) { return values[std::min(values.size() - 1, static_cast<size_t>(share * values.size()))]; };
+        std::printf("%s us: p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", title, at(0.5), at(0.9), at(0.99), at(0.999), values.back());
+    }
+
+    static void printCounts(const char* title, const std::unordered_map<std::string, uint64_t>& counts, size_t top)
+    {
+        std::vector<std::pair<std::string, uint64_t>> sorted(counts.begin(), counts.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+        });
+        std::printf("%s:\n", title);
+        for (size_t i = 0; i < sorted.size() && i < top; ++i)
+            std::printf("  %-40s %llu\n", sorted[i].first.empty() ? "." : sorted[i].first.c_str(), static_cast<unsigned long long>(sorted[i].second));
+    }
+
+    uint64_t total = 0;
+    uint64_t hits = 0;
+    uint64_t forwarded = 0;
+    uint64_t stale = 0;
+    uint64_t tcp = 0;
+    uint64_t unanswered = 0;
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    std::vector<uint32_t> latencies;
+    std::vector<uint32_t> rtts;
+    std::unordered_map<std::string, uint64_t> rCodes;
+    std::unordered_map<std::string, uint64_t> qTypes;
+    std::unordered_map<std::string, uint64_t> names;
+    std::unordered_map<std::string, uint64_t> clients;
+};
+
+// read chunks of the file, returns number of records, stops at the first broken chunk
+template<typename Handler>
+uint64_t decodeFile(const std::string& path, Handler&& handle)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Failed to open " + path);
+    uint64_t records = 0;
+    char header[QUERY_LOG_CHUNK_HEADER_SIZE];
+    std::vector<char> payload;
+    while (file.read(header, sizeof (header)))
+    {
+        const char* pos = header;
+        const uint32_t magic = static_cast<uint32_t>(QueryLogRecord::getValue(pos, 4));
+        const uint16_t version = static_cast<uint16_t>(QueryLogRecord::getValue(pos, 2));
+        const uint16_t recordSize = static_cast<uint16_t>(QueryLogRecord::getValue(pos, 2));
+        const uint32_t count = static_cast<uint32_t>(QueryLogRecord::getValue(pos, 4));
+        // newer versions may only append fields to the record, writer never frames more records in a chunk
+        if (magic != QUERY_LOG_MAGIC || version < QUERY_LOG_VERSION || recordSize < QUERY_LOG_RECORD_SIZE
+            || count > QUERY_LOG_CHUNK_RECORDS)
+        {
+            std::fprintf(stderr, "%s: broken chunk after %llu records, the rest is skipped\n", path.c_str(), static_cast<unsigned long long>(records));
+            break;
+        }
+        payload.resize(static_cast<size_t>(count) * recordSize);
+        if (!file.read(payload.data(), payload.size()))
+        {
+            std::fprintf(stderr, "%s: truncated chunk after %llu records\n", path.c_str(), static_cast<unsigned long long>(records));
+            break;
+        }
+        for (uint32_t i = 0; i < count; ++i)
+            handle(QueryLogRecord::decode(payload.data() + static_cast<size_t>(i) * recordSize));
+        records += count;
+    }
+    return records;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+    const std::string usage("Usage: querylog_decode [--summary] [--top=N] file...\n"
+                            "  --summary  print aggregated counters and latency percentiles instead of records\n"
+                            "  --top=N    names, clients and types shown in summary (default 10)\n");
+    bool summaryOnly = false;
+    size_t top = DEFAULT_TOP;
+    std::vector<std::string> files;
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg(argv[i]);
+            if (arg == "--summary")
+                summaryOnly = true;
+            else if (arg.rfind("--top=", 0) == 0)
+                top = std::stoul(arg.substr(6));
+            else if (arg.rfind("--", 0) == 0)
+                throw std::runtime_error("Unknown option: " + arg);
+            else
+                files.push_back(arg);
+        }
+        if (files.empty())
+            throw std::runtime_error("File missing");
+    } catch (std::exception& e) {
+        std::fprintf(stderr, "Invalid arguments. %s\n%s", e.what(), usage.c_str());
+        return 1;
+    }
+
+    Summary summary;
+    try
+    {
+        for (const std::string& path : files)
+        {
+            if (summaryOnly)
+                decodeFile(path, [&summary](const QueryLogRecord& record) { summary.add(record); });
+            else
+                decodeFile(path, printRecord);
+        }
+    } catch (std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    if (summaryOnly)
+        summary.print(top);
+    return 0;
+}